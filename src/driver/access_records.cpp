@@ -0,0 +1,346 @@
+#include "std_include.hpp"
+#include "access_records.hpp"
+#include "event_ring_set.hpp"
+#include "finally.hpp"
+#include "logging.hpp"
+
+namespace
+{
+	constexpr uint64_t slot_count = 4096;
+	constexpr uint64_t filter_size = 1024;
+
+	// A slot is published by storing its sequence last, zero marks a slot that is being written
+	struct record_slot
+	{
+		volatile LONG64 sequence;
+		uint64_t rip;
+	};
+
+	record_slot slots[slot_count]{};
+	volatile LONG64 last_sequence{0};
+
+	// Direct-mapped and racy on purpose, a missed duplicate only costs one extra record
+	volatile uint64_t recent_rips[filter_size]{};
+
+	uint64_t get_filter_index(const uint64_t rip)
+	{
+		return ((rip >> 4) ^ (rip >> 16)) % filter_size;
+	}
+
+	// Open addressing, slots are claimed once and never released. Zero marks a free slot.
+	constexpr size_t max_retained_probes = 32;
+	volatile LONG64 retained_rips[access_records::max_retained_rips]{};
+
+	void retain_rip(const uint64_t rip)
+	{
+		const auto start = get_filter_index(rip) % access_records::max_retained_rips;
+
+		for (size_t i = 0; i < max_retained_probes; ++i)
+		{
+			auto& slot = retained_rips[(start + i) % access_records::max_retained_rips];
+
+			const auto previous = InterlockedCompareExchange64(&slot, static_cast<LONG64>(rip), 0);
+			if (previous == 0 || static_cast<uint64_t>(previous) == rip)
+			{
+				return;
+			}
+		}
+	}
+
+	uint64_t get_oldest_available(const uint64_t newest)
+	{
+		return newest >= slot_count ? newest - slot_count + 1 : 1;
+	}
+
+	constexpr size_t ring_size = 64_kb;
+	constexpr uint32_t default_interval_ms = 10;
+	constexpr uint32_t max_interval_ms = 1000;
+
+	event_ring_set rings{};
+
+	// Only touched by the notification DPC and while the mapping lock is held
+	struct ring_notification
+	{
+		uint64_t observed_head;
+		uint64_t signalled_head;
+		bool waiting;
+	};
+
+	ring_notification notifications[max_event_rings]{};
+
+	KTIMER notification_timer{};
+	KDPC notification_dpc{};
+	EX_RUNDOWN_REF notification_rundown{};
+	PKEVENT notification_event{nullptr};
+	uint64_t notification_watermark{0};
+
+	void push_event(const uint64_t sequence, const uint64_t rip)
+	{
+		access_event event{};
+		event.record_sequence = sequence;
+		event.rip = rip;
+		event.tsc = __rdtsc();
+
+		rings.push(event);
+	}
+
+	_Function_class_(KDEFERRED_ROUTINE)
+
+	void NTAPI notify_consumer(struct _KDPC* /*Dpc*/,
+	                           const PVOID /*param*/,
+	                           const PVOID /*arg1*/,
+	                           const PVOID /*arg2*/)
+	{
+		if (!ExAcquireRundownProtection(&notification_rundown))
+		{
+			return;
+		}
+
+		const auto _ = utils::finally([]
+		{
+			ExReleaseRundownProtection(&notification_rundown);
+		});
+
+		bool signal = false;
+		for (uint32_t i = 0; i < rings.get_ring_count(); ++i)
+		{
+			auto& notification = notifications[i];
+			notification.observed_head = rings.get_ring(i).head;
+
+			// Entries below the watermark are signalled on the tick after they were first seen
+			const auto pending = notification.observed_head - notification.signalled_head;
+			signal |= pending >= notification_watermark || (pending && notification.waiting);
+			notification.waiting = pending != 0;
+		}
+
+		if (!signal)
+		{
+			return;
+		}
+
+		for (uint32_t i = 0; i < rings.get_ring_count(); ++i)
+		{
+			auto& notification = notifications[i];
+			notification.signalled_head = notification.observed_head;
+			notification.waiting = false;
+		}
+
+		KeSetEvent(notification_event, IO_NO_INCREMENT, FALSE);
+	}
+
+	void start_notifications(const PKEVENT event, const access_event_mapping_request& request)
+	{
+		const auto capacity = rings.get_ring_count() ? rings.get_ring(0).capacity : 1;
+		notification_watermark = request.watermark
+			                         ? min(static_cast<uint64_t>(request.watermark), capacity)
+			                         : max(capacity / 2, 1ull);
+
+		const auto interval_ms = request.interval_ms ? min(request.interval_ms, max_interval_ms) : default_interval_ms;
+
+		for (uint32_t i = 0; i < rings.get_ring_count(); ++i)
+		{
+			auto& notification = notifications[i];
+			notification.signalled_head = rings.get_ring(i).head;
+			notification.observed_head = notification.signalled_head;
+			notification.waiting = false;
+		}
+
+		notification_event = event;
+		ExReInitializeRundownProtection(&notification_rundown);
+
+		LARGE_INTEGER due_time{};
+		due_time.QuadPart = -static_cast<LONGLONG>(interval_ms) * 10'000;
+		KeSetTimerEx(&notification_timer, due_time, static_cast<LONG>(interval_ms), &notification_dpc);
+	}
+
+	void stop_notifications()
+	{
+		if (!notification_event)
+		{
+			return;
+		}
+
+		KeCancelTimer(&notification_timer);
+
+		// A DPC that is already running may still signal the event
+		ExWaitForRundownProtectionRelease(&notification_rundown);
+
+		ObDereferenceObject(notification_event);
+		notification_event = nullptr;
+	}
+
+	void allocate_rings()
+	{
+		KeInitializeTimer(&notification_timer);
+		KeInitializeDpc(&notification_dpc, notify_consumer, nullptr);
+
+		// Starts out run down, every mapping re-arms it
+		ExInitializeRundownProtection(&notification_rundown);
+		ExWaitForRundownProtectionRelease(&notification_rundown);
+
+		rings.allocate<access_event>(ring_size);
+	}
+}
+
+namespace access_records
+{
+	void record(const uint64_t rip)
+	{
+		auto& recent_rip = recent_rips[get_filter_index(rip)];
+		if (recent_rip == rip)
+		{
+			return;
+		}
+
+		recent_rip = rip;
+
+		// A filtered RIP passed the filter before, so it is retained already
+		retain_rip(rip);
+
+		const auto sequence = InterlockedIncrement64(&last_sequence);
+		auto& slot = slots[static_cast<uint64_t>(sequence) % slot_count];
+
+		InterlockedExchange64(&slot.sequence, 0);
+		slot.rip = rip;
+		InterlockedExchange64(&slot.sequence, sequence);
+
+		push_event(static_cast<uint64_t>(sequence), rip);
+	}
+
+	size_t read(uint64_t& cursor, access_record* records, const size_t max_count, uint64_t& lost_count)
+	{
+		const auto newest = static_cast<uint64_t>(ReadAcquire64(&last_sequence));
+
+		auto sequence = cursor + 1;
+		const auto oldest = get_oldest_available(newest);
+		if (sequence < oldest)
+		{
+			lost_count += oldest - sequence;
+			sequence = oldest;
+		}
+
+		size_t count = 0;
+		for (; sequence <= newest && count < max_count; ++sequence)
+		{
+			const auto& slot = slots[sequence % slot_count];
+
+			const auto published = static_cast<uint64_t>(ReadAcquire64(&slot.sequence));
+			const auto rip = slot.rip;
+			const auto confirmed = static_cast<uint64_t>(ReadAcquire64(&slot.sequence));
+
+			if (published == sequence && confirmed == sequence)
+			{
+				records[count].sequence = sequence;
+				records[count].rip = rip;
+				++count;
+				continue;
+			}
+
+			// A writer that wrapped around took the slot, otherwise this record is still being written
+			if (static_cast<uint64_t>(ReadAcquire64(&last_sequence)) >= sequence + slot_count)
+			{
+				++lost_count;
+				continue;
+			}
+
+			break;
+		}
+
+		cursor = sequence - 1;
+		return count;
+	}
+
+	size_t read_retained_rips(uint64_t* rips, const size_t max_count)
+	{
+		size_t count = 0;
+
+		for (size_t i = 0; i < max_retained_rips && count < max_count; ++i)
+		{
+			const auto rip = static_cast<uint64_t>(ReadAcquire64(&retained_rips[i]));
+			if (rip)
+			{
+				rips[count++] = rip;
+			}
+		}
+
+		return count;
+	}
+
+	access_event_mapping map_into_current_process(const access_event_mapping_request& request)
+	{
+		event_ring_set::scoped_lock _{rings};
+
+		if (rings.is_mapped())
+		{
+			throw std::runtime_error("Access events are already mapped");
+		}
+
+		PKEVENT event{};
+		const auto status = ObReferenceObjectByHandle(reinterpret_cast<HANDLE>(request.event_handle),
+		                                              EVENT_MODIFY_STATE, *ExEventObjectType, UserMode,
+		                                              reinterpret_cast<PVOID*>(&event), nullptr);
+		if (!NT_SUCCESS(status))
+		{
+			throw std::runtime_error("Invalid access event handle");
+		}
+
+		auto destructor = utils::finally([event]
+		{
+			ObDereferenceObject(event);
+		});
+
+		access_event_mapping mapping{};
+		mapping.ring_count = rings.get_ring_count();
+		mapping.ring_size = rings.get_ring_size();
+		rings.map_into_current_process(mapping.rings);
+
+		destructor.cancel();
+
+		start_notifications(event, request);
+		return mapping;
+	}
+
+	bool unmap_from_process(const process_id process)
+	{
+		event_ring_set::scoped_lock _{rings};
+
+		if (!rings.is_mapped_by(process))
+		{
+			return false;
+		}
+
+		stop_notifications();
+		rings.unmap();
+
+		return true;
+	}
+
+	scoped_rings::scoped_rings()
+	{
+		auto destructor = utils::finally([]
+		{
+			rings.free();
+		});
+
+		allocate_rings();
+		destructor.cancel();
+	}
+
+	scoped_rings::~scoped_rings()
+	{
+		try
+		{
+			event_ring_set::scoped_lock _{rings};
+			stop_notifications();
+			rings.unmap();
+		}
+		catch (...)
+		{
+			debug_log("Failed to unmap access event rings\n");
+		}
+
+		// The timer is cancelled, but its DPC may still be queued
+		KeFlushQueuedDpcs();
+		rings.free();
+	}
+}
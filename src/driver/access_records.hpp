@@ -0,0 +1,41 @@
+#pragma once
+
+struct access_record;
+struct access_event_mapping;
+struct access_event_mapping_request;
+
+namespace access_records
+{
+	constexpr size_t max_retained_rips = 1024;
+
+	// Safe to call from VMX root mode. Repeated accesses from one RIP are filtered out.
+	void record(uint64_t rip);
+
+	// The first distinct RIPs are kept for the legacy interface, independent of the record slots.
+	// Copies them in no particular order and returns their count.
+	size_t read_retained_rips(uint64_t* rips, size_t max_count);
+
+	// Copies the records that follow the cursor and advances it past them.
+	// Records that were overwritten before they could be read are added to lost_count.
+	size_t read(uint64_t& cursor, access_record* records, size_t max_count, uint64_t& lost_count);
+
+	// Must run in the context of the process that owns the event handle
+	_IRQL_requires_max_(APC_LEVEL)
+	access_event_mapping map_into_current_process(const access_event_mapping_request& request);
+
+	_IRQL_requires_max_(APC_LEVEL)
+	bool unmap_from_process(process_id process);
+
+	class scoped_rings
+	{
+	public:
+		scoped_rings();
+		~scoped_rings();
+
+		scoped_rings(scoped_rings&& obj) noexcept = delete;
+		scoped_rings& operator=(scoped_rings&& obj) noexcept = delete;
+
+		scoped_rings(const scoped_rings& obj) = delete;
+		scoped_rings& operator=(const scoped_rings& obj) = delete;
+	};
+}
@@ -30,6 +30,16 @@ LEAF_ENTRY __invept, _TEXT$00
     ret
 LEAF_END __invept, _TEXT$00
 
+; -----------------------------------------------------
+
+LEAF_ENTRY __cpuid_hypercall, _TEXT$00
+    mov r9, rbx
+    mov rax, 41414141h
+    cpuid
+    mov rbx, r9
+    ret
+LEAF_END __cpuid_hypercall, _TEXT$00
+
 ; -----------------------------------------------------
     
 LEAF_ENTRY restore_context, _TEXT$00
@@ -79,8 +89,8 @@ LEAF_END restore_context, _TEXT$00
 ; -----------------------------------------------------
 
 extern vm_exit_handler:proc
+extern vm_resume_failed:proc
 extern vm_launch_handler:proc
-extern RtlCaptureContext:proc
 
 ; -----------------------------------------------------
 
@@ -92,26 +102,93 @@ vm_launch ENDP
 
 ; -----------------------------------------------------
 
-vm_exit PROC
-    ; Load CONTEXT pointer
-    push    rcx
-    lea     rcx, [rsp+8h]
-
-    sub rsp, 30h ; Home-space
-    call RtlCaptureContext
-    add rsp, 30h
+; The host stack pointer points at a CONTEXT at the top of the host stack.
+; Only the GPRs, the volatile vector registers and MXCSR are saved here.
+; XMM6-15 are callee-saved under the Win64 ABI, so the C++ handlers preserve
+; the guest values and none of them reads or writes them in the CONTEXT.
+; They are only stored when leaving VMX, which restores the full CONTEXT.
 
-    mov rcx, [rsp+CxRsp+8h]
-    add rcx, 8h  ; Fixup push rcx
-    add rcx, 30h ; Fixup home-space
-    mov [rsp+CxRsp+8h], rcx
-
-    pop rcx
-    mov [rsp+CxRcx], rcx
-
-    mov rcx, rsp
-    sub rsp, 30h
-    jmp vm_exit_handler
+vm_exit PROC
+    mov     CxRax[rsp], rax
+    mov     CxRcx[rsp], rcx
+    mov     CxRdx[rsp], rdx
+    mov     CxRbx[rsp], rbx
+    mov     CxRbp[rsp], rbp
+    mov     CxRsi[rsp], rsi
+    mov     CxRdi[rsp], rdi
+    mov     CxR8[rsp], r8
+    mov     CxR9[rsp], r9
+    mov     CxR10[rsp], r10
+    mov     CxR11[rsp], r11
+    mov     CxR12[rsp], r12
+    mov     CxR13[rsp], r13
+    mov     CxR14[rsp], r14
+    mov     CxR15[rsp], r15
+
+    movaps  CxXmm0[rsp], xmm0
+    movaps  CxXmm1[rsp], xmm1
+    movaps  CxXmm2[rsp], xmm2
+    movaps  CxXmm3[rsp], xmm3
+    movaps  CxXmm4[rsp], xmm4
+    movaps  CxXmm5[rsp], xmm5
+    stmxcsr CxMxCsr[rsp]
+
+    rdtsc
+    shl     rdx, 32
+    or      rax, rdx
+    mov     rdx, rax
+    mov     rcx, rsp
+
+    sub     rsp, 20h
+    call    vm_exit_handler
+    add     rsp, 20h
+
+    test    al, al
+    jnz     leave_vmx
+
+    movaps  xmm0, CxXmm0[rsp]
+    movaps  xmm1, CxXmm1[rsp]
+    movaps  xmm2, CxXmm2[rsp]
+    movaps  xmm3, CxXmm3[rsp]
+    movaps  xmm4, CxXmm4[rsp]
+    movaps  xmm5, CxXmm5[rsp]
+    ldmxcsr CxMxCsr[rsp]
+
+    mov     rax, CxRax[rsp]
+    mov     rcx, CxRcx[rsp]
+    mov     rdx, CxRdx[rsp]
+    mov     rbx, CxRbx[rsp]
+    mov     rbp, CxRbp[rsp]
+    mov     rsi, CxRsi[rsp]
+    mov     rdi, CxRdi[rsp]
+    mov     r8, CxR8[rsp]
+    mov     r9, CxR9[rsp]
+    mov     r10, CxR10[rsp]
+    mov     r11, CxR11[rsp]
+    mov     r12, CxR12[rsp]
+    mov     r13, CxR13[rsp]
+    mov     r14, CxR14[rsp]
+    mov     r15, CxR15[rsp]
+
+    vmresume
+
+    sub     rsp, 20h
+    call    vm_resume_failed
+
+leave_vmx:
+    movaps  CxXmm6[rsp], xmm6
+    movaps  CxXmm7[rsp], xmm7
+    movaps  CxXmm8[rsp], xmm8
+    movaps  CxXmm9[rsp], xmm9
+    movaps  CxXmm10[rsp], xmm10
+    movaps  CxXmm11[rsp], xmm11
+    movaps  CxXmm12[rsp], xmm12
+    movaps  CxXmm13[rsp], xmm13
+    movaps  CxXmm14[rsp], xmm14
+    movaps  CxXmm15[rsp], xmm15
+
+    mov     rcx, rsp
+    jmp     restore_context
 vm_exit ENDP
 
 end
@@ -11,6 +11,9 @@ void _sgdt(void*);
 
 void __invept(size_t type, invept_descriptor* descriptor);
 
+// CPUID with the hypervisor magic in RAX, the command in RCX and its argument in RDX
+void __cpuid_hypercall(uint64_t command, const void* argument);
+
 [[ noreturn ]] void vm_launch();
 [[ noreturn ]] void vm_exit();
 [[ noreturn ]] void restore_context(CONTEXT* context);
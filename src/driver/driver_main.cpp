@@ -7,6 +7,12 @@
 #include "globals.hpp"
 #include "process.hpp"
 #include "process_callback.hpp"
+#include "processor_callback.hpp"
+#include "syscall_filter.hpp"
+#include "syscall_events.hpp"
+#include "access_records.hpp"
+#include "hypercall.hpp"
+#include "worker_pool.hpp"
 
 #define DOS_DEV_NAME L"\\DosDevices\\HyperHook"
 #define DEV_NAME L"\\Device\\HyperHook"
@@ -24,6 +30,10 @@ public:
 			  {
 				  this->process_notification(parent_id, process_id, type);
 			  }),
+		  processor_callback_([this](const uint32_t processor_index)
+		  {
+			  this->processor_notification(processor_index);
+		  }),
 		  irp_(driver_object, DEV_NAME, DOS_DEV_NAME)
 	{
 		debug_log("Driver started\n");
@@ -46,9 +56,15 @@ public:
 
 private:
 	bool hypervisor_was_enabled_{false};
+	syscall_events::scoped_rings syscall_event_rings_{};
+	access_records::scoped_rings access_event_rings_{};
+	hypercall::scoped_sessions hypercall_sessions_{};
 	hypervisor hypervisor_{};
+	// Torn down before the hypervisor, pended requests still use it
+	worker_pool::scoped_pool worker_pool_{};
 	sleep_callback sleep_callback_{};
 	process_callback::scoped_process_callback process_callback_{};
+	processor_callback processor_callback_{};
 	irp irp_{};
 
 	void sleep_notification(const sleep_callback::type type)
@@ -67,10 +83,21 @@ private:
 		}
 	}
 
+	void processor_notification(const uint32_t processor_index)
+	{
+		if (this->hypervisor_.is_enabled())
+		{
+			debug_log("Processor %u was added\n", processor_index);
+			(void)this->hypervisor_.enable_processor(processor_index);
+		}
+	}
+
 	void process_notification(process_id /*parent_id*/, const process_id process_id, const process_callback::type type)
 	{
 		if (type == process_callback::type::destroy)
 		{
+			syscall_filter::remove_target(process_id);
+
 			if (this->hypervisor_.cleanup_process(process_id))
 			{
 				const auto proc = process::find_process_by_id(process_id);
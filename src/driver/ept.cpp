@@ -5,6 +5,8 @@
 #include "finally.hpp"
 #include "logging.hpp"
 #include "memory.hpp"
+#include "host_memory.hpp"
+#include "access_records.hpp"
 #include "vmx.hpp"
 
 namespace vmx
@@ -65,26 +67,150 @@ namespace vmx
 			return candidate_memory_type;
 		}
 
-		void update_fake_page(ept_hook& hook)
+		// Root mode only, the original page is read through the host direct map
+		bool update_fake_page(ept_hook& hook)
 		{
-			if (!hook.mapped_virtual_address)
+			const auto* original_page = host_memory::get_direct_map_address(hook.physical_base_address, PAGE_SIZE);
+			if (!original_page)
 			{
-				return;
+				return false;
 			}
 
-			uint8_t page_copy[PAGE_SIZE];
-			memcpy(page_copy, hook.mapped_virtual_address, PAGE_SIZE);
+			bool changed = false;
 
 			for (size_t i = 0; i < PAGE_SIZE; ++i)
 			{
-				if (hook.diff_page[i] != page_copy[i])
+				const auto value = original_page[i];
+				if (hook.diff_page[i] != value)
 				{
-					hook.diff_page[i] = page_copy[i];
-					hook.fake_page[i] = page_copy[i];
+					hook.diff_page[i] = value;
+					hook.fake_page[i] = value;
+					changed = true;
+				}
+			}
+
+			return changed;
+		}
+
+		// Bytes that another patch still covers keep their current content
+		void restore_patch_bytes(ept_hook& hook, const ept_patch& removed_patch)
+		{
+			const auto end = removed_patch.offset + removed_patch.length;
+			for (auto i = removed_patch.offset; i < end; ++i)
+			{
+				bool covered = false;
+				for (const auto& patch : hook.patches)
+				{
+					if (i >= patch.offset && i < patch.offset + patch.length)
+					{
+						covered = true;
+						break;
+					}
+				}
+
+				if (!covered)
+				{
+					hook.fake_page[i] = hook.diff_page[i];
 				}
 			}
 		}
 
+		bool uses_handle(const ept_hook& hook, const uint64_t handle)
+		{
+			for (const auto& patch : hook.patches)
+			{
+				if (patch.handle == handle)
+				{
+					return true;
+				}
+			}
+
+			return false;
+		}
+
+		bool is_patched_by(const ept_hook& hook, const uint64_t handle, const uint64_t offset)
+		{
+			for (const auto& patch : hook.patches)
+			{
+				if (patch.handle == handle && offset >= patch.offset && offset < patch.offset + patch.length)
+				{
+					return true;
+				}
+			}
+
+			return false;
+		}
+
+		uint8_t* get_inactive_fake_page(ept_hook& hook)
+		{
+			return hook.fake_page == hook.fake_pages[0] ? hook.fake_pages[1] : hook.fake_pages[0];
+		}
+
+		pml1 get_execute_entry(const ept_hook& hook, const uint8_t* page)
+		{
+			auto entry = hook.execute_entry;
+			entry.page_frame_number = memory::get_physical_address(const_cast<uint8_t*>(page)) / PAGE_SIZE;
+
+			return entry;
+		}
+
+		// The previous page stays intact, so cores with a stale translation keep executing consistent code
+		void swap_fake_page(ept_hook& hook, uint8_t* next_page)
+		{
+			const auto previous_entry = hook.execute_entry;
+			const auto next_entry = get_execute_entry(hook, next_page);
+
+			InterlockedExchange64(reinterpret_cast<volatile LONG64*>(&hook.execute_entry.flags),
+			                      static_cast<LONG64>(next_entry.flags));
+			hook.fake_page = next_page;
+
+			// Pages that are currently mapped for data pick up the new entry on their next execution
+			InterlockedCompareExchange64(reinterpret_cast<volatile LONG64*>(&hook.target_page->flags),
+			                             static_cast<LONG64>(next_entry.flags),
+			                             static_cast<LONG64>(previous_entry.flags));
+		}
+
+		// The store is interlocked, so the entry is re-read after it is visible. An update that swapped the entry
+		// in between either replaces the stored one through its compare exchange, or the loop stores it here.
+		void install_execute_entry(const ept_hook& hook)
+		{
+			const auto* execute_flags = reinterpret_cast<const volatile LONG64*>(&hook.execute_entry.flags);
+
+			auto flags = *execute_flags;
+			while (true)
+			{
+				InterlockedExchange64(reinterpret_cast<volatile LONG64*>(&hook.target_page->flags), flags);
+
+				const auto current_flags = *execute_flags;
+				if (current_flags == flags)
+				{
+					break;
+				}
+
+				flags = current_flags;
+			}
+		}
+
+		void record_hit(ept_hit_counts& hits, const bool execute)
+		{
+			InterlockedIncrement64(execute ? &hits.execute_transitions : &hits.data_transitions);
+			InterlockedExchange64(&hits.last_hit_tsc, static_cast<LONG64>(__rdtsc()));
+		}
+
+		void copy_hit_counts(const ept_hit_counts& hits, ept_entry_info& entry)
+		{
+			entry.execute_transitions = static_cast<uint64_t>(hits.execute_transitions);
+			entry.data_transitions = static_cast<uint64_t>(hits.data_transitions);
+			entry.last_hit_tsc = static_cast<uint64_t>(hits.last_hit_tsc);
+		}
+
+		void accumulate_hit_counts(const ept_hit_counts& hits, ept_entry_info& entry)
+		{
+			entry.execute_transitions += static_cast<uint64_t>(hits.execute_transitions);
+			entry.data_transitions += static_cast<uint64_t>(hits.data_transitions);
+			entry.last_hit_tsc = max(entry.last_hit_tsc, static_cast<uint64_t>(hits.last_hit_tsc));
+		}
+
 		void reset_all_watch_point_pages(utils::list<ept_code_watch_point>& watch_points)
 		{
 			for (const auto& watch_point : watch_points)
@@ -99,24 +225,39 @@ namespace vmx
 		}
 	}
 
-	ept_hook::ept_hook(const uint64_t physical_base)
-		: physical_base_address(physical_base)
-		  , mapped_virtual_address(memory::map_physical_memory(physical_base_address, PAGE_SIZE))
+	bool ept_patch_filter::matches(const ept_patch& patch) const
 	{
-		if (!mapped_virtual_address)
+		switch (this->type)
 		{
-			throw std::runtime_error("Failed to map physical memory");
+		case ept_patch_filter_type::handles:
+			for (size_t i = 0; i < this->handle_count; ++i)
+			{
+				if (this->handles[i] == patch.handle)
+				{
+					return true;
+				}
+			}
+
+			return false;
+		case ept_patch_filter_type::range:
+			return (!this->process || patch.target_pid == this->process)
+				&& patch.virtual_address < this->range_end
+				&& patch.virtual_address + patch.length > this->range_start;
+		case ept_patch_filter_type::process:
+			return patch.source_pid == this->process || patch.target_pid == this->process;
+		default:
+			return false;
 		}
 	}
 
+	ept_hook::ept_hook(const uint64_t physical_base)
+		: physical_base_address(physical_base)
+	{
+	}
+
 	ept_hook::~ept_hook()
 	{
 		this->target_page->flags = this->original_entry.flags;
-
-		if (mapped_virtual_address)
-		{
-			memory::unmap_physical_memory(mapped_virtual_address, PAGE_SIZE);
-		}
 	}
 
 	ept::ept()
@@ -126,8 +267,6 @@ namespace vmx
 		memset(this->epml4, 0, sizeof(this->epml4));
 		memset(this->epdpt, 0, sizeof(this->epdpt));
 		memset(this->epde, 0, sizeof(this->epde));
-
-		memset(this->access_records, 0, sizeof(this->access_records));
 	}
 
 	ept::~ept()
@@ -135,8 +274,8 @@ namespace vmx
 		this->disable_all_hooks();
 	}
 
-	void ept::install_page_hook(void* destination, const void* source, const size_t length, const process_id source_pid,
-	                            const process_id target_pid,
+	void ept::install_page_hook(void* destination, const void* source, const size_t length, const uint64_t handle,
+	                            const process_id source_pid, const process_id target_pid,
 	                            const ept_translation_hint* translation_hint)
 	{
 		auto* hook = this->get_or_create_ept_hook(destination, translation_hint);
@@ -144,27 +283,133 @@ namespace vmx
 		hook->target_pid = target_pid;
 
 		const auto page_offset = ADDRMASK_EPT_PML1_OFFSET(reinterpret_cast<uint64_t>(destination));
+
+		auto& patch = hook->patches.emplace_back();
+		patch.handle = handle;
+		patch.virtual_address = reinterpret_cast<uint64_t>(destination);
+		patch.offset = static_cast<uint32_t>(page_offset);
+		patch.length = static_cast<uint32_t>(length);
+		patch.source_pid = source_pid;
+		patch.target_pid = target_pid;
+
 		memcpy(hook->fake_page + page_offset, source, length);
+
+		++this->copy_stats.copies;
+		this->copy_stats.bytes += length;
+	}
+
+	const ept_copy_stats& ept::get_copy_stats() const
+	{
+		return this->copy_stats;
+	}
+
+	ept_entry_counts ept::get_entry_counts() const
+	{
+		ept_entry_counts counts{};
+		counts.hooks = this->ept_hooks.size();
+		counts.splits = this->ept_splits.size();
+		counts.watch_points = this->ept_code_watch_points.size();
+
+		return counts;
 	}
 
-	void ept::record_access(const uint64_t rip)
+	size_t ept::get_entries(const uint64_t first_index, ept_entry_info* entries, const size_t max_count) const
 	{
-		for (auto& access_record : this->access_records)
+		uint64_t index = 0;
+		size_t count = 0;
+
+		for (const auto& hook : this->ept_hooks)
 		{
-			if (access_record == 0)
+			if (count == max_count)
+			{
+				return count;
+			}
+
+			if (index++ < first_index)
 			{
-				access_record = rip;
-				return;
+				continue;
 			}
 
-			if (access_record == rip)
+			auto& entry = entries[count++];
+			entry = {};
+			entry.type = ept_entry_type::hook;
+			entry.physical_base_address = hook.physical_base_address;
+			entry.source_pid = hook.source_pid;
+			entry.target_pid = hook.target_pid;
+			entry.patch_count = hook.patches.size();
+			copy_hit_counts(hook.hits, entry);
+		}
+
+		for (const auto& split : this->ept_splits)
+		{
+			if (count == max_count)
 			{
-				return;
+				return count;
+			}
+
+			if (index++ < first_index)
+			{
+				continue;
+			}
+
+			auto& entry = entries[count++];
+			entry = {};
+			entry.type = ept_entry_type::split;
+			entry.physical_base_address = split.pml1[0].page_frame_number * PAGE_SIZE;
+		}
+
+		for (const auto& watch_point : this->ept_code_watch_points)
+		{
+			if (count == max_count)
+			{
+				return count;
+			}
+
+			if (index++ < first_index)
+			{
+				continue;
+			}
+
+			auto& entry = entries[count++];
+			entry = {};
+			entry.type = ept_entry_type::watch_point;
+			entry.physical_base_address = watch_point.physical_base_address;
+			entry.source_pid = watch_point.source_pid;
+			entry.target_pid = watch_point.target_pid;
+			copy_hit_counts(watch_point.hits, entry);
+		}
+
+		return count;
+	}
+
+	void ept::add_hit_counts(ept_entry_info& entry) const
+	{
+		if (entry.type == ept_entry_type::hook)
+		{
+			for (const auto& hook : this->ept_hooks)
+			{
+				if (hook.physical_base_address == entry.physical_base_address)
+				{
+					accumulate_hit_counts(hook.hits, entry);
+					return;
+				}
+			}
+		}
+
+		if (entry.type == ept_entry_type::watch_point)
+		{
+			for (const auto& watch_point : this->ept_code_watch_points)
+			{
+				if (watch_point.physical_base_address == entry.physical_base_address)
+				{
+					accumulate_hit_counts(watch_point.hits, entry);
+					return;
+				}
 			}
 		}
 	}
 
-	void ept::install_hook(const void* destination, const void* source, const size_t length,
+	void ept::install_hook(const void* destination, const void* source, const size_t length, const uint64_t handle,
 	                       const process_id source_pid, const process_id target_pid,
 	                       const utils::list<ept_translation_hint>& hints)
 	{
@@ -191,8 +436,8 @@ namespace vmx
 			}
 
 			this->install_page_hook(reinterpret_cast<void*>(current_destination),
-			                        reinterpret_cast<const void*>(current_source), data_to_write, source_pid,
-			                        target_pid, relevant_hint);
+			                        reinterpret_cast<const void*>(current_source), data_to_write, handle,
+			                        source_pid, target_pid, relevant_hint);
 
 			current_length -= data_to_write;
 			current_destination += data_to_write;
@@ -205,17 +450,162 @@ namespace vmx
 		this->ept_hooks.clear();
 	}
 
+	bool ept::update_hook(const uint64_t handle, const void* data, const size_t length)
+	{
+		// The data starts at the lowest address of the handle, its patches may be listed in any order
+		auto start = ~0ull;
+		uint64_t end = 0;
+		size_t page_count = 0;
+
+		for (const auto& hook : this->ept_hooks)
+		{
+			if (!uses_handle(hook, handle))
+			{
+				continue;
+			}
+
+			++page_count;
+
+			for (const auto& patch : hook.patches)
+			{
+				if (patch.handle == handle)
+				{
+					start = min(start, patch.virtual_address);
+					end = max(end, patch.virtual_address + patch.length);
+				}
+			}
+		}
+
+		if (start >= end)
+		{
+			return false;
+		}
+
+		if (end - start != length)
+		{
+			throw std::runtime_error("Update does not match the hook size");
+		}
+
+		// Every page swaps separately, so a core could execute a mix of old and new pages
+		if (page_count > 1)
+		{
+			throw std::runtime_error("Hooks that span several pages cannot be updated");
+		}
+
+		const auto* source = static_cast<const uint8_t*>(data);
+
+		for (auto& hook : this->ept_hooks)
+		{
+			uint8_t* next_page = nullptr;
+
+			for (const auto& patch : hook.patches)
+			{
+				if (patch.handle != handle)
+				{
+					continue;
+				}
+
+				if (!next_page)
+				{
+					next_page = get_inactive_fake_page(hook);
+					memcpy(next_page, hook.fake_page, PAGE_SIZE);
+				}
+
+				memcpy(next_page + patch.offset, source + (patch.virtual_address - start), patch.length);
+
+				++this->copy_stats.copies;
+				this->copy_stats.bytes += patch.length;
+			}
+
+			if (next_page)
+			{
+				swap_fake_page(hook, next_page);
+			}
+		}
+
+		return true;
+	}
+
+	size_t ept::merge_original_changes(const uint64_t handle)
+	{
+		size_t merged = 0;
+
+		for (auto& hook : this->ept_hooks)
+		{
+			if (!uses_handle(hook, handle))
+			{
+				continue;
+			}
+
+			auto* current_page = hook.fake_page;
+			const auto* previous_page = get_inactive_fake_page(hook);
+
+			// Outside the updated patches both pages only differ where a violation merged original bytes into
+			// one of them, and the diff page always holds the latest of those
+			for (size_t i = 0; i < PAGE_SIZE; ++i)
+			{
+				const auto current = current_page[i];
+				if (current == previous_page[i] || is_patched_by(hook, handle, i))
+				{
+					continue;
+				}
+
+				// A violation that writes the byte concurrently stores an even newer value, which must win
+				(void)_InterlockedCompareExchange8(reinterpret_cast<volatile char*>(&current_page[i]),
+				                                   static_cast<char>(hook.diff_page[i]), static_cast<char>(current));
+				++merged;
+			}
+		}
+
+		return merged;
+	}
+
+	size_t ept::remove_patches(const ept_patch_filter& filter)
+	{
+		size_t removed = 0;
+
+		for (auto hook = this->ept_hooks.begin(); hook != this->ept_hooks.end();)
+		{
+			for (auto patch = hook->patches.begin(); patch != hook->patches.end();)
+			{
+				if (!filter.matches(*patch))
+				{
+					++patch;
+					continue;
+				}
+
+				const auto removed_patch = *patch;
+				patch = hook->patches.erase(patch);
+				restore_patch_bytes(*hook, removed_patch);
+				++removed;
+			}
+
+			// The destructor points the page back to the original memory
+			if (hook->patches.empty())
+			{
+				hook = this->ept_hooks.erase(hook);
+			}
+			else
+			{
+				++hook;
+			}
+		}
+
+		return removed;
+	}
+
 	void ept::handle_violation(guest_context& guest_context)
 	{
 		vmx_exit_qualification_ept_violation violation_qualification{};
-		violation_qualification.flags = guest_context.exit_qualification;
+		violation_qualification.flags = guest_context.read(VMCS_EXIT_QUALIFICATION);
 
 		if (!violation_qualification.caused_by_translation)
 		{
 			guest_context.exit_vm = true;
 		}
 
-		const auto physical_base_address = reinterpret_cast<uint64_t>(PAGE_ALIGN(guest_context.guest_physical_address));
+		const auto physical_base_address = reinterpret_cast<uint64_t>(PAGE_ALIGN(
+			guest_context.read(VMCS_GUEST_PHYSICAL_ADDRESS)));
 
 		// watch-point stuff
 
@@ -226,6 +616,7 @@ namespace vmx
 
 			if (!violation_qualification.ept_executable && violation_qualification.execute_access)
 			{
+				record_hit(watch_point->hits, true);
 				watch_point->target_page->execute_access = 1;
 				watch_point->target_page->write_access = 0;
 				watch_point->target_page->read_access = 0;
@@ -235,13 +626,14 @@ namespace vmx
 				violation_qualification.
 				write_access))
 			{
+				record_hit(watch_point->hits, false);
 				watch_point->target_page->execute_access = 0;
 				watch_point->target_page->read_access = 1;
 				watch_point->target_page->write_access = 1;
 				guest_context.increment_rip = false;
 				if (violation_qualification.read_access)
 				{
-					this->record_access(guest_context.guest_rip);
+					access_records::record(guest_context.read(VMCS_GUEST_RIP));
 				}
 			}
 
@@ -258,14 +650,22 @@ namespace vmx
 
 		if (!violation_qualification.ept_executable && violation_qualification.execute_access)
 		{
-			update_fake_page(*hook);
-			hook->target_page->flags = hook->execute_entry.flags;
+			record_hit(hook->hits, true);
+
+			if (update_fake_page(*hook))
+			{
+				// The code we execute changed, so previously decoded instructions might be stale
+				invalidate_syscall_decode_caches();
+			}
+
+			install_execute_entry(*hook);
 			guest_context.increment_rip = false;
 		}
 
 		if (violation_qualification.ept_executable && (violation_qualification.read_access || violation_qualification.
 			write_access))
 		{
+			record_hit(hook->hits, false);
 			hook->target_page->flags = hook->readwrite_entry.flags;
 			guest_context.increment_rip = false;
 		}
@@ -495,7 +895,7 @@ namespace vmx
 			if (hook->target_page->flags == hook->original_entry.flags)
 			{
 				const auto* data_source = translation_hint ? &translation_hint->page[0] : virtual_target;
-				memcpy(&hook->fake_page[0], data_source, PAGE_SIZE);
+				memcpy(hook->fake_page, data_source, PAGE_SIZE);
 
 				hook->target_page->flags = hook->readwrite_entry.flags;
 			}
@@ -508,7 +908,7 @@ namespace vmx
 		this->split_large_page(physical_address);
 
 		const auto* data_source = translation_hint ? &translation_hint->page[0] : virtual_target;
-		memcpy(&hook->fake_page[0], data_source, PAGE_SIZE);
+		memcpy(hook->fake_page, data_source, PAGE_SIZE);
 		memcpy(&hook->diff_page[0], data_source, PAGE_SIZE);
 		hook->physical_base_address = physical_base_address;
 
@@ -529,7 +929,7 @@ namespace vmx
 		hook->execute_entry.read_access = 0;
 		hook->execute_entry.write_access = 0;
 		hook->execute_entry.execute_access = 1;
-		hook->execute_entry.page_frame_number = memory::get_physical_address(&hook->fake_page) / PAGE_SIZE;
+		hook->execute_entry.page_frame_number = memory::get_physical_address(hook->fake_page) / PAGE_SIZE;
 
 		hook->target_page->flags = hook->readwrite_entry.flags;
 
@@ -581,7 +981,14 @@ namespace vmx
 	utils::list<ept_translation_hint> ept::generate_translation_hints(const void* destination, const size_t length)
 	{
 		utils::list<ept_translation_hint> hints{};
+		generate_translation_hints(hints, destination, length);
 
+		return hints;
+	}
+
+	void ept::generate_translation_hints(utils::list<ept_translation_hint>& hints, const void* destination,
+	                                     const size_t length)
+	{
 		auto current_destination = reinterpret_cast<uint64_t>(destination);
 		auto current_length = length;
 
@@ -592,6 +999,24 @@ namespace vmx
 			const auto page_remaining = PAGE_SIZE - page_offset;
 			const auto data_to_write = min(page_remaining, current_length);
 
+			current_length -= data_to_write;
+			current_destination += data_to_write;
+
+			bool known = false;
+			for (const auto& hint : hints)
+			{
+				if (hint.virtual_base_address == aligned_destination)
+				{
+					known = true;
+					break;
+				}
+			}
+
+			if (known)
+			{
+				continue;
+			}
+
 			const auto physical_base_address = memory::get_physical_address(aligned_destination);
 			if (!physical_base_address)
 			{
@@ -604,43 +1029,17 @@ namespace vmx
 			current_hint.physical_base_address = physical_base_address;
 
 			memcpy(&current_hint.page[0], aligned_destination, PAGE_SIZE);
-
-			current_length -= data_to_write;
-			current_destination += data_to_write;
-		}
-
-		return hints;
-	}
-
-	uint64_t* ept::get_access_records(size_t* count)
-	{
-		size_t i = 0;
-		for (const auto& record : this->access_records)
-		{
-			if (record == 0) break;
-			++i;
 		}
-
-		*count = i;
-		return this->access_records;
 	}
 
 	bool ept::cleanup_process(const process_id process)
 	{
-		bool changed = false;
+		// Pages are shared between processes, so only the patches the process owns go away
+		ept_patch_filter filter{};
+		filter.type = ept_patch_filter_type::process;
+		filter.process = process;
 
-		for (auto i = this->ept_hooks.begin(); i != this->ept_hooks.end();)
-		{
-			if (i->source_pid == process || i->target_pid == process)
-			{
-				i = this->ept_hooks.erase(i);
-				changed = true;
-			}
-			else
-			{
-				++i;
-			}
-		}
+		bool changed = this->remove_patches(filter) != 0;
 
 		for (auto i = this->ept_code_watch_points.begin(); i != this->ept_code_watch_points.end();)
 		{
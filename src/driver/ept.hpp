@@ -39,12 +39,57 @@ namespace vmx
 		};
 	};
 
+	// Updated by the violation handler in VMX root mode, possibly from several cores at once
+	struct ept_hit_counts
+	{
+		volatile LONG64 execute_transitions{0};
+		volatile LONG64 data_transitions{0};
+		volatile LONG64 last_hit_tsc{0};
+	};
+
 	struct ept_code_watch_point
 	{
 		uint64_t physical_base_address{};
 		pml1* target_page{};
 		process_id source_pid{0};
 		process_id target_pid{0};
+
+		ept_hit_counts hits{};
+	};
+
+	// One installed write on a hook page, a write that crosses pages leaves a patch on each of them
+	struct ept_patch
+	{
+		uint64_t handle{};
+		uint64_t virtual_address{};
+		uint32_t offset{};
+		uint32_t length{};
+		process_id source_pid{0};
+		process_id target_pid{0};
+	};
+
+	enum class ept_patch_filter_type
+	{
+		handles,
+		range,
+		process,
+	};
+
+	struct ept_patch_filter
+	{
+		ept_patch_filter_type type{};
+
+		const uint64_t* handles{};
+		size_t handle_count{};
+
+		// Virtual addresses in the target process, a process of zero matches any target
+		uint64_t range_start{};
+		uint64_t range_end{};
+
+		// Matches patches installed by or targeting the process
+		process_id process{0};
+
+		bool matches(const ept_patch& patch) const;
 	};
 
 	struct ept_hook
@@ -52,11 +97,13 @@ namespace vmx
 		ept_hook(uint64_t physical_base);
 		~ept_hook();
 
-		DECLSPEC_PAGE_ALIGN uint8_t fake_page[PAGE_SIZE]{};
+		DECLSPEC_PAGE_ALIGN uint8_t fake_pages[2][PAGE_SIZE]{};
 		DECLSPEC_PAGE_ALIGN uint8_t diff_page[PAGE_SIZE]{};
 
+		// The page execute_entry points to, updates are prepared in the other one and swapped in
+		uint8_t* volatile fake_page{fake_pages[0]};
+
 		uint64_t physical_base_address{};
-		void* mapped_virtual_address{};
 
 		pml1* target_page{};
 		pml1 original_entry{};
@@ -65,6 +112,49 @@ namespace vmx
 
 		process_id source_pid{0};
 		process_id target_pid{0};
+
+		utils::list<ept_patch> patches{};
+		ept_hit_counts hits{};
+	};
+
+	struct ept_hook_region
+	{
+		const void* destination{};
+		const void* source{};
+		size_t length{};
+	};
+
+	struct ept_copy_stats
+	{
+		uint64_t copies;
+		uint64_t bytes;
+	};
+
+	enum class ept_entry_type
+	{
+		hook,
+		split,
+		watch_point,
+	};
+
+	// Hooks come first, followed by splits and watch points. Splits carry the base of the 2 MB page.
+	struct ept_entry_info
+	{
+		ept_entry_type type{};
+		uint64_t physical_base_address{};
+		process_id source_pid{0};
+		process_id target_pid{0};
+		uint64_t patch_count{};
+		uint64_t execute_transitions{};
+		uint64_t data_transitions{};
+		uint64_t last_hit_tsc{};
+	};
+
+	struct ept_entry_counts
+	{
+		uint64_t hooks;
+		uint64_t splits;
+		uint64_t watch_points;
 	};
 
 	struct ept_translation_hint
@@ -75,7 +165,7 @@ namespace vmx
 		const void* virtual_base_address{};
 	};
 
-	struct guest_context;
+	class guest_context;
 
 	class ept
 	{
@@ -92,20 +182,47 @@ namespace vmx
 
 		void install_code_watch_point(uint64_t physical_page, process_id source_pid, process_id target_pid);
 
-		void install_hook(const void* destination, const void* source, size_t length, process_id source_pid,
-		                  process_id target_pid,
+		void install_hook(const void* destination, const void* source, size_t length, uint64_t handle,
+		                  process_id source_pid, process_id target_pid,
 		                  const utils::list<ept_translation_hint>& hints = {});
 		void disable_all_hooks();
 
+		// Writes the new bytes of a handle into the inactive fake page and swaps it in atomically, so other cores
+		// execute either the old or the new bytes. Hooks that span several pages are rejected.
+		// Returns false if the handle is unknown.
+		bool update_hook(uint64_t handle, const void* data, size_t length);
+
+		// Violations keep merging changed original bytes into whichever fake page they saw active. Once no
+		// violation can still hold the previous page, this carries those bytes over. Returns the merged byte count.
+		size_t merge_original_changes(uint64_t handle);
+
+		// Restores the bytes of matching patches and drops hooks that have no patch left.
+		// Returns the number of removed patches.
+		size_t remove_patches(const ept_patch_filter& filter);
+
 		void handle_violation(guest_context& guest_context);
 		void handle_misconfiguration(guest_context& guest_context) const;
 
 		ept_pointer get_ept_pointer() const;
+
+		// INVEPT exits unconditionally, so this must run in VMX root mode
 		void invalidate() const;
 
 		static utils::list<ept_translation_hint> generate_translation_hints(const void* destination, size_t length);
 
-		uint64_t* get_access_records(size_t* count);
+		// Appends hints for pages not yet covered by the list, so overlapping regions share them
+		static void generate_translation_hints(utils::list<ept_translation_hint>& hints, const void* destination,
+		                                       size_t length);
+
+		const ept_copy_stats& get_copy_stats() const;
+
+		ept_entry_counts get_entry_counts() const;
+
+		// Describes up to max_count entries, starting at the given index of the combined entry sequence
+		size_t get_entries(uint64_t first_index, ept_entry_info* entries, size_t max_count) const;
+
+		// Adds the hits this EPT saw for the same entry, replicas count their hits separately
+		void add_hit_counts(ept_entry_info& entry) const;
 
 		bool cleanup_process(process_id process);
 
@@ -114,7 +231,7 @@ namespace vmx
 		DECLSPEC_PAGE_ALIGN pml3 epdpt[EPT_PDPTE_ENTRY_COUNT];
 		DECLSPEC_PAGE_ALIGN pml2 epde[EPT_PDPTE_ENTRY_COUNT][EPT_PDE_ENTRY_COUNT];
 
-		uint64_t access_records[1024];
+		ept_copy_stats copy_stats{};
 
 		utils::list<ept_split, utils::AlignedAllocator> ept_splits{};
 		utils::list<ept_hook, utils::AlignedAllocator> ept_hooks{};
@@ -135,9 +252,8 @@ namespace vmx
 
 		void split_large_page(uint64_t physical_address);
 
-		void install_page_hook(void* destination, const void* source, size_t length, process_id source_pid,
-		                       process_id target_pid, const ept_translation_hint* translation_hint = nullptr);
-
-		void record_access(uint64_t rip);
+		void install_page_hook(void* destination, const void* source, size_t length, uint64_t handle,
+		                       process_id source_pid, process_id target_pid,
+		                       const ept_translation_hint* translation_hint = nullptr);
 	};
 }
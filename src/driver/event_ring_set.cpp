@@ -0,0 +1,148 @@
+#include "std_include.hpp"
+#include "event_ring_set.hpp"
+#include "memory.hpp"
+#include "finally.hpp"
+
+namespace
+{
+	void* map_read_only_into_user_mode(const PMDL mdl)
+	{
+		__try
+		{
+			return MmMapLockedPagesSpecifyCache(mdl, UserMode, MmCached, nullptr, FALSE,
+			                                    NormalPagePriority | MdlMappingNoWrite | MdlMappingNoExecute);
+		}
+		__except (EXCEPTION_EXECUTE_HANDLER)
+		{
+			return nullptr;
+		}
+	}
+}
+
+event_ring_set::scoped_lock::scoped_lock(event_ring_set& set)
+	: set_(set)
+{
+	ExAcquireFastMutex(&this->set_.mapping_mutex_);
+}
+
+event_ring_set::scoped_lock::~scoped_lock()
+{
+	ExReleaseFastMutex(&this->set_.mapping_mutex_);
+}
+
+void event_ring_set::allocate(const size_t ring_size, void (*initialize)(event_ring_header&, uint64_t, uint32_t))
+{
+	ExInitializeFastMutex(&this->mapping_mutex_);
+
+	this->ring_size_ = ring_size;
+	this->ring_count_ = min(thread::get_processor_count(), max_event_rings);
+
+	for (uint32_t i = 0; i < this->ring_count_; ++i)
+	{
+		auto& ring = this->rings_[i];
+
+		// Page aligned, so the user mapping never exposes neighbouring allocations
+		ring.header = static_cast<event_ring_header*>(memory::allocate_aligned_memory(ring_size));
+		if (!ring.header)
+		{
+			throw std::runtime_error("Failed to allocate event ring");
+		}
+
+		ring.mdl = IoAllocateMdl(ring.header, static_cast<ULONG>(ring_size), FALSE, FALSE, nullptr);
+		if (!ring.mdl)
+		{
+			throw std::runtime_error("Failed to allocate event ring MDL");
+		}
+
+		MmBuildMdlForNonPagedPool(ring.mdl);
+		initialize(*ring.header, ring_size, i);
+	}
+}
+
+void event_ring_set::free()
+{
+	this->ring_count_ = 0;
+
+	for (auto& ring : this->rings_)
+	{
+		if (ring.mdl)
+		{
+			IoFreeMdl(ring.mdl);
+		}
+
+		memory::free_aligned_memory(ring.header);
+		ring = {};
+	}
+}
+
+bool event_ring_set::is_mapped_by(const process_id process) const
+{
+	return this->mapping_owner_ && this->mapping_owner_.get_id() == process;
+}
+
+process_id event_ring_set::get_owner_id() const
+{
+	return this->mapping_owner_ ? this->mapping_owner_.get_id() : 0;
+}
+
+void event_ring_set::map_into_current_process(const event_ring_header** user_rings)
+{
+	if (this->mapping_owner_)
+	{
+		throw std::runtime_error("Event rings are already mapped");
+	}
+
+	auto destructor = utils::finally([this]
+	{
+		this->unmap_rings();
+	});
+
+	for (uint32_t i = 0; i < this->ring_count_; ++i)
+	{
+		auto& ring = this->rings_[i];
+		ring.user_address = map_read_only_into_user_mode(ring.mdl);
+		if (!ring.user_address)
+		{
+			throw std::runtime_error("Failed to map event ring");
+		}
+
+		user_rings[i] = static_cast<const event_ring_header*>(ring.user_address);
+	}
+
+	this->mapping_owner_ = process::find_process_by_id(process::get_current_process_id());
+	destructor.cancel();
+}
+
+void event_ring_set::unmap()
+{
+	if (!this->mapping_owner_)
+	{
+		return;
+	}
+
+	if (process::get_current_process_id() == this->mapping_owner_.get_id())
+	{
+		this->unmap_rings();
+		return;
+	}
+
+	// Unmapping releases the owner, so keep a reference while attached
+	const auto owner = this->mapping_owner_;
+	process::scoped_process_attacher attacher{owner};
+	this->unmap_rings();
+}
+
+void event_ring_set::unmap_rings()
+{
+	for (uint32_t i = 0; i < this->ring_count_; ++i)
+	{
+		auto& ring = this->rings_[i];
+		if (ring.user_address)
+		{
+			MmUnmapLockedPages(ring.user_address, ring.mdl);
+			ring.user_address = nullptr;
+		}
+	}
+
+	this->mapping_owner_ = {};
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "thread.hpp"
+#include "process.hpp"
+
+#include <irp_data.hpp>
+
+// One event ring per core, described by an MDL so the whole set can be mapped read-only into a single
+// process at a time. The mapping state is guarded by the lock, pushing never takes it.
+class event_ring_set
+{
+public:
+	class scoped_lock
+	{
+	public:
+		scoped_lock(event_ring_set& set);
+		~scoped_lock();
+
+		scoped_lock(scoped_lock&& obj) noexcept = delete;
+		scoped_lock& operator=(scoped_lock&& obj) noexcept = delete;
+
+		scoped_lock(const scoped_lock& obj) = delete;
+		scoped_lock& operator=(const scoped_lock& obj) = delete;
+
+	private:
+		event_ring_set& set_;
+	};
+
+	template <typename Entry>
+	void allocate(const size_t ring_size)
+	{
+		this->allocate(ring_size, event_ring::initialize<Entry>);
+	}
+
+	void free();
+
+	// Safe to call from VMX root mode. Cores without a ring count the event as dropped on the first ring.
+	template <typename Entry>
+	void push(const Entry& entry)
+	{
+		const auto processor = thread::get_processor_index();
+		if (processor >= this->ring_count_)
+		{
+			if (this->ring_count_)
+			{
+				InterlockedIncrement64(reinterpret_cast<volatile LONG64*>(&this->rings_[0].header->dropped));
+			}
+
+			return;
+		}
+
+		event_ring::push(*this->rings_[processor].header, entry);
+	}
+
+	uint32_t get_ring_count() const
+	{
+		return this->ring_count_;
+	}
+
+	size_t get_ring_size() const
+	{
+		return this->ring_size_;
+	}
+
+	event_ring_header& get_ring(const uint32_t index) const
+	{
+		return *this->rings_[index].header;
+	}
+
+	// The following require the lock
+
+	bool is_mapped() const
+	{
+		return this->mapping_owner_;
+	}
+
+	bool is_mapped_by(process_id process) const;
+	process_id get_owner_id() const;
+
+	// Fills one user address per ring and makes the current process the owner. Nothing stays mapped on failure.
+	_IRQL_requires_max_(APC_LEVEL)
+	void map_into_current_process(const event_ring_header** user_rings);
+
+	// Attaches to the owner if it is not the current process
+	_IRQL_requires_max_(APC_LEVEL)
+	void unmap();
+
+private:
+	struct ring
+	{
+		event_ring_header* header;
+		PMDL mdl;
+		void* user_address;
+	};
+
+	ring rings_[max_event_rings]{};
+	uint32_t ring_count_{0};
+	size_t ring_size_{0};
+
+	FAST_MUTEX mapping_mutex_{};
+	process::process_handle mapping_owner_{};
+
+	void allocate(size_t ring_size, void (*initialize)(event_ring_header&, uint64_t, uint32_t));
+	void unmap_rings();
+};
@@ -0,0 +1,76 @@
+#pragma once
+
+namespace vmx
+{
+	class guest_context;
+	struct state;
+
+	using exit_handler_function = void(*)(guest_context& guest_context, state& vm_state);
+
+	enum exit_handler_flags : uint32_t
+	{
+		exit_flag_none = 0,
+		exit_flag_advances_rip = 1 << 0,
+		exit_flag_needs_exit_qualification = 1 << 1,
+		exit_flag_needs_guest_physical_address = 1 << 2,
+		exit_flag_needs_guest_rip = 1 << 3,
+	};
+
+	struct exit_handler_entry
+	{
+		exit_handler_function handler{nullptr};
+		uint32_t flags{exit_flag_advances_rip};
+	};
+
+	constexpr uint32_t exit_reason_count = 0x80;
+
+	// Specialize this for a basic exit reason to plug a handler into the dispatch table.
+	// Constrained partial specializations can be used to register a whole group of reasons at once.
+	template <uint32_t ExitReason>
+	struct exit_handler
+	{
+		static constexpr exit_handler_entry entry{};
+	};
+
+	template <exit_handler_function Handler, uint32_t Flags = exit_flag_advances_rip>
+	struct exit_handler_registration
+	{
+		static constexpr exit_handler_entry entry{Handler, Flags};
+	};
+
+	struct exit_handler_table
+	{
+		exit_handler_entry entries[exit_reason_count]{};
+		exit_handler_entry fallback{};
+
+		constexpr const exit_handler_entry& operator[](const uint32_t exit_reason) const
+		{
+			if (exit_reason >= exit_reason_count)
+			{
+				return this->fallback;
+			}
+
+			return this->entries[exit_reason];
+		}
+	};
+
+	template <template <uint32_t> typename Registry, uint32_t ExitReason = 0>
+	constexpr void fill_exit_handler_table(exit_handler_table& table)
+	{
+		if constexpr (ExitReason < exit_reason_count)
+		{
+			table.entries[ExitReason] = Registry<ExitReason>::entry;
+			fill_exit_handler_table<Registry, ExitReason + 1>(table);
+		}
+	}
+
+	// The registry is a template parameter, so the table can be built and measured
+	// against stub handlers without pulling in the hypervisor itself.
+	template <template <uint32_t> typename Registry = exit_handler>
+	constexpr exit_handler_table make_exit_handler_table()
+	{
+		exit_handler_table table{};
+		fill_exit_handler_table<Registry>(table);
+		return table;
+	}
+}
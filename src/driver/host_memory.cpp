@@ -0,0 +1,235 @@
+#include "std_include.hpp"
+#include "host_memory.hpp"
+#include "paging.hpp"
+#include "memory.hpp"
+#include "list.hpp"
+#include "exception.hpp"
+#include "finally.hpp"
+#include "logging.hpp"
+
+namespace
+{
+	// The host never runs user code, so the lower half is free for the direct map
+	constexpr uint64_t direct_map_pml4_index = 16;
+	constexpr uint64_t direct_map_pml4_count = 8;
+	constexpr uint64_t direct_map_base = direct_map_pml4_index << 39;
+	constexpr uint64_t direct_map_size = direct_map_pml4_count << 39;
+
+	constexpr uint64_t kernel_pml4_start = 256;
+	constexpr uint64_t table_entry_count = 512;
+	constexpr size_t max_ram_ranges = 64;
+
+	struct page_table
+	{
+		DECLSPEC_PAGE_ALIGN uint64_t entries[table_entry_count]{};
+	};
+
+	struct ram_range
+	{
+		uint64_t start;
+		uint64_t end;
+	};
+
+	page_table* pml4{nullptr};
+	utils::list<page_table> tables{};
+	uint64_t system_pml4_address{0};
+	uint64_t host_cr3{0};
+
+	ram_range ram_ranges[max_ram_ranges]{};
+	size_t ram_range_count{0};
+
+	page_table& get_or_create_table(uint64_t& parent_entry)
+	{
+		if (parent_entry & paging::entry_present)
+		{
+			return *static_cast<page_table*>(memory::get_virtual_address(parent_entry & paging::address_mask));
+		}
+
+		auto& table = tables.emplace_back();
+		parent_entry = memory::get_physical_address(&table) | paging::entry_present | paging::entry_writable;
+
+		return table;
+	}
+
+	void map_small_page(const uint64_t address)
+	{
+		const auto virtual_address = direct_map_base + address;
+
+		auto& pdpt = get_or_create_table(pml4->entries[(virtual_address >> 39) & 0x1FF]);
+		auto& pd = get_or_create_table(pdpt.entries[(virtual_address >> 30) & 0x1FF]);
+		auto& pt = get_or_create_table(pd.entries[(virtual_address >> 21) & 0x1FF]);
+
+		pt.entries[(virtual_address >> 12) & 0x1FF] = address | paging::entry_present | paging::entry_writable |
+			paging::entry_execute_disable;
+	}
+
+	void map_large_page(const uint64_t address)
+	{
+		const auto virtual_address = direct_map_base + address;
+
+		auto& pdpt = get_or_create_table(pml4->entries[(virtual_address >> 39) & 0x1FF]);
+		auto& pd = get_or_create_table(pdpt.entries[(virtual_address >> 30) & 0x1FF]);
+
+		pd.entries[(virtual_address >> 21) & 0x1FF] = address | paging::entry_present | paging::entry_writable |
+			paging::entry_large_page | paging::entry_execute_disable;
+	}
+
+	// Large pages only cover whole 2 MB units inside the range. Rounding out would map adjacent MMIO or
+	// reserved memory as write-back, so the unaligned head and tail use 4 KB pages.
+	void map_range(const uint64_t start, const uint64_t end)
+	{
+		constexpr auto large_page_size = 2_mb;
+
+		auto address = start & ~paging::page_offset_mask;
+		while (address < end && address < direct_map_size)
+		{
+			if ((address & (large_page_size - 1)) == 0 && end - address >= large_page_size)
+			{
+				map_large_page(address);
+				address += large_page_size;
+			}
+			else
+			{
+				map_small_page(address);
+				address += PAGE_SIZE;
+			}
+		}
+	}
+
+	void map_physical_memory_ranges()
+	{
+		auto* ranges = MmGetPhysicalMemoryRanges();
+		if (!ranges)
+		{
+			throw std::runtime_error("Failed to query physical memory ranges");
+		}
+
+		const auto _ = utils::finally([ranges]
+		{
+			ExFreePool(ranges);
+		});
+
+		for (auto* range = ranges; range->BaseAddress.QuadPart || range->NumberOfBytes.QuadPart; ++range)
+		{
+			const auto start = static_cast<uint64_t>(range->BaseAddress.QuadPart);
+			const auto end = min(start + static_cast<uint64_t>(range->NumberOfBytes.QuadPart), direct_map_size);
+
+			if (start >= end)
+			{
+				continue;
+			}
+
+			if (ram_range_count >= max_ram_ranges)
+			{
+				debug_log("Too many physical memory ranges, the direct map is incomplete\n");
+				break;
+			}
+
+			map_range(start, end);
+			ram_ranges[ram_range_count++] = {start, end};
+		}
+	}
+}
+
+namespace host_memory
+{
+	void initialize(const uint64_t system_directory_table_base)
+	{
+		if (host_cr3)
+		{
+			return;
+		}
+
+		auto destructor = utils::finally([]
+		{
+			release();
+		});
+
+		pml4 = memory::allocate_aligned_object<page_table>();
+		if (!pml4)
+		{
+			throw std::runtime_error("Failed to allocate host PML4");
+		}
+
+		system_pml4_address = system_directory_table_base & paging::address_mask;
+		sync_kernel_mappings();
+
+		map_physical_memory_ranges();
+
+		host_cr3 = memory::get_physical_address(pml4);
+		destructor.cancel();
+	}
+
+	void release()
+	{
+		host_cr3 = 0;
+		system_pml4_address = 0;
+		ram_range_count = 0;
+
+		tables.clear();
+
+		memory::free_aligned_object(pml4);
+		pml4 = nullptr;
+	}
+
+	void sync_kernel_mappings()
+	{
+		if (!pml4 || !system_pml4_address)
+		{
+			return;
+		}
+
+		const auto* system_pml4 = static_cast<const uint64_t*>(memory::get_virtual_address(system_pml4_address));
+		if (!system_pml4)
+		{
+			return;
+		}
+
+		// Entries below are shared with the system tables, so only new top-level entries need copying
+		for (auto i = kernel_pml4_start; i < table_entry_count; ++i)
+		{
+			if (pml4->entries[i] != system_pml4[i])
+			{
+				InterlockedExchange64(reinterpret_cast<volatile LONG64*>(&pml4->entries[i]),
+				                      static_cast<LONG64>(system_pml4[i]));
+			}
+		}
+	}
+
+	uint64_t get_cr3()
+	{
+		return host_cr3;
+	}
+
+	const uint8_t* get_direct_map_address(const uint64_t physical_address, const size_t length)
+	{
+		const auto end = physical_address + length;
+		if (end < physical_address)
+		{
+			return nullptr;
+		}
+
+		for (size_t i = 0; i < ram_range_count; ++i)
+		{
+			const auto& range = ram_ranges[i];
+			if (physical_address >= range.start && end <= range.end)
+			{
+				return reinterpret_cast<const uint8_t*>(direct_map_base + physical_address);
+			}
+		}
+
+		return nullptr;
+	}
+
+	bool read(const uint64_t physical_address, void* destination, const size_t length)
+	{
+		const auto* source = get_direct_map_address(physical_address, length);
+		if (!source)
+		{
+			return false;
+		}
+
+		memcpy(destination, source, length);
+		return true;
+	}
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+// The host address space: the kernel half of the system page tables plus a direct map of RAM.
+// With it, VMX root mode reads physical memory with plain loads instead of OS calls.
+namespace host_memory
+{
+	_IRQL_requires_max_(APC_LEVEL)
+	void initialize(uint64_t system_directory_table_base);
+
+	// Only once no core runs on the host page tables anymore
+	_IRQL_requires_max_(APC_LEVEL)
+	void release();
+
+	// Picks up top-level kernel entries that appeared after initialization
+	_IRQL_requires_max_(DISPATCH_LEVEL)
+	void sync_kernel_mappings();
+
+	uint64_t get_cr3();
+
+	// Host context only. Returns nullptr for physical memory outside of RAM.
+	const uint8_t* get_direct_map_address(uint64_t physical_address, size_t length = 1);
+	bool read(uint64_t physical_address, void* destination, size_t length);
+}
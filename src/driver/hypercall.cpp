@@ -0,0 +1,267 @@
+#include "std_include.hpp"
+#include "hypercall.hpp"
+#include "hypervisor.hpp"
+#include "memory.hpp"
+#include "thread.hpp"
+#include "process.hpp"
+#include "finally.hpp"
+#include "logging.hpp"
+
+#include <irp_data.hpp>
+
+namespace
+{
+	constexpr size_t ring_size = 4 * PAGE_SIZE;
+
+	struct session_state
+	{
+		uint64_t key;
+		hypercall_command* commands;
+		uint32_t command_capacity;
+		PMDL mdl;
+		void* user_address;
+		process::process_handle owner;
+	};
+
+	FAST_MUTEX session_mutex{};
+	session_state current_session{};
+
+	// Published for root mode once the ring is mapped, cleared before it is torn down
+	session_state* volatile active_session{nullptr};
+
+	class scoped_session_lock
+	{
+	public:
+		scoped_session_lock()
+		{
+			ExAcquireFastMutex(&session_mutex);
+		}
+
+		~scoped_session_lock()
+		{
+			ExReleaseFastMutex(&session_mutex);
+		}
+
+		scoped_session_lock(scoped_session_lock&& obj) noexcept = delete;
+		scoped_session_lock& operator=(scoped_session_lock&& obj) noexcept = delete;
+
+		scoped_session_lock(const scoped_session_lock& obj) = delete;
+		scoped_session_lock& operator=(const scoped_session_lock& obj) = delete;
+	};
+
+	void* map_into_user_mode(const PMDL mdl)
+	{
+		__try
+		{
+			return MmMapLockedPagesSpecifyCache(mdl, UserMode, MmCached, nullptr, FALSE,
+			                                    NormalPagePriority | MdlMappingNoExecute);
+		}
+		__except (EXCEPTION_EXECUTE_HANDLER)
+		{
+			return nullptr;
+		}
+	}
+
+	uint64_t generate_key()
+	{
+		const auto counter = KeQueryPerformanceCounter(nullptr);
+		auto seed = static_cast<ULONG>(__rdtsc() ^ counter.QuadPart);
+
+		uint64_t key = 0;
+		while (!key)
+		{
+			key = static_cast<uint64_t>(RtlRandomEx(&seed)) << 33;
+			key ^= static_cast<uint64_t>(RtlRandomEx(&seed)) << 2;
+			key ^= __rdtsc();
+		}
+
+		return key;
+	}
+
+	void free_session(session_state& session)
+	{
+		if (session.user_address)
+		{
+			MmUnmapLockedPages(session.user_address, session.mdl);
+		}
+
+		if (session.mdl)
+		{
+			IoFreeMdl(session.mdl);
+		}
+
+		memory::free_aligned_memory(session.commands);
+		session = {};
+	}
+
+	void release_session()
+	{
+		InterlockedExchangePointer(reinterpret_cast<PVOID volatile*>(&active_session), nullptr);
+
+		// A core might still be working through a batch, a DPC on every core waits for it to leave root mode
+		thread::dispatch_on_all_cores([]
+		{
+		});
+
+		free_session(current_session);
+	}
+
+	void query_stats(hypercall_command& command)
+	{
+		const auto* hypervisor = hypervisor::get_instance();
+		if (!hypervisor)
+		{
+			command.status = hypercall_status::unavailable;
+			return;
+		}
+
+		const auto stats = hypervisor->get_stats();
+
+		command.results[0] = hypervisor->get_core_count();
+		command.results[1] = stats.cpuid_exits;
+		command.results[2] = stats.cpuid_cache_hits;
+		command.results[3] = stats.cpuid_cache_misses;
+		command.results[4] = stats.cpuid_cycles;
+		command.results[5] = stats.exits;
+		command.results[6] = stats.exit_cycles;
+		command.status = hypercall_status::success;
+	}
+
+	void execute_command(hypercall_command& command)
+	{
+		// The ring is writable by user mode, so the type is read exactly once
+		switch (*reinterpret_cast<volatile hypercall_command_type*>(&command.type))
+		{
+		case hypercall_command_type::ping:
+			command.results[0] = command.arguments[0];
+			command.results[1] = thread::get_processor_index();
+			command.results[2] = __rdtsc();
+			command.status = hypercall_status::success;
+			break;
+		case hypercall_command_type::query_stats:
+			query_stats(command);
+			break;
+		default:
+			command.status = hypercall_status::invalid_command;
+			break;
+		}
+	}
+}
+
+namespace hypercall
+{
+	uint64_t execute(const uint64_t key, const uint64_t command_count)
+	{
+		auto* session = static_cast<session_state*>(ReadPointerAcquire(reinterpret_cast<PVOID volatile*>(&active_session)));
+		if (!session || session->key != key)
+		{
+			return 0;
+		}
+
+		const auto count = min(command_count, static_cast<uint64_t>(session->command_capacity));
+		for (uint64_t i = 0; i < count; ++i)
+		{
+			execute_command(session->commands[i]);
+		}
+
+		return count;
+	}
+
+	hypercall_session open_session()
+	{
+		scoped_session_lock _{};
+
+		if (current_session.owner)
+		{
+			throw std::runtime_error("A hypercall session is already open");
+		}
+
+		auto destructor = utils::finally([]
+		{
+			free_session(current_session);
+		});
+
+		auto& session = current_session;
+
+		// Page aligned, so the user mapping never exposes neighbouring allocations
+		session.commands = static_cast<hypercall_command*>(memory::allocate_aligned_memory(ring_size));
+		if (!session.commands)
+		{
+			throw std::runtime_error("Failed to allocate hypercall ring");
+		}
+
+		memset(session.commands, 0, ring_size);
+		session.command_capacity = static_cast<uint32_t>(ring_size / sizeof(hypercall_command));
+
+		session.mdl = IoAllocateMdl(session.commands, ring_size, FALSE, FALSE, nullptr);
+		if (!session.mdl)
+		{
+			throw std::runtime_error("Failed to allocate hypercall ring MDL");
+		}
+
+		MmBuildMdlForNonPagedPool(session.mdl);
+
+		session.user_address = map_into_user_mode(session.mdl);
+		if (!session.user_address)
+		{
+			throw std::runtime_error("Failed to map hypercall ring");
+		}
+
+		session.key = generate_key();
+		session.owner = process::find_process_by_id(process::get_current_process_id());
+
+		hypercall_session result{};
+		result.key = session.key;
+		result.commands = static_cast<hypercall_command*>(session.user_address);
+		result.command_capacity = session.command_capacity;
+
+		InterlockedExchangePointer(reinterpret_cast<PVOID volatile*>(&active_session), &session);
+		destructor.cancel();
+
+		return result;
+	}
+
+	bool close_session(const process_id process)
+	{
+		scoped_session_lock _{};
+
+		if (!current_session.owner || current_session.owner.get_id() != process)
+		{
+			return false;
+		}
+
+		if (process::get_current_process_id() == process)
+		{
+			release_session();
+		}
+		else
+		{
+			// Releasing drops the owner, so keep a reference while attached
+			const auto owner = current_session.owner;
+			process::scoped_process_attacher attacher{owner};
+			release_session();
+		}
+
+		return true;
+	}
+
+	scoped_sessions::scoped_sessions()
+	{
+		ExInitializeFastMutex(&session_mutex);
+	}
+
+	scoped_sessions::~scoped_sessions()
+	{
+		try
+		{
+			if (current_session.owner)
+			{
+				(void)close_session(current_session.owner.get_id());
+			}
+		}
+		catch (...)
+		{
+			debug_log("Failed to close hypercall session\n");
+		}
+	}
+}
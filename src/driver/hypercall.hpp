@@ -0,0 +1,28 @@
+#pragma once
+
+struct hypercall_session;
+
+namespace hypercall
+{
+	// Safe to call from VMX root mode
+	uint64_t execute(uint64_t key, uint64_t command_count);
+
+	_IRQL_requires_max_(APC_LEVEL)
+	hypercall_session open_session();
+
+	_IRQL_requires_max_(APC_LEVEL)
+	bool close_session(process_id process);
+
+	class scoped_sessions
+	{
+	public:
+		scoped_sessions();
+		~scoped_sessions();
+
+		scoped_sessions(scoped_sessions&& obj) noexcept = delete;
+		scoped_sessions& operator=(scoped_sessions&& obj) noexcept = delete;
+
+		scoped_sessions(const scoped_sessions& obj) = delete;
+		scoped_sessions& operator=(const scoped_sessions& obj) = delete;
+	};
+}
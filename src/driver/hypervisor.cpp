@@ -9,6 +9,14 @@
 #include "assembly.hpp"
 #include "process.hpp"
 #include "string.hpp"
+#include "exit_dispatch.hpp"
+#include "syscall_filter.hpp"
+#include "syscall_events.hpp"
+#include "hypercall.hpp"
+#include "host_memory.hpp"
+#include "paging.hpp"
+
+#include <irp_data.hpp>
 
 #define DPL_USER   3
 #define DPL_SYSTEM 0
@@ -25,6 +33,35 @@ namespace
 {
 	hypervisor* instance{nullptr};
 
+	// Keep a copy of the EPT paging structures and hooks on every NUMA node
+	constexpr bool replicate_ept_per_node = true;
+
+	volatile long syscall_decode_generation{1};
+
+	class scoped_fast_mutex
+	{
+	public:
+		scoped_fast_mutex(FAST_MUTEX& mutex)
+			: mutex_(&mutex)
+		{
+			ExAcquireFastMutex(this->mutex_);
+		}
+
+		~scoped_fast_mutex()
+		{
+			ExReleaseFastMutex(this->mutex_);
+		}
+
+		scoped_fast_mutex(scoped_fast_mutex&& obj) noexcept = delete;
+		scoped_fast_mutex& operator=(scoped_fast_mutex&& obj) noexcept = delete;
+
+		scoped_fast_mutex(const scoped_fast_mutex& obj) = delete;
+		scoped_fast_mutex& operator=(const scoped_fast_mutex& obj) = delete;
+
+	private:
+		FAST_MUTEX* mutex_{};
+	};
+
 	bool is_vmx_supported()
 	{
 		cpuid_eax_01 data{};
@@ -53,6 +90,8 @@ namespace
 		return cpuid_data[0] == 'momo';
 	}
 
+	constexpr uint64_t hypercall_invalidate = 0x42424244;
+
 	void enable_syscall_hooking()
 	{
 		int32_t cpu_info[4]{0};
@@ -99,11 +138,6 @@ namespace
 		return data;
 	}
 
-	[[ noreturn ]] void resume_vmx()
-	{
-		__vmx_vmresume();
-	}
-
 	int32_t launch_vmx()
 	{
 		__vmx_vmlaunch();
@@ -131,6 +165,8 @@ hypervisor::hypervisor()
 		throw std::runtime_error("Hypervisor already instantiated");
 	}
 
+	ExInitializeFastMutex(&this->ept_mutex_);
+
 	auto destructor = utils::finally([this]()
 	{
 		this->free_vm_states();
@@ -163,6 +199,40 @@ hypervisor::~hypervisor()
 	instance = nullptr;
 }
 
+bool hypervisor::enable_processor(const uint32_t processor_index)
+{
+	if (processor_index >= this->vm_state_count_ || !this->is_enabled())
+	{
+		return false;
+	}
+
+	if (!this->get_vm_state(processor_index) && !this->allocate_vm_state(processor_index))
+	{
+		debug_log("Failed to allocate VM state for hot-added core %u\n", processor_index);
+		return false;
+	}
+
+	auto success = false;
+	const auto dispatched = thread::dispatch_on_core(processor_index, [&]
+	{
+		auto* vm_state = this->get_current_vm_state();
+		if (vm_state)
+		{
+			vm_state->bringup = {};
+			success = this->try_enable_core(this->system_directory_table_base_);
+		}
+	});
+
+	if (!dispatched || !success)
+	{
+		debug_log("Failed to enable hypervisor on hot-added core %u\n", processor_index);
+		return false;
+	}
+
+	debug_log("Hypervisor enabled on hot-added core %u\n", processor_index);
+	return true;
+}
+
 void hypervisor::disable()
 {
 	thread::dispatch_on_all_cores([this]()
@@ -178,35 +248,154 @@ bool hypervisor::is_enabled() const
 	return is_hypervisor_present();
 }
 
-bool hypervisor::install_ept_hook(const void* destination, const void* source, const size_t length,
-                                  const process_id source_pid, const process_id target_pid,
-                                  const utils::list<vmx::ept_translation_hint>& hints)
+uint64_t hypervisor::install_ept_hook(const void* destination, const void* source, const size_t length,
+                                      const process_id source_pid, const process_id target_pid,
+                                      const utils::list<vmx::ept_translation_hint>& hints)
 {
-	try
+	vmx::ept_hook_region region{};
+	region.destination = destination;
+	region.source = source;
+	region.length = length;
+
+	uint64_t handle = 0;
+	(void)this->install_ept_hooks(&region, 1, source_pid, target_pid, hints, &handle);
+
+	return handle;
+}
+
+size_t hypervisor::install_ept_hooks(const vmx::ept_hook_region* regions, const size_t region_count,
+                                     const process_id source_pid, const process_id target_pid,
+                                     const utils::list<vmx::ept_translation_hint>& hints, uint64_t* const handles)
+{
+	scoped_fast_mutex lock{this->ept_mutex_};
+
+	const auto _ = utils::finally([]
 	{
-		this->ept_->install_hook(destination, source, length, source_pid, target_pid, hints);
+		vmx::invalidate_syscall_decode_caches();
+	});
+
+	std::unique_ptr<bool[]> failed(new bool[region_count]{});
+	if (!failed)
+	{
+		throw std::runtime_error("Failed to allocate hook batch state");
 	}
-	catch (std::exception& e)
+
+	const auto first_handle = this->next_hook_handle_;
+	this->next_hook_handle_ += region_count;
+
+	this->for_each_ept_on_node([&](vmx::ept& ept)
 	{
-		debug_log("Failed to install ept hook on core %d: %s\n", thread::get_processor_index(), e.what());
-		return false;
+		for (size_t i = 0; i < region_count; ++i)
+		{
+			const auto& region = regions[i];
+
+			try
+			{
+				ept.install_hook(region.destination, region.source, region.length, first_handle + i, source_pid,
+				                 target_pid, hints);
+			}
+			catch (std::exception& e)
+			{
+				debug_log("Failed to install ept hook %zu of batch: %s\n", i, e.what());
+				failed.get()[i] = true;
+			}
+			catch (...)
+			{
+				debug_log("Failed to install ept hook %zu of batch.\n", i);
+				failed.get()[i] = true;
+			}
+		}
+	});
+
+	size_t installed = 0;
+	for (size_t i = 0; i < region_count; ++i)
+	{
+		const auto handle = failed.get()[i] ? 0 : first_handle + i;
+		installed += handle ? 1 : 0;
+
+		if (handles)
+		{
+			handles[i] = handle;
+		}
 	}
-	catch (...)
+
+	// Failed regions may be partially applied, their handles are never handed out, so nothing could remove them
+	if (installed != region_count)
 	{
-		debug_log("Failed to install ept hook on core %d.\n", thread::get_processor_index());
-		return false;
+		std::unique_ptr<uint64_t[]> failed_handles(new uint64_t[region_count - installed]);
+		if (failed_handles)
+		{
+			size_t failed_count = 0;
+			for (size_t i = 0; i < region_count; ++i)
+			{
+				if (failed.get()[i])
+				{
+					failed_handles.get()[failed_count++] = first_handle + i;
+				}
+			}
+
+			vmx::ept_patch_filter filter{};
+			filter.type = vmx::ept_patch_filter_type::handles;
+			filter.handles = failed_handles.get();
+			filter.handle_count = failed_count;
+
+			this->for_each_ept([&](vmx::ept& ept)
+			{
+				(void)ept.remove_patches(filter);
+			});
+		}
 	}
 
+	// Partially applied regions still changed EPT entries. INVVPID only drops linear mappings of the
+	// hooking process, so cached guest-physical translations and other aliases need an INVEPT.
 	this->invalidate_cores();
-	return true;
+
+	return installed;
 }
 
 bool hypervisor::install_ept_code_watch_point(const uint64_t physical_page, const process_id source_pid,
                                               const process_id target_pid, const bool invalidate) const
+{
+	scoped_fast_mutex lock{this->ept_mutex_};
+
+	if (!this->try_install_ept_code_watch_point(physical_page, source_pid, target_pid))
+	{
+		return false;
+	}
+
+	if (invalidate)
+	{
+		this->invalidate_cores();
+	}
+
+	return true;
+}
+
+bool hypervisor::install_ept_code_watch_points(const uint64_t* physical_pages, const size_t count,
+                                               const process_id source_pid, const process_id target_pid) const
+{
+	scoped_fast_mutex lock{this->ept_mutex_};
+
+	bool success = true;
+	for (size_t i = 0; i < count; ++i)
+	{
+		success &= this->try_install_ept_code_watch_point(physical_pages[i], source_pid, target_pid);
+	}
+
+	this->invalidate_cores();
+
+	return success;
+}
+
+bool hypervisor::try_install_ept_code_watch_point(const uint64_t physical_page, const process_id source_pid,
+                                                  const process_id target_pid) const
 {
 	try
 	{
-		this->ept_->install_code_watch_point(physical_page, source_pid, target_pid);
+		this->for_each_ept_on_node([&](vmx::ept& ept)
+		{
+			ept.install_code_watch_point(physical_page, source_pid, target_pid);
+		});
 	}
 	catch (std::exception& e)
 	{
@@ -219,56 +408,160 @@ bool hypervisor::install_ept_code_watch_point(const uint64_t physical_page, cons
 		return false;
 	}
 
-	if (invalidate)
+	return true;
+}
+
+void hypervisor::disable_all_ept_hooks() const
+{
+	scoped_fast_mutex lock{this->ept_mutex_};
+
+	this->for_each_ept([](vmx::ept& ept)
+	{
+		ept.disable_all_hooks();
+	});
+
+	vmx::invalidate_syscall_decode_caches();
+
+	this->invalidate_cores();
+}
+
+size_t hypervisor::remove_ept_hooks(const vmx::ept_patch_filter& filter) const
+{
+	scoped_fast_mutex lock{this->ept_mutex_};
+
+	const auto _ = utils::finally([]
+	{
+		vmx::invalidate_syscall_decode_caches();
+	});
+
+	// The replicas hold the same patches, so the first one tells how many were removed
+	size_t removed = 0;
+	bool first = true;
+
+	this->for_each_ept([&](vmx::ept& ept)
 	{
-		thread::dispatch_on_all_cores([&]
+		const auto count = ept.remove_patches(filter);
+		if (first)
 		{
-			this->ept_->invalidate();
-		});
+			removed = count;
+			first = false;
+		}
+	});
+
+	if (removed)
+	{
+		this->invalidate_cores();
 	}
 
-	return true;
+	return removed;
 }
 
-bool hypervisor::install_ept_code_watch_points(const uint64_t* physical_pages, const size_t count,
-                                               const process_id source_pid, const process_id target_pid) const
+bool hypervisor::update_ept_hook(const uint64_t handle, const void* data, const size_t length) const
 {
-	bool success = true;
-	for (size_t i = 0; i < count; ++i)
+	scoped_fast_mutex lock{this->ept_mutex_};
+
+	const auto _ = utils::finally([]
+	{
+		vmx::invalidate_syscall_decode_caches();
+	});
+
+	bool updated = true;
+
+	this->for_each_ept_on_node([&](vmx::ept& ept)
+	{
+		updated &= ept.update_hook(handle, data, length);
+	});
+
+	if (!updated)
 	{
-		success &= this->install_ept_code_watch_point(physical_pages[i], source_pid, target_pid, false);
+		return false;
 	}
 
-	thread::dispatch_on_all_cores([&]
+	this->invalidate_cores();
+
+	// Once every core went through the invalidation, no violation handler can still use the previous page.
+	// Merging only writes bytes of the active page, which needs no further flush.
+	this->for_each_ept([&](vmx::ept& ept)
 	{
-		this->ept_->invalidate();
+		(void)ept.merge_original_changes(handle);
 	});
 
-	return success;
+	return true;
 }
 
-void hypervisor::disable_all_ept_hooks() const
+vmx::core_stats hypervisor::get_stats() const
 {
-	this->ept_->disable_all_hooks();
+	vmx::core_stats stats{};
 
-	thread::dispatch_on_all_cores([&]
+	for (auto i = 0u; i < this->vm_state_count_; ++i)
 	{
-		const auto* vm_state = this->get_current_vm_state();
+		const auto* vm_state = this->get_vm_state(i);
 		if (!vm_state)
 		{
-			return;
+			continue;
 		}
 
-		if (this->is_enabled())
+		const auto& core_stats = vm_state->stats;
+		stats.cpuid_exits += core_stats.cpuid_exits;
+		stats.cpuid_cache_hits += core_stats.cpuid_cache_hits;
+		stats.cpuid_cache_misses += core_stats.cpuid_cache_misses;
+		stats.cpuid_cycles += core_stats.cpuid_cycles;
+		stats.exits += core_stats.exits;
+		stats.exit_cycles += core_stats.exit_cycles;
+	}
+
+	return stats;
+}
+
+vmx::ept_copy_stats hypervisor::get_copy_stats() const
+{
+	vmx::ept_copy_stats stats{};
+
+	this->for_each_ept([&](const vmx::ept& ept)
+	{
+		const auto& ept_stats = ept.get_copy_stats();
+		stats.copies += ept_stats.copies;
+		stats.bytes += ept_stats.bytes;
+	});
+
+	return stats;
+}
+
+size_t hypervisor::get_ept_entries(const uint64_t first_index, vmx::ept_entry_info* entries,
+                                   const size_t max_count, vmx::ept_entry_counts& counts) const
+{
+	scoped_fast_mutex lock{this->ept_mutex_};
+
+	counts = {};
+	if (!this->ept_count_)
+	{
+		return 0;
+	}
+
+	const auto& first_ept = *this->epts_[0];
+	counts = first_ept.get_entry_counts();
+
+	const auto count = first_ept.get_entries(first_index, entries, max_count);
+
+	for (auto i = 1u; i < this->ept_count_; ++i)
+	{
+		for (size_t j = 0; j < count; ++j)
 		{
-			vm_state->ept->invalidate();
+			this->epts_[i]->add_hit_counts(entries[j]);
 		}
-	});
+	}
+
+	return count;
+}
+
+uint32_t hypervisor::get_core_count() const
+{
+	return static_cast<uint32_t>(this->active_vm_state_count_);
 }
 
-vmx::ept& hypervisor::get_ept() const
+uint32_t hypervisor::get_max_core_count() const
 {
-	return *this->ept_;
+	return this->vm_state_count_;
 }
 
 hypervisor* hypervisor::get_instance()
@@ -276,9 +569,25 @@ hypervisor* hypervisor::get_instance()
 	return instance;
 }
 
+void vmx::invalidate_syscall_decode_caches()
+{
+	InterlockedIncrement(&syscall_decode_generation);
+}
+
 bool hypervisor::cleanup_process(const process_id process)
 {
-	if (!this->ept_->cleanup_process(process))
+	// The address space is going away, so cached decodes for its CR3 must not survive
+	vmx::invalidate_syscall_decode_caches();
+
+	scoped_fast_mutex lock{this->ept_mutex_};
+
+	bool changed = false;
+	this->for_each_ept([&](vmx::ept& ept)
+	{
+		changed |= ept.cleanup_process(process);
+	});
+
+	if (!changed)
 	{
 		return false;
 	}
@@ -289,9 +598,34 @@ bool hypervisor::cleanup_process(const process_id process)
 
 void hypervisor::enable()
 {
+	LARGE_INTEGER frequency{};
+	const auto start = KeQueryPerformanceCounter(&frequency);
+
+	// Kept for processors that are hot-added later, their callback may run in any process
 	const auto cr3 = __readcr3();
+	this->system_directory_table_base_ = cr3;
 
-	this->ept_->initialize();
+	host_memory::initialize(cr3);
+
+	// Processors added while the hypervisor was off have no state yet
+	const auto active_count = min(thread::get_processor_count(), this->vm_state_count_);
+	for (auto i = 0u; i < active_count; ++i)
+	{
+		if (!this->get_vm_state(i) && !this->allocate_vm_state(i))
+		{
+			throw std::runtime_error("Failed to allocate VM state entries");
+		}
+	}
+
+	for (auto i = 0u; i < this->vm_state_count_; ++i)
+	{
+		if (auto* vm_state = this->get_vm_state(i))
+		{
+			vm_state->bringup = {};
+		}
+	}
+
+	this->build_epts();
 
 	volatile long failures = 0;
 	thread::dispatch_on_all_cores([&]
@@ -302,13 +636,116 @@ void hypervisor::enable()
 		}
 	});
 
+	const auto end = KeQueryPerformanceCounter(nullptr);
+	const auto elapsed = static_cast<uint64_t>(end.QuadPart - start.QuadPart);
+	this->bringup_microseconds_ = elapsed * 1000000 / static_cast<uint64_t>(frequency.QuadPart);
+
+	this->log_bringup_report();
+
 	if (failures)
 	{
 		this->disable();
 		throw std::runtime_error("Hypervisor initialization failed");
 	}
 
-	debug_log("Hypervisor enabled on %d cores\n", this->vm_state_count_);
+	debug_log("Hypervisor enabled on %d cores\n", this->get_core_count());
+}
+
+void hypervisor::build_epts() const
+{
+	std::unique_ptr<volatile long[]> claimed(new volatile long[this->ept_count_]{});
+	if (!claimed)
+	{
+		throw std::runtime_error("Failed to allocate ept build state");
+	}
+
+	// Replicas are independent, so the first core of each node builds its local one in parallel
+	thread::dispatch_on_all_cores([&]
+	{
+		auto* vm_state = this->get_current_vm_state();
+		if (!vm_state)
+		{
+			return;
+		}
+
+		const auto index = this->get_ept_index(vm_state->ept);
+		if (index >= this->ept_count_ || InterlockedCompareExchange(&claimed.get()[index], 1, 0) != 0)
+		{
+			return;
+		}
+
+		const auto start = __rdtsc();
+		vm_state->ept->initialize();
+		vm_state->bringup.ept_build = __rdtsc() - start;
+	});
+
+	// Nodes without active processors still receive hook updates
+	for (auto i = 0u; i < this->ept_count_; ++i)
+	{
+		if (!claimed.get()[i])
+		{
+			this->epts_[i]->initialize();
+		}
+	}
+}
+
+uint32_t hypervisor::get_ept_index(const vmx::ept* ept) const
+{
+	for (auto i = 0u; i < this->ept_count_; ++i)
+	{
+		if (this->epts_[i] == ept)
+		{
+			return i;
+		}
+	}
+
+	return this->ept_count_;
+}
+
+void hypervisor::log_bringup_report() const
+{
+	debug_log("Bring-up took %llu us\n", this->bringup_microseconds_);
+
+	for (auto i = 0u; i < this->vm_state_count_; ++i)
+	{
+		const auto* vm_state = this->get_vm_state(i);
+		if (!vm_state)
+		{
+			continue;
+		}
+
+		const auto& timing = vm_state->bringup;
+		debug_log("Core %u: %s, ept %llu, msr %llu, vmxon %llu, vmcs %llu, launch %llu, total %llu cycles%s%s\n", i,
+		          timing.succeeded ? "ok" : "failed", timing.ept_build, timing.msr_capture, timing.vmxon,
+		          timing.vmcs_setup, timing.launch, timing.total, timing.error[0] ? ": " : "", timing.error);
+	}
+}
+
+const vmx::bringup_timing* hypervisor::get_bringup_timing(const uint32_t core) const
+{
+	const auto* vm_state = this->get_vm_state(core);
+	if (!vm_state)
+	{
+		return nullptr;
+	}
+
+	return &vm_state->bringup;
+}
+
+uint32_t hypervisor::get_core_node(const uint32_t core) const
+{
+	const auto* vm_state = this->get_vm_state(core);
+	if (!vm_state)
+	{
+		return 0;
+	}
+
+	return vm_state->node;
+}
+
+uint64_t hypervisor::get_bringup_microseconds() const
+{
+	return this->bringup_microseconds_;
 }
 
 bool hypervisor::try_enable_core(const uint64_t system_directory_table_base)
@@ -321,15 +758,28 @@ bool hypervisor::try_enable_core(const uint64_t system_directory_table_base)
 	catch (std::exception& e)
 	{
 		debug_log("Failed to enable hypervisor on core %d: %s\n", thread::get_processor_index(), e.what());
+		this->record_bringup_error(e.what());
 		return false;
 	}
 	catch (...)
 	{
 		debug_log("Failed to enable hypervisor on core %d.\n", thread::get_processor_index());
+		this->record_bringup_error("Unknown error");
 		return false;
 	}
 }
 
+void hypervisor::record_bringup_error(const char* error) const
+{
+	auto* vm_state = this->get_current_vm_state();
+	if (vm_state)
+	{
+		auto& timing = vm_state->bringup;
+		timing.succeeded = false;
+		(void)RtlStringCbCopyA(timing.error, sizeof(timing.error), error);
+	}
+}
+
 void enter_root_mode_on_cpu(vmx::state& vm_state)
 {
 	auto* launch_context = &vm_state.launch_context;
@@ -464,13 +914,13 @@ uint32_t adjust_msr(const ULARGE_INTEGER control_value, const uint64_t desired_v
 	return result;
 }
 
-void vmx_handle_invd()
+void vmx_handle_invd(vmx::guest_context& /*guest_context*/, vmx::state& /*vm_state*/)
 {
 	__wbinvd();
 }
 
-void inject_interuption(const interruption_type type, const exception_vector vector, const bool deliver_code,
-                        const uint32_t error_code)
+void inject_interuption(vmx::guest_context& guest_context, const interruption_type type,
+                        const exception_vector vector, const bool deliver_code, const uint32_t error_code)
 {
 	vmentry_interrupt_information interrupt{};
 	interrupt.valid = true;
@@ -478,40 +928,32 @@ void inject_interuption(const interruption_type type, const exception_vector vec
 	interrupt.vector = vector;
 	interrupt.deliver_error_code = deliver_code;
 
-	__vmx_vmwrite(VMCS_CTRL_VMENTRY_INTERRUPTION_INFORMATION_FIELD, interrupt.flags);
+	guest_context.write(VMCS_CTRL_VMENTRY_INTERRUPTION_INFORMATION_FIELD, interrupt.flags);
 
 	if (deliver_code)
 	{
-		__vmx_vmwrite(VMCS_CTRL_VMENTRY_INTERRUPTION_INFORMATION_FIELD, error_code);
+		guest_context.write(VMCS_CTRL_VMENTRY_INTERRUPTION_INFORMATION_FIELD, error_code);
 	}
 }
 
-void inject_invalid_opcode()
+void inject_invalid_opcode(vmx::guest_context& guest_context)
 {
-	inject_interuption(hardware_exception, invalid_opcode, false, 0);
+	inject_interuption(guest_context, hardware_exception, invalid_opcode, false, 0);
 }
 
-void inject_page_fault(const uint64_t page_fault_address)
+void inject_page_fault(vmx::guest_context& guest_context, const uint64_t page_fault_address)
 {
 	__writecr2(page_fault_address);
 
 	page_fault_exception error_code{};
 	error_code.flags = 0;
 
-	inject_interuption(hardware_exception, page_fault, true, error_code.flags);
-}
-
-void inject_page_fault(const void* page_fault_address)
-{
-	inject_page_fault(reinterpret_cast<uint64_t>(page_fault_address));
+	inject_interuption(guest_context, hardware_exception, page_fault, true, error_code.flags);
 }
 
-cr3 get_current_process_cr3()
+void inject_page_fault(vmx::guest_context& guest_context, const void* page_fault_address)
 {
-	cr3 guest_cr3{};
-	guest_cr3.flags = PsGetCurrentProcess()->DirectoryTableBase;
-
-	return guest_cr3;
+	inject_page_fault(guest_context, reinterpret_cast<uint64_t>(page_fault_address));
 }
 
 template <size_t Length>
@@ -528,9 +970,9 @@ bool is_mem_equal(const uint8_t* ptr, const uint8_t (&array)[Length])
 	return true;
 }
 
-void set_exception_bit(const exception_vector bit, const bool value)
+void set_exception_bit(vmx::guest_context& guest_context, const exception_vector bit, const bool value)
 {
-	auto exception_bitmap = read_vmx(VMCS_CTRL_EXCEPTION_BITMAP);
+	auto exception_bitmap = guest_context.read(VMCS_CTRL_EXCEPTION_BITMAP);
 
 	if (value)
 	{
@@ -541,10 +983,92 @@ void set_exception_bit(const exception_vector bit, const bool value)
 		exception_bitmap &= ~(1ULL << bit);
 	}
 
-	__vmx_vmwrite(VMCS_CTRL_EXCEPTION_BITMAP, exception_bitmap);
+	guest_context.write(VMCS_CTRL_EXCEPTION_BITMAP, exception_bitmap);
+}
+
+vmx::gdt_entry make_flat_segment(const uint16_t selector, const uint32_t access_rights)
+{
+	vmx::gdt_entry gdt_entry{};
+	gdt_entry.selector.flags = selector;
+	gdt_entry.base = 0;
+	gdt_entry.limit = 0xFFFFF;
+	gdt_entry.access_rights.flags = access_rights;
+
+	return gdt_entry;
+}
+
+void capture_syscall_msrs(vmx::syscall_msr_state& msrs)
+{
+	msrs.star = __readmsr(IA32_STAR);
+	msrs.lstar = __readmsr(IA32_LSTAR);
+	msrs.fmask = __readmsr(IA32_FMASK);
+
+	const auto syscall_selector = static_cast<uint16_t>((msrs.star >> 32) & ~3);
+	msrs.syscall.cs = make_flat_segment(syscall_selector, 0xA09B);
+	msrs.syscall.ss = make_flat_segment(static_cast<uint16_t>(syscall_selector + 8), 0xC093);
+
+	const auto sysret_selector = static_cast<uint16_t>(msrs.star >> 48);
+	msrs.sysret.cs = make_flat_segment(static_cast<uint16_t>((sysret_selector + 16) | 3), 0xA0FB);
+	msrs.sysret.ss = make_flat_segment(static_cast<uint16_t>((sysret_selector + 8) | 3), 0xC0F3);
+}
+
+bool is_syscall_msr(const uint32_t msr)
+{
+	return msr == IA32_STAR || msr == IA32_LSTAR || msr == IA32_FMASK;
 }
 
-void vmx_enable_syscall_hooks(const bool enable)
+void set_msr_write_trap(vmx::state& vm_state, const uint32_t msr, const bool trap)
+{
+	constexpr uint32_t high_msr_base = 0xC0000000;
+	constexpr uint32_t msr_range_size = 0x2000;
+	constexpr size_t write_low_offset = 0x800;
+	constexpr size_t write_high_offset = 0xC00;
+
+	size_t offset{};
+	uint32_t index{};
+
+	if (msr < msr_range_size)
+	{
+		offset = write_low_offset;
+		index = msr;
+	}
+	else if (msr >= high_msr_base && msr < high_msr_base + msr_range_size)
+	{
+		offset = write_high_offset;
+		index = msr - high_msr_base;
+	}
+	else
+	{
+		return;
+	}
+
+	auto& bitmap_byte = vm_state.msr_bitmap[offset + index / 8];
+	const auto bit = static_cast<uint8_t>(1 << (index % 8));
+
+	if (trap)
+	{
+		bitmap_byte |= bit;
+	}
+	else
+	{
+		bitmap_byte &= ~bit;
+	}
+}
+
+void apply_syscall_segments(vmx::guest_context& guest_context, const vmx::syscall_segments& segments)
+{
+	guest_context.write(VMCS_GUEST_CS_SELECTOR, segments.cs.selector.flags);
+	guest_context.write(VMCS_GUEST_CS_LIMIT, segments.cs.limit);
+	guest_context.write(VMCS_GUEST_CS_ACCESS_RIGHTS, segments.cs.access_rights.flags);
+	guest_context.write(VMCS_GUEST_CS_BASE, segments.cs.base);
+
+	guest_context.write(VMCS_GUEST_SS_SELECTOR, segments.ss.selector.flags);
+	guest_context.write(VMCS_GUEST_SS_LIMIT, segments.ss.limit);
+	guest_context.write(VMCS_GUEST_SS_ACCESS_RIGHTS, segments.ss.access_rights.flags);
+	guest_context.write(VMCS_GUEST_SS_BASE, segments.ss.base);
+}
+
+void vmx_enable_syscall_hooks(vmx::guest_context& guest_context, vmx::state& vm_state, const bool enable)
 {
 	ULARGE_INTEGER msr{};
 	ia32_efer_register efer_register{};
@@ -553,8 +1077,8 @@ void vmx_enable_syscall_hooks(const bool enable)
 	ia32_vmx_entry_ctls_register entry_ctls_register{};
 
 	vmx_basic_register.flags = __readmsr(IA32_VMX_BASIC);
-	exit_ctls_register.flags = read_vmx(VMCS_CTRL_PRIMARY_VMEXIT_CONTROLS);
-	entry_ctls_register.flags = read_vmx(VMCS_CTRL_VMENTRY_CONTROLS);
+	exit_ctls_register.flags = guest_context.read(VMCS_CTRL_PRIMARY_VMEXIT_CONTROLS);
+	entry_ctls_register.flags = guest_context.read(VMCS_CTRL_VMENTRY_CONTROLS);
 
 	efer_register.flags = __readmsr(IA32_EFER);
 
@@ -569,18 +1093,27 @@ void vmx_enable_syscall_hooks(const bool enable)
 	if (enable)
 	{
 		msr.QuadPart = __readmsr(vmx_basic_register.vmx_controls ? IA32_VMX_TRUE_ENTRY_CTLS : IA32_VMX_ENTRY_CTLS);
-		__vmx_vmwrite(VMCS_CTRL_VMENTRY_CONTROLS, adjust_msr(msr, entry_ctls_register.flags));
+		guest_context.write(VMCS_CTRL_VMENTRY_CONTROLS, adjust_msr(msr, entry_ctls_register.flags));
 
 		msr.QuadPart = __readmsr(vmx_basic_register.vmx_controls ? IA32_VMX_TRUE_EXIT_CTLS : IA32_VMX_EXIT_CTLS);
-		__vmx_vmwrite(VMCS_CTRL_PRIMARY_VMEXIT_CONTROLS, adjust_msr(msr, exit_ctls_register.flags));
+		guest_context.write(VMCS_CTRL_PRIMARY_VMEXIT_CONTROLS, adjust_msr(msr, exit_ctls_register.flags));
 	}
 
-	__vmx_vmwrite(VMCS_GUEST_EFER, efer_register.flags);
+	guest_context.write(VMCS_GUEST_EFER, efer_register.flags);
+
+	set_exception_bit(guest_context, invalid_opcode, enable);
 
-	set_exception_bit(invalid_opcode, enable);
+	if (enable)
+	{
+		capture_syscall_msrs(vm_state.syscall_msrs);
+	}
+
+	set_msr_write_trap(vm_state, IA32_STAR, enable);
+	set_msr_write_trap(vm_state, IA32_LSTAR, enable);
+	set_msr_write_trap(vm_state, IA32_FMASK, enable);
 }
 
-enum class syscall_state
+enum class syscall_state : uint8_t
 {
 	is_sysret,
 	is_syscall,
@@ -588,54 +1121,34 @@ enum class syscall_state
 	none,
 };
 
-class scoped_cr3_switch
+bool is_five_level_paging(vmx::guest_context& guest_context)
 {
-public:
-	scoped_cr3_switch()
-	{
-		original_cr3_.flags = __readcr3();
-	}
-
-	scoped_cr3_switch(const cr3 new_cr3)
-		: scoped_cr3_switch()
-	{
-		this->set_cr3(new_cr3);
-	}
-
-	scoped_cr3_switch(const scoped_cr3_switch&) = delete;
-	scoped_cr3_switch& operator=(const scoped_cr3_switch&) = delete;
-
-	scoped_cr3_switch(scoped_cr3_switch&&) = delete;
-	scoped_cr3_switch& operator=(scoped_cr3_switch&&) = delete;
-
-	~scoped_cr3_switch()
-	{
-		__writecr3(original_cr3_.flags);
-	}
+	constexpr auto CR4_LA57 = 1ULL << 12;
+	return (guest_context.read(VMCS_GUEST_CR4) & CR4_LA57) != 0;
+}
 
-	void set_cr3(const cr3 new_cr3)
+// Guest memory is read by walking the guest's own page tables, never through OS APIs.
+// The physical address of the base is stored if requested.
+template <size_t Length>
+bool read_data_or_page_fault(vmx::guest_context& guest_context, uint8_t (&array)[Length],
+                             const uint64_t base, uint64_t* physical_base = nullptr)
+{
+	const auto read_entry = [](const uint64_t physical_address, uint64_t& entry)
 	{
-		this->must_restore_ = true;
-		__writecr3(new_cr3.flags);
-	}
+		return host_memory::read(physical_address, &entry, sizeof(entry));
+	};
 
-private:
-	bool must_restore_{false};
-	cr3 original_cr3_{};
-};
+	// User CR3s under KPTI still map user code, so no address space switch is needed
+	const auto guest_cr3 = guest_context.read(VMCS_GUEST_CR3);
+	const auto five_level = is_five_level_paging(guest_context);
 
-template <size_t Length>
-bool read_data_or_page_fault(uint8_t (&array)[Length], const uint8_t* base)
-{
 	for (size_t offset = 0; offset < Length;)
 	{
-		auto* current_base = base + offset;
+		const auto current_base = base + offset;
 		auto* current_destination = array + offset;
 		auto read_length = Length - offset;
 
-		const auto* page_start = static_cast<uint8_t*>(PAGE_ALIGN(current_base));
-		const auto* next_page = page_start + PAGE_SIZE;
-
+		const auto next_page = (current_base & ~static_cast<uint64_t>(PAGE_SIZE - 1)) + PAGE_SIZE;
 		if (current_base + read_length > next_page)
 		{
 			read_length = next_page - current_base;
@@ -643,15 +1156,19 @@ bool read_data_or_page_fault(uint8_t (&array)[Length], const uint8_t* base)
 
 		offset += read_length;
 
-		const auto physical_base = memory::get_physical_address(const_cast<uint8_t*>(current_base));
-
-		if (!physical_base)
+		paging::translation translation{};
+		if (!paging::translate(read_entry, guest_cr3, current_base, five_level, translation))
 		{
-			inject_page_fault(current_base);
+			inject_page_fault(guest_context, current_base);
 			return false;
 		}
 
-		if (!memory::read_physical_memory(current_destination, physical_base, read_length))
+		if (physical_base && current_base == base)
+		{
+			*physical_base = translation.physical_address;
+		}
+
+		if (!host_memory::read(translation.physical_address, current_destination, read_length))
 		{
 			// Not sure if we can recover from that :(
 			return false;
@@ -661,31 +1178,18 @@ bool read_data_or_page_fault(uint8_t (&array)[Length], const uint8_t* base)
 	return true;
 }
 
-syscall_state get_syscall_state(const vmx::guest_context& guest_context)
-{
-	scoped_cr3_switch cr3_switch{};
-
-	constexpr auto PCID_NONE = 0x000;
-	constexpr auto PCID_MASK = 0x003;
-
-	cr3 guest_cr3{};
-	guest_cr3.flags = read_vmx(VMCS_GUEST_CR3);
-
-	if ((guest_cr3.flags & PCID_MASK) != PCID_NONE)
-	{
-		cr3_switch.set_cr3(get_current_process_cr3());
-	}
-
-	const auto* rip = reinterpret_cast<uint8_t*>(guest_context.guest_rip);
+constexpr uint8_t syscall_bytes[] = {0x0F, 0x05};
+constexpr uint8_t sysret_bytes[] = {0x48, 0x0F, 0x07};
 
-	constexpr uint8_t syscall_bytes[] = {0x0F, 0x05};
-	constexpr uint8_t sysret_bytes[] = {0x48, 0x0F, 0x07};
+syscall_state decode_syscall_state(vmx::guest_context& guest_context, uint64_t& physical_rip)
+{
+	const auto rip = guest_context.read(VMCS_GUEST_RIP);
 
 	constexpr auto max_byte_length = max(sizeof(sysret_bytes), sizeof(syscall_bytes));
 
 	uint8_t data[max_byte_length];
 
-	if (!read_data_or_page_fault(data, rip))
+	if (!read_data_or_page_fault(guest_context, data, rip, &physical_rip))
 	{
 		return syscall_state::page_fault;
 	}
@@ -703,10 +1207,81 @@ syscall_state get_syscall_state(const vmx::guest_context& guest_context)
 	return syscall_state::none;
 }
 
-void vmx_handle_exception(vmx::guest_context& guest_context)
+vmx::syscall_decode_entry& get_syscall_decode_entry(vmx::state& vm_state, const uint64_t cr3, const uint64_t rip)
+{
+	const auto index = (rip ^ (rip >> 12) ^ (cr3 >> 12)) % vmx::syscall_decode_cache_size;
+	return vm_state.syscall_decode_cache[index];
+}
+
+// Code can be rewritten in place without causing an exit, so a hit re-checks the opcode bytes.
+// Only decodes within one page are cached, their bytes are read through the direct map.
+bool has_cached_opcode(const vmx::syscall_decode_entry& entry)
+{
+	if (static_cast<syscall_state>(entry.state) == syscall_state::is_syscall)
+	{
+		const auto* code = host_memory::get_direct_map_address(entry.physical_rip, sizeof(syscall_bytes));
+		return code && is_mem_equal(code, syscall_bytes);
+	}
+
+	const auto* code = host_memory::get_direct_map_address(entry.physical_rip, sizeof(sysret_bytes));
+	return code && is_mem_equal(code, sysret_bytes);
+}
+
+syscall_state get_syscall_state(vmx::guest_context& guest_context, vmx::state& vm_state)
+{
+	constexpr auto CR3_ADDRESS_MASK = 0x000FFFFFFFFFF000ULL;
+
+	const auto generation = static_cast<uint32_t>(syscall_decode_generation);
+	const auto cr3 = guest_context.read(VMCS_GUEST_CR3) & CR3_ADDRESS_MASK;
+	const auto rip = guest_context.read(VMCS_GUEST_RIP);
+
+	auto& entry = get_syscall_decode_entry(vm_state, cr3, rip);
+	if (entry.generation == generation && entry.cr3 == cr3 && entry.rip == rip && has_cached_opcode(entry))
+	{
+		return static_cast<syscall_state>(entry.state);
+	}
+
+	uint64_t physical_rip{};
+	const auto state = decode_syscall_state(guest_context, physical_rip);
+
+	constexpr auto max_byte_length = max(sizeof(sysret_bytes), sizeof(syscall_bytes));
+	const auto within_page = (rip & (PAGE_SIZE - 1)) + max_byte_length <= PAGE_SIZE;
+
+	// Only positive results are cached. Faults and genuine #UDs always take the slow path.
+	if (within_page && (state == syscall_state::is_syscall || state == syscall_state::is_sysret))
+	{
+		entry.cr3 = cr3;
+		entry.rip = rip;
+		entry.physical_rip = physical_rip;
+		entry.state = static_cast<uint8_t>(state);
+		entry.generation = generation;
+	}
+
+	return state;
+}
+
+void record_syscall_event(vmx::guest_context& guest_context, const process_id process)
+{
+	const auto& regs = *guest_context.vp_regs;
+
+	syscall_event event{};
+	event.tsc = __rdtsc();
+	event.cr3 = guest_context.read(VMCS_GUEST_CR3);
+	event.syscall_number = regs.Rax;
+	event.arguments[0] = regs.R10;
+	event.arguments[1] = regs.Rdx;
+	event.arguments[2] = regs.R8;
+	event.arguments[3] = regs.R9;
+	event.process_id = process;
+	event.processor = thread::get_processor_index();
+
+	syscall_events::record(event);
+}
+
+void vmx_handle_exception(vmx::guest_context& guest_context, vmx::state& vm_state)
 {
 	vmexit_interrupt_information interrupt{};
-	interrupt.flags = static_cast<uint32_t>(read_vmx(VMCS_VMEXIT_INTERRUPTION_INFORMATION));
+	interrupt.flags = static_cast<uint32_t>(guest_context.read(VMCS_VMEXIT_INTERRUPTION_INFORMATION));
 
 	if (interrupt.interruption_type == non_maskable_interrupt
 		&& interrupt.vector == nmi)
@@ -719,177 +1294,305 @@ void vmx_handle_exception(vmx::guest_context& guest_context)
 	{
 		guest_context.increment_rip = false;
 
-		const auto state = get_syscall_state(guest_context);
+		const auto state = get_syscall_state(guest_context, vm_state);
 
 		if (state == syscall_state::page_fault)
 		{
 			return;
 		}
 
-		const auto proc = process::get_current_process();
-
-		const auto filename = proc.get_image_filename();
-		if (string::equal(filename, "explorer.exe"))
+		// Processes without a filter only pay for a single load before the emulation
+		if (state == syscall_state::is_syscall && syscall_filter::has_targets())
 		{
-			debug_log("Explorer SYSCALL: %d\n", static_cast<uint32_t>(guest_context.vp_regs->Rax));
+			const auto process = process::get_current_process_id();
+			const auto syscall_number = guest_context.vp_regs->Rax;
+
+			if (syscall_filter::should_log(process, syscall_number))
+			{
+				record_syscall_event(guest_context, process);
+			}
 		}
 
+		const auto& msrs = vm_state.syscall_msrs;
+
 		if (state == syscall_state::is_syscall)
 		{
-			const auto instruction_length = read_vmx(VMCS_VMEXIT_INSTRUCTION_LENGTH);
-
-			const auto star = __readmsr(IA32_STAR);
-			const auto lstar = __readmsr(IA32_LSTAR);
-			const auto fmask = __readmsr(IA32_FMASK);
-
-			guest_context.vp_regs->Rcx = guest_context.guest_rip + instruction_length;
-			guest_context.guest_rip = lstar;
-			__vmx_vmwrite(VMCS_GUEST_RIP, guest_context.guest_rip);
-
-
-			guest_context.vp_regs->R11 = guest_context.guest_e_flags;
-			guest_context.guest_e_flags &= ~(fmask | RFLAGS_RESUME_FLAG_FLAG);
-			__vmx_vmwrite(VMCS_GUEST_RFLAGS, guest_context.guest_e_flags);
+			const auto instruction_length = guest_context.read(VMCS_VMEXIT_INSTRUCTION_LENGTH);
+			const auto guest_rip = guest_context.read(VMCS_GUEST_RIP);
+			const auto guest_rflags = guest_context.read(VMCS_GUEST_RFLAGS);
 
+			guest_context.vp_regs->Rcx = guest_rip + instruction_length;
+			guest_context.write(VMCS_GUEST_RIP, msrs.lstar);
 
-			vmx::gdt_entry gdt_entry{};
-			gdt_entry.selector.flags = static_cast<uint16_t>((star >> 32) & ~3);
-			gdt_entry.base = 0;
-			gdt_entry.limit = 0xFFFFF;
-			gdt_entry.access_rights.flags = 0xA09B;
+			guest_context.vp_regs->R11 = guest_rflags;
+			guest_context.write(VMCS_GUEST_RFLAGS, guest_rflags & ~(msrs.fmask | RFLAGS_RESUME_FLAG_FLAG));
 
-			__vmx_vmwrite(VMCS_GUEST_CS_SELECTOR, gdt_entry.selector.flags);
-			__vmx_vmwrite(VMCS_GUEST_CS_LIMIT, gdt_entry.limit);
-			__vmx_vmwrite(VMCS_GUEST_CS_ACCESS_RIGHTS, gdt_entry.access_rights.flags);
-			__vmx_vmwrite(VMCS_GUEST_CS_BASE, gdt_entry.base);
-
-			gdt_entry = {};
-			gdt_entry.selector.flags = static_cast<uint16_t>(((star >> 32) & ~3) + 8);
-			gdt_entry.base = 0;
-			gdt_entry.limit = 0xFFFFF;
-			gdt_entry.access_rights.flags = 0xC093;
-
-			__vmx_vmwrite(VMCS_GUEST_SS_SELECTOR, gdt_entry.selector.flags);
-			__vmx_vmwrite(VMCS_GUEST_SS_LIMIT, gdt_entry.limit);
-			__vmx_vmwrite(VMCS_GUEST_SS_ACCESS_RIGHTS, gdt_entry.access_rights.flags);
-			__vmx_vmwrite(VMCS_GUEST_SS_BASE, gdt_entry.base);
+			apply_syscall_segments(guest_context, msrs.syscall);
 		}
 		else if (state == syscall_state::is_sysret)
 		{
-			const auto star = __readmsr(IA32_STAR);
-
 			guest_context.vp_regs->Rip = guest_context.vp_regs->Rcx;
-			__vmx_vmwrite(VMCS_GUEST_RIP, guest_context.vp_regs->Rip);
-
-			guest_context.guest_e_flags = (guest_context.vp_regs->R11 & 0x3C7FD7) | 2;
-			__vmx_vmwrite(VMCS_GUEST_RFLAGS, guest_context.guest_e_flags);
-
-			vmx::gdt_entry gdt_entry{};
-			gdt_entry.selector.flags = static_cast<uint16_t>(((star >> 48) + 16) | 3);
-			gdt_entry.base = 0;
-			gdt_entry.limit = 0xFFFFF;
-			gdt_entry.access_rights.flags = 0xA0FB;
-
-			__vmx_vmwrite(VMCS_GUEST_CS_SELECTOR, gdt_entry.selector.flags);
-			__vmx_vmwrite(VMCS_GUEST_CS_LIMIT, gdt_entry.limit);
-			__vmx_vmwrite(VMCS_GUEST_CS_ACCESS_RIGHTS, gdt_entry.access_rights.flags);
-			__vmx_vmwrite(VMCS_GUEST_CS_BASE, gdt_entry.base);
-
-			gdt_entry = {};
-			gdt_entry.selector.flags = static_cast<uint16_t>(((star >> 48) + 8) | 3);
-			gdt_entry.base = 0;
-			gdt_entry.limit = 0xFFFFF;
-			gdt_entry.access_rights.flags = 0xC0F3;
-
-			__vmx_vmwrite(VMCS_GUEST_SS_SELECTOR, gdt_entry.selector.flags);
-			__vmx_vmwrite(VMCS_GUEST_SS_LIMIT, gdt_entry.limit);
-			__vmx_vmwrite(VMCS_GUEST_SS_ACCESS_RIGHTS, gdt_entry.access_rights.flags);
-			__vmx_vmwrite(VMCS_GUEST_SS_BASE, gdt_entry.base);
+			guest_context.write(VMCS_GUEST_RIP, guest_context.vp_regs->Rip);
+
+			guest_context.write(VMCS_GUEST_RFLAGS, (guest_context.vp_regs->R11 & 0x3C7FD7) | 2);
+
+			apply_syscall_segments(guest_context, msrs.sysret);
 		}
 		else
 		{
-			inject_invalid_opcode();
+			inject_invalid_opcode(guest_context);
 		}
 	}
 	else
 	{
-		__vmx_vmwrite(VMCS_CTRL_VMENTRY_INTERRUPTION_INFORMATION_FIELD, interrupt.flags);
+		guest_context.write(VMCS_CTRL_VMENTRY_INTERRUPTION_INFORMATION_FIELD, interrupt.flags);
 		if (interrupt.error_code_valid)
 		{
-			__vmx_vmwrite(VMCS_CTRL_VMENTRY_EXCEPTION_ERROR_CODE, read_vmx(VMCS_VMEXIT_INTERRUPTION_ERROR_CODE));
+			guest_context.write(VMCS_CTRL_VMENTRY_EXCEPTION_ERROR_CODE,
+			                    guest_context.read(VMCS_VMEXIT_INTERRUPTION_ERROR_CODE));
 		}
 	}
 }
 
-bool is_system()
+bool is_system(vmx::guest_context& guest_context)
+{
+	return (guest_context.read(VMCS_GUEST_CS_SELECTOR) & SEGMENT_ACCESS_RIGHTS_DESCRIPTOR_PRIVILEGE_LEVEL_MASK) == DPL_SYSTEM;
+}
+
+constexpr bool cpuid_uses_subleaf(const uint32_t leaf)
+{
+	switch (leaf)
+	{
+	case 0x4:
+	case 0x7:
+	case 0xB:
+	case 0xD:
+	case 0xF:
+	case 0x10:
+	case 0x12:
+	case 0x14:
+	case 0x17:
+	case 0x18:
+	case 0x1B:
+	case 0x1D:
+	case 0x1E:
+	case 0x1F:
+	case 0x20:
+	case 0x23:
+	case 0x24:
+	case 0x8000001D:
+	case 0x80000020:
+	case 0x80000026:
+		return true;
+	default:
+		return false;
+	}
+}
+
+constexpr bool is_cpuid_cacheable(const uint32_t leaf)
+{
+	// Leaf 0xD reports sizes that depend on the current XCR0
+	return leaf != 0xD;
+}
+
+void execute_cpuid(const uint32_t leaf, const uint32_t subleaf, int32_t cpu_info[4])
+{
+	__cpuidex(cpu_info, static_cast<int32_t>(leaf), static_cast<int32_t>(subleaf));
+
+	if (leaf == CPUID_VERSION_INFORMATION)
+	{
+		cpu_info[2] |= HYPERV_HYPERVISOR_PRESENT_BIT;
+	}
+	else if (leaf == HYPERV_CPUID_INTERFACE)
+	{
+		cpu_info[0] = 'momo';
+	}
+}
+
+vmx::cpuid_cache_entry& get_cpuid_cache_entry(vmx::state& vm_state, const uint32_t leaf, const uint32_t subleaf)
+{
+	const auto hash = (leaf ^ (leaf >> 24) ^ (subleaf * 7)) & (vmx::cpuid_cache_size - 1);
+	return vm_state.cpuid_cache[hash];
+}
+
+// The cache is per core, so per-core values like the APIC IDs in leaves 0x1, 0xB and 0x1F stay correct
+void query_cpuid(vmx::state& vm_state, const uint32_t leaf, uint32_t subleaf, int32_t cpu_info[4])
+{
+	if (!is_cpuid_cacheable(leaf))
+	{
+		execute_cpuid(leaf, subleaf, cpu_info);
+		return;
+	}
+
+	if (!cpuid_uses_subleaf(leaf))
+	{
+		subleaf = 0;
+	}
+
+	auto& entry = get_cpuid_cache_entry(vm_state, leaf, subleaf);
+	if (entry.valid && entry.leaf == leaf && entry.subleaf == subleaf)
+	{
+		++vm_state.stats.cpuid_cache_hits;
+		memcpy(cpu_info, entry.registers, sizeof(entry.registers));
+		return;
+	}
+
+	++vm_state.stats.cpuid_cache_misses;
+	execute_cpuid(leaf, subleaf, cpu_info);
+
+	entry.leaf = leaf;
+	entry.subleaf = subleaf;
+	memcpy(entry.registers, cpu_info, sizeof(entry.registers));
+	entry.valid = true;
+}
+
+// Bits mirroring guest control registers are patched on every query instead of being cached
+void apply_dynamic_cpuid_bits(vmx::guest_context& guest_context, const uint32_t leaf, const uint32_t subleaf,
+                              int32_t cpu_info[4])
+{
+	constexpr int32_t osxsave_bit = 1 << 27;
+	constexpr int32_t ospke_bit = 1 << 4;
+
+	if (leaf != CPUID_VERSION_INFORMATION && (leaf != CPUID_STRUCTURED_EXTENDED_FEATURE_FLAGS || subleaf != 0))
+	{
+		return;
+	}
+
+	cr4 guest_cr4{};
+	guest_cr4.flags = guest_context.read(VMCS_GUEST_CR4);
+
+	if (leaf == CPUID_VERSION_INFORMATION)
+	{
+		cpu_info[2] = guest_cr4.os_xsave ? (cpu_info[2] | osxsave_bit) : (cpu_info[2] & ~osxsave_bit);
+	}
+	else
+	{
+		cpu_info[2] = guest_cr4.protection_key_enable ? (cpu_info[2] | ospke_bit) : (cpu_info[2] & ~ospke_bit);
+	}
+}
+
+void prefill_cpuid_cache(vmx::state& vm_state)
 {
-	return (read_vmx(VMCS_GUEST_CS_SELECTOR) & SEGMENT_ACCESS_RIGHTS_DESCRIPTOR_PRIVILEGE_LEVEL_MASK) == DPL_SYSTEM;
+	memset(vm_state.cpuid_cache, 0, sizeof(vm_state.cpuid_cache));
+
+	constexpr uint32_t common_leaves[] = {
+		CPUID_SIGNATURE,
+		CPUID_VERSION_INFORMATION,
+		CPUID_STRUCTURED_EXTENDED_FEATURE_FLAGS,
+		CPUID_EXTENDED_FUNCTION_INFORMATION,
+		CPUID_EXTENDED_CPU_SIGNATURE,
+		HYPERV_CPUID_VENDOR_AND_MAX_FUNCTIONS,
+		HYPERV_CPUID_INTERFACE,
+	};
+
+	int32_t cpu_info[4];
+	for (const auto leaf : common_leaves)
+	{
+		query_cpuid(vm_state, leaf, 0, cpu_info);
+	}
+
+	vm_state.stats = {};
 }
 
-void vmx_handle_cpuid(vmx::guest_context& guest_context)
+void vmx_handle_cpuid(vmx::guest_context& guest_context, vmx::state& vm_state)
 {
 	if (guest_context.vp_regs->Rax == 0x41414141 &&
 		guest_context.vp_regs->Rcx == 0x42424243 &&
-		is_system())
+		is_system(guest_context))
 	{
-		vmx_enable_syscall_hooks(true);
+		vmx_enable_syscall_hooks(guest_context, vm_state, true);
 		return;
 	}
 
-	INT32 cpu_info[4];
+	if (guest_context.vp_regs->Rax == 0x41414141 &&
+		guest_context.vp_regs->Rcx == hypercall_invalidate &&
+		is_system(guest_context))
+	{
+		vm_state.ept->invalidate();
+		return;
+	}
 
 	if (guest_context.vp_regs->Rax == 0x41414141 &&
 		guest_context.vp_regs->Rcx == 0x42424242 &&
-		is_system())
+		is_system(guest_context))
 	{
 		guest_context.exit_vm = true;
 		return;
 	}
 
-	__cpuidex(cpu_info, static_cast<int32_t>(guest_context.vp_regs->Rax),
-	          static_cast<int32_t>(guest_context.vp_regs->Rcx));
+	const auto start = __rdtsc();
+
+	const auto leaf = static_cast<uint32_t>(guest_context.vp_regs->Rax);
+	const auto subleaf = static_cast<uint32_t>(guest_context.vp_regs->Rcx);
+
+	int32_t cpu_info[4];
+	query_cpuid(vm_state, leaf, subleaf, cpu_info);
+	apply_dynamic_cpuid_bits(guest_context, leaf, subleaf, cpu_info);
+
+	guest_context.vp_regs->Rax = static_cast<uint32_t>(cpu_info[0]);
+	guest_context.vp_regs->Rbx = static_cast<uint32_t>(cpu_info[1]);
+	guest_context.vp_regs->Rcx = static_cast<uint32_t>(cpu_info[2]);
+	guest_context.vp_regs->Rdx = static_cast<uint32_t>(cpu_info[3]);
+
+	++vm_state.stats.cpuid_exits;
+	vm_state.stats.cpuid_cycles += __rdtsc() - start;
+}
+
+void vmx_handle_xsetbv(vmx::guest_context& guest_context, vmx::state& /*vm_state*/)
+{
+	_xsetbv(static_cast<uint32_t>(guest_context.vp_regs->Rcx),
+	        guest_context.vp_regs->Rdx << 32 | guest_context.vp_regs->Rax);
+}
+
+void vmx_handle_wrmsr(vmx::guest_context& guest_context, vmx::state& vm_state)
+{
+	const auto msr = static_cast<uint32_t>(guest_context.vp_regs->Rcx);
 
-	if (guest_context.vp_regs->Rax == 1)
+	// Only the syscall MSRs are trapped in the bitmap. Writes outside the bitmap ranges
+	// are dropped, as they were before this handler existed.
+	if (!is_syscall_msr(msr))
 	{
-		cpu_info[2] |= HYPERV_HYPERVISOR_PRESENT_BIT;
+		return;
 	}
-	else if (guest_context.vp_regs->Rax == HYPERV_CPUID_INTERFACE)
+
+	const auto value = (guest_context.vp_regs->Rdx << 32) | (guest_context.vp_regs->Rax & 0xFFFFFFFF);
+	__writemsr(msr, value);
+
+	capture_syscall_msrs(vm_state.syscall_msrs);
+}
+
+void vmx_handle_vmx(vmx::guest_context& guest_context, vmx::state& /*vm_state*/)
+{
+	const auto guest_rflags = guest_context.read(VMCS_GUEST_RFLAGS);
+	guest_context.write(VMCS_GUEST_RFLAGS, guest_rflags | 0x1); // VM_FAIL_INVALID
+}
+
+// User mode reaches this as well, only the session key authenticates the caller
+void vmx_handle_vmcall(vmx::guest_context& guest_context, vmx::state& vm_state)
+{
+	if (guest_context.vp_regs->Rcx != hypercall_session_magic)
 	{
-		cpu_info[0] = 'momo';
+		vmx_handle_vmx(guest_context, vm_state);
+		return;
 	}
 
-	guest_context.vp_regs->Rax = cpu_info[0];
-	guest_context.vp_regs->Rbx = cpu_info[1];
-	guest_context.vp_regs->Rcx = cpu_info[2];
-	guest_context.vp_regs->Rdx = cpu_info[3];
+	guest_context.vp_regs->Rax = hypercall::execute(guest_context.vp_regs->Rdx, guest_context.vp_regs->R8);
 }
 
-void vmx_handle_xsetbv(const vmx::guest_context& guest_context)
+void vmx_handle_ept_violation(vmx::guest_context& guest_context, vmx::state& vm_state)
 {
-	_xsetbv(static_cast<uint32_t>(guest_context.vp_regs->Rcx),
-	        guest_context.vp_regs->Rdx << 32 | guest_context.vp_regs->Rax);
+	vm_state.ept->handle_violation(guest_context);
 }
 
-void vmx_handle_vmx(vmx::guest_context& guest_context)
+void vmx_handle_ept_misconfiguration(vmx::guest_context& guest_context, vmx::state& vm_state)
 {
-	guest_context.guest_e_flags |= 0x1; // VM_FAIL_INVALID
-	__vmx_vmwrite(VMCS_GUEST_RFLAGS, guest_context.guest_e_flags);
+	vm_state.ept->handle_misconfiguration(guest_context);
 }
 
-void vmx_dispatch_vm_exit(vmx::guest_context& guest_context, const vmx::state& vm_state)
+constexpr bool is_vmx_instruction_exit(const uint32_t exit_reason)
 {
-	switch (guest_context.exit_reason)
+	switch (exit_reason)
 	{
-	case VMX_EXIT_REASON_EXECUTE_CPUID:
-		vmx_handle_cpuid(guest_context);
-		break;
-	case VMX_EXIT_REASON_EXECUTE_INVD:
-		vmx_handle_invd();
-		break;
-	case VMX_EXIT_REASON_EXECUTE_XSETBV:
-		vmx_handle_xsetbv(guest_context);
-		break;
-	case VMX_EXIT_REASON_EXECUTE_VMCALL:
 	case VMX_EXIT_REASON_EXECUTE_VMCLEAR:
 	case VMX_EXIT_REASON_EXECUTE_VMLAUNCH:
 	case VMX_EXIT_REASON_EXECUTE_VMPTRLD:
@@ -899,65 +1602,152 @@ void vmx_dispatch_vm_exit(vmx::guest_context& guest_context, const vmx::state& v
 	case VMX_EXIT_REASON_EXECUTE_VMWRITE:
 	case VMX_EXIT_REASON_EXECUTE_VMXOFF:
 	case VMX_EXIT_REASON_EXECUTE_VMXON:
-		vmx_handle_vmx(guest_context);
-		break;
-	case VMX_EXIT_REASON_EPT_VIOLATION:
-		vm_state.ept->handle_violation(guest_context);
-		break;
-	case VMX_EXIT_REASON_EPT_MISCONFIGURATION:
-		vm_state.ept->handle_misconfiguration(guest_context);
-		break;
-	case VMX_EXIT_REASON_EXCEPTION_OR_NMI:
-		vmx_handle_exception(guest_context);
-		break;
-	//case VMX_EXIT_REASON_EXECUTE_RDTSC:
-	//	break;
+		return true;
 	default:
-		break;
+		return false;
+	}
+}
+
+namespace vmx
+{
+	template <>
+	struct exit_handler<VMX_EXIT_REASON_EXECUTE_CPUID>
+		: exit_handler_registration<vmx_handle_cpuid>
+	{
+	};
+
+	template <>
+	struct exit_handler<VMX_EXIT_REASON_EXECUTE_INVD>
+		: exit_handler_registration<vmx_handle_invd>
+	{
+	};
+
+	template <>
+	struct exit_handler<VMX_EXIT_REASON_EXECUTE_XSETBV>
+		: exit_handler_registration<vmx_handle_xsetbv>
+	{
+	};
+
+	template <>
+	struct exit_handler<VMX_EXIT_REASON_EXECUTE_WRMSR>
+		: exit_handler_registration<vmx_handle_wrmsr>
+	{
+	};
+
+	template <>
+	struct exit_handler<VMX_EXIT_REASON_EXECUTE_VMCALL>
+		: exit_handler_registration<vmx_handle_vmcall>
+	{
+	};
+
+	template <uint32_t ExitReason>
+		requires(is_vmx_instruction_exit(ExitReason))
+	struct exit_handler<ExitReason>
+		: exit_handler_registration<vmx_handle_vmx>
+	{
+	};
+
+	// The instruction length is undefined for the following exits, so they must never advance RIP
+	template <>
+	struct exit_handler<VMX_EXIT_REASON_EPT_VIOLATION>
+		: exit_handler_registration<vmx_handle_ept_violation, exit_flag_needs_exit_qualification |
+		                            exit_flag_needs_guest_physical_address>
+	{
+	};
+
+	template <>
+	struct exit_handler<VMX_EXIT_REASON_EPT_MISCONFIGURATION>
+		: exit_handler_registration<vmx_handle_ept_misconfiguration, exit_flag_none>
+	{
+	};
+
+	template <>
+	struct exit_handler<VMX_EXIT_REASON_EXCEPTION_OR_NMI>
+		: exit_handler_registration<vmx_handle_exception, exit_flag_needs_guest_rip>
+	{
+	};
+}
+
+constexpr auto exit_handlers = vmx::make_exit_handler_table();
+
+void prefetch_exit_fields(vmx::guest_context& guest_context, const uint32_t flags)
+{
+	if (flags & vmx::exit_flag_needs_exit_qualification)
+	{
+		(void)guest_context.read(VMCS_EXIT_QUALIFICATION);
+	}
+
+	if (flags & vmx::exit_flag_needs_guest_physical_address)
+	{
+		(void)guest_context.read(VMCS_GUEST_PHYSICAL_ADDRESS);
+	}
+
+	if (flags & (vmx::exit_flag_needs_guest_rip | vmx::exit_flag_advances_rip))
+	{
+		(void)guest_context.read(VMCS_GUEST_RIP);
+	}
+}
+
+void vmx_dispatch_vm_exit(vmx::guest_context& guest_context, vmx::state& vm_state)
+{
+	const auto& entry = exit_handlers[guest_context.exit_reason];
+	guest_context.increment_rip = (entry.flags & vmx::exit_flag_advances_rip) != 0;
+
+	prefetch_exit_fields(guest_context, entry.flags);
+
+	if (entry.handler)
+	{
+		entry.handler(guest_context, vm_state);
 	}
 
 	if (guest_context.increment_rip)
 	{
-		guest_context.guest_rip += read_vmx(VMCS_VMEXIT_INSTRUCTION_LENGTH);
-		__vmx_vmwrite(VMCS_GUEST_RIP, guest_context.guest_rip);
+		const auto guest_rip = guest_context.read(VMCS_GUEST_RIP);
+		guest_context.write(VMCS_GUEST_RIP, guest_rip + guest_context.read(VMCS_VMEXIT_INSTRUCTION_LENGTH));
 	}
 }
 
-extern "C" [[ noreturn ]] void vm_exit_handler(CONTEXT* context)
+// Returns true when leaving VMX, the stub then restores the full context instead of resuming
+extern "C" bool vm_exit_handler(CONTEXT* context, const uint64_t entry_tsc)
 {
 	auto* vm_state = resolve_vm_state_from_context(*context);
+	vm_state->exit_reason = read_vmx(VMCS_EXIT_REASON) & 0xFFFF;
 
-	vmx::guest_context guest_context{};
-	guest_context.guest_e_flags = read_vmx(VMCS_GUEST_RFLAGS);
-	guest_context.guest_rip = read_vmx(VMCS_GUEST_RIP);
-	guest_context.guest_rsp = read_vmx(VMCS_GUEST_RSP);
-	guest_context.guest_physical_address = read_vmx(VMCS_GUEST_PHYSICAL_ADDRESS);
-	guest_context.exit_reason = read_vmx(VMCS_EXIT_REASON) & 0xFFFF;
-	guest_context.exit_qualification = read_vmx(VMCS_EXIT_QUALIFICATION);
-	guest_context.vp_regs = context;
-	guest_context.exit_vm = false;
-	guest_context.increment_rip = true;
+	vmx::guest_context guest_context{context};
+	guest_context.exit_reason = vm_state->exit_reason;
 
 	vmx_dispatch_vm_exit(guest_context, *vm_state);
 
 	if (guest_context.exit_vm)
 	{
 		context->Rcx = 0x43434343;
-		context->Rsp = guest_context.guest_rsp;
-		context->Rip = guest_context.guest_rip;
-		context->EFlags = static_cast<uint32_t>(guest_context.guest_e_flags);
+		context->Rsp = guest_context.read(VMCS_GUEST_RSP);
+		context->Rip = guest_context.read(VMCS_GUEST_RIP);
+		context->EFlags = static_cast<uint32_t>(guest_context.read(VMCS_GUEST_RFLAGS));
 
 		restore_descriptor_tables(vm_state->launch_context);
 
-		__writecr3(read_vmx(VMCS_GUEST_CR3));
+		__writecr3(guest_context.read(VMCS_GUEST_CR3));
 		__vmx_off();
+
+		return true;
 	}
-	else
-	{
-		context->Rip = reinterpret_cast<uint64_t>(resume_vmx);
-	}
 
-	restore_context(context);
+	guest_context.flush();
+
+	const auto cycles = __rdtsc() - entry_tsc;
+	auto& stats = vm_state->stats;
+
+	++stats.exits;
+	stats.exit_cycles += cycles;
+
+	return false;
+}
+
+extern "C" [[ noreturn ]] void vm_resume_failed()
+{
+	const auto error_code = read_vmx(VMCS_VM_INSTRUCTION_ERROR);
+	KeBugCheckEx(DRIVER_VIOLATION, 2, error_code, 0, 0);
 }
 
 void setup_vmcs_for_cpu(vmx::state& vm_state)
@@ -972,7 +1762,7 @@ void setup_vmcs_for_cpu(vmx::state& vm_state)
 	{
 		const auto vmx_eptp = vm_state.ept->get_ept_pointer();
 		__vmx_vmwrite(VMCS_CTRL_EPT_POINTER, vmx_eptp.flags);
-		__vmx_vmwrite(VMCS_CTRL_VIRTUAL_PROCESSOR_IDENTIFIER, 1);
+		__vmx_vmwrite(VMCS_CTRL_VIRTUAL_PROCESSOR_IDENTIFIER, vm_state.vpid);
 	}
 
 	__vmx_vmwrite(VMCS_CTRL_MSR_BITMAP_ADDRESS, launch_context->msr_bitmap_physical_address);
@@ -1077,7 +1867,7 @@ void setup_vmcs_for_cpu(vmx::state& vm_state)
 	__vmx_vmwrite(VMCS_HOST_CR0, state->cr0);
 	__vmx_vmwrite(VMCS_GUEST_CR0, state->cr0);
 
-	__vmx_vmwrite(VMCS_HOST_CR3, launch_context->system_directory_table_base);
+	__vmx_vmwrite(VMCS_HOST_CR3, host_memory::get_cr3());
 	__vmx_vmwrite(VMCS_GUEST_CR3, state->cr3);
 
 	__vmx_vmwrite(VMCS_HOST_CR4, state->cr4);
@@ -1110,12 +1900,22 @@ void initialize_msrs(vmx::launch_context& launch_context)
 
 [[ noreturn ]] void launch_hypervisor(vmx::state& vm_state)
 {
+	auto& timing = vm_state.bringup;
+
+	auto start = __rdtsc();
 	initialize_msrs(vm_state.launch_context);
-	//vm_state.ept->initialize();
+	timing.msr_capture = __rdtsc() - start;
 
+	start = __rdtsc();
 	enter_root_mode_on_cpu(vm_state);
+	timing.vmxon = __rdtsc() - start;
+
+	start = __rdtsc();
 	setup_vmcs_for_cpu(vm_state);
+	timing.vmcs_setup = __rdtsc() - start;
 
+	// Completed in enable_core, once the guest continues after the launch
+	timing.phase_start = __rdtsc();
 	auto error_code = launch_vmx();
 	throw std::runtime_error(string::va("Failed to launch vmx: %X", error_code));
 }
@@ -1125,6 +1925,12 @@ void hypervisor::enable_core(const uint64_t system_directory_table_base)
 {
 	debug_log("Enabling hypervisor on core %d\n", thread::get_processor_index());
 	auto* vm_state = this->get_current_vm_state();
+	if (!vm_state)
+	{
+		throw std::runtime_error("No VM state for this core");
+	}
+
+	const auto start = __rdtsc();
 
 	if (!is_vmx_supported())
 	{
@@ -1138,6 +1944,9 @@ void hypervisor::enable_core(const uint64_t system_directory_table_base)
 
 	vm_state->launch_context.launched = false;
 	vm_state->launch_context.system_directory_table_base = system_directory_table_base;
+	vm_state->vpid = vmx::make_vpid(thread::get_processor_index());
+
+	prefill_cpuid_cache(*vm_state);
 
 	// Must be inlined here, otherwise the stack is broken
 	capture_cpu_context(vm_state->launch_context);
@@ -1147,12 +1956,18 @@ void hypervisor::enable_core(const uint64_t system_directory_table_base)
 		launch_hypervisor(*vm_state);
 	}
 
+	auto& timing = vm_state->bringup;
+	timing.launch = __rdtsc() - timing.phase_start;
+
 	if (!is_hypervisor_present())
 	{
 		throw std::runtime_error("Hypervisor is not present");
 	}
 
 	enable_syscall_hooking();
+
+	timing.total = __rdtsc() - start;
+	timing.succeeded = true;
 }
 
 void hypervisor::disable_core()
@@ -1169,36 +1984,111 @@ void hypervisor::disable_core()
 	}
 }
 
-void hypervisor::allocate_vm_states()
+void hypervisor::allocate_epts()
 {
-	if (!this->ept_)
+	if (this->epts_)
+	{
+		return;
+	}
+
+	// Remote page walks are what replicas avoid, a single node gains nothing from them
+	this->ept_count_ = replicate_ept_per_node ? thread::get_node_count() : 1;
+	this->epts_ = new vmx::ept*[this->ept_count_]{};
+
+	for (auto i = 0u; i < this->ept_count_; ++i)
 	{
-		this->ept_ = memory::allocate_aligned_object<vmx::ept>();
-		if (!this->ept_)
+		this->epts_[i] = memory::allocate_aligned_object_on_node<vmx::ept>(i);
+		if (!this->epts_[i])
+		{
+			this->epts_[i] = memory::allocate_aligned_object<vmx::ept>();
+		}
+
+		if (!this->epts_[i])
 		{
 			throw std::runtime_error("Failed to allocate ept object");
 		}
 	}
+}
+
+void hypervisor::free_epts()
+{
+	if (!this->epts_)
+	{
+		return;
+	}
+
+	for (auto i = 0u; i < this->ept_count_; ++i)
+	{
+		memory::free_aligned_object(this->epts_[i]);
+	}
+
+	delete[] this->epts_;
+	this->epts_ = nullptr;
+	this->ept_count_ = 0;
+}
+
+void hypervisor::allocate_vm_states()
+{
+	this->allocate_epts();
 
 	if (this->vm_states_)
 	{
 		throw std::runtime_error("VM states are still in use");
 	}
 
-	// As Windows technically supports cpu hot-plugging, keep track of the allocation count.
-	// However virtualizing the hot-plugged cpu won't be supported here.
-	this->vm_state_count_ = thread::get_processor_count();
+	// The slot array never moves, so hot-added processors can be published without locking readers out
+	this->vm_state_count_ = thread::get_max_processor_count();
 	this->vm_states_ = new vmx::state*[this->vm_state_count_]{};
 
-	for (auto i = 0u; i < this->vm_state_count_; ++i)
+	const auto active_count = min(thread::get_processor_count(), this->vm_state_count_);
+	for (auto i = 0u; i < active_count; ++i)
 	{
-		this->vm_states_[i] = memory::allocate_aligned_object<vmx::state>();
-		if (!this->vm_states_[i])
+		if (!this->allocate_vm_state(i))
 		{
 			throw std::runtime_error("Failed to allocate VM state entries");
 		}
+	}
+
+	this->log_vm_state_placement();
+}
+
+vmx::state* hypervisor::allocate_vm_state(const uint32_t processor_index)
+{
+	// VM exits touch the VMCS, MSR bitmap and host stack constantly, keep them on the core's own node
+	const auto node = thread::get_processor_node(processor_index);
+	auto* vm_state = memory::allocate_aligned_object_on_node<vmx::state>(node);
+	if (!vm_state)
+	{
+		return nullptr;
+	}
+
+	vm_state->ept = this->epts_[node % this->ept_count_];
+	vm_state->node = node;
+
+	auto* slot = reinterpret_cast<PVOID volatile*>(&this->vm_states_[processor_index]);
+	auto* existing = static_cast<vmx::state*>(InterlockedCompareExchangePointer(slot, vm_state, nullptr));
+	if (existing)
+	{
+		memory::free_aligned_object(vm_state);
+		return existing;
+	}
+
+	InterlockedIncrement(&this->active_vm_state_count_);
+	return vm_state;
+}
+
+void hypervisor::log_vm_state_placement() const
+{
+	for (auto i = 0u; i < this->vm_state_count_; ++i)
+	{
+		const auto* vm_state = this->get_vm_state(i);
+		if (!vm_state)
+		{
+			continue;
+		}
 
-		this->vm_states_[i]->ept = this->ept_;
+		debug_log("Core %u: node %u, vm state %p (physical %llX), ept %p\n", i, vm_state->node, vm_state,
+		          memory::get_physical_address(vm_state), vm_state->ept);
 	}
 }
 
@@ -1214,34 +2104,40 @@ void hypervisor::free_vm_states()
 		delete[] this->vm_states_;
 		this->vm_states_ = nullptr;
 		this->vm_state_count_ = 0;
+		this->active_vm_state_count_ = 0;
 	}
 
-	if (this->ept_)
-	{
-		memory::free_aligned_object(this->ept_);
-		this->ept_ = nullptr;
-	}
+	this->free_epts();
+	host_memory::release();
 }
 
 void hypervisor::invalidate_cores() const
 {
+	// Hooks may have placed new pool allocations that exit handlers touch
+	host_memory::sync_kernel_mappings();
+
 	thread::dispatch_on_all_cores([&]
 	{
 		const auto* vm_state = this->get_current_vm_state();
 		if (vm_state && this->is_enabled())
 		{
-			vm_state->ept->invalidate();
+			__cpuid_hypercall(hypercall_invalidate, nullptr);
 		}
 	});
 }
 
-vmx::state* hypervisor::get_current_vm_state() const
+vmx::state* hypervisor::get_vm_state(const uint32_t processor_index) const
 {
-	const auto current_core = thread::get_processor_index();
-	if (!this->vm_states_ || current_core >= this->vm_state_count_)
+	if (!this->vm_states_ || processor_index >= this->vm_state_count_)
 	{
 		return nullptr;
 	}
 
-	return this->vm_states_[current_core];
+	auto* slot = reinterpret_cast<PVOID volatile*>(&this->vm_states_[processor_index]);
+	return static_cast<vmx::state*>(ReadPointerAcquire(slot));
+}
+
+vmx::state* hypervisor::get_current_vm_state() const
+{
+	return this->get_vm_state(thread::get_processor_index());
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "vmx.hpp"
+#include "thread.hpp"
 
 class hypervisor
 {
@@ -17,10 +18,20 @@ public:
 	void enable();
 	void disable();
 
+	// Allocates state for a hot-added processor and launches the hypervisor on it
+	bool enable_processor(uint32_t processor_index);
+
 	bool is_enabled() const;
 
-	bool install_ept_hook(const void* destination, const void* source, size_t length, process_id source_pid,
-	                      process_id target_pid, const utils::list<vmx::ept_translation_hint>& hints = {});
+	// Returns the handle of the installed hook, zero on failure
+	uint64_t install_ept_hook(const void* destination, const void* source, size_t length, process_id source_pid,
+	                          process_id target_pid, const utils::list<vmx::ept_translation_hint>& hints = {});
+
+	// One translation pass and a single invalidation for the whole batch, returns the number of installed regions.
+	// Handles may be null, otherwise it receives one handle per region, zero for regions that failed.
+	size_t install_ept_hooks(const vmx::ept_hook_region* regions, size_t region_count, process_id source_pid,
+	                         process_id target_pid, const utils::list<vmx::ept_translation_hint>& hints,
+	                         uint64_t* handles = nullptr);
 
 	bool install_ept_code_watch_point(uint64_t physical_page, process_id source_pid, process_id target_pid,
 	                                  bool invalidate = true) const;
@@ -29,25 +40,92 @@ public:
 
 	void disable_all_ept_hooks() const;
 
-	vmx::ept& get_ept() const;
+	// Only the pages that lost patches are restored. Returns the number of removed patches.
+	size_t remove_ept_hooks(const vmx::ept_patch_filter& filter) const;
+
+	// Replaces the bytes of a hook without tearing, with a single INVEPT on every core.
+	// The data must cover the whole hook, which has to lie within one page. Returns false if the handle is unknown.
+	bool update_ept_hook(uint64_t handle, const void* data, size_t length) const;
+
+	template <typename F>
+	void for_each_ept(F&& callback) const
+	{
+		for (auto i = 0u; i < this->ept_count_; ++i)
+		{
+			callback(*this->epts_[i]);
+		}
+	}
+
+	vmx::core_stats get_stats() const;
+	vmx::ept_copy_stats get_copy_stats() const;
+
+	// Describes the entries of the first EPT, with the hits of every replica summed up
+	size_t get_ept_entries(uint64_t first_index, vmx::ept_entry_info* entries, size_t max_count,
+	                       vmx::ept_entry_counts& counts) const;
+	uint32_t get_core_count() const;
+	uint32_t get_max_core_count() const;
+
+	const vmx::bringup_timing* get_bringup_timing(uint32_t core) const;
+	uint32_t get_core_node(uint32_t core) const;
+	uint64_t get_bringup_microseconds() const;
 
 	static hypervisor* get_instance();
 
 	bool cleanup_process(process_id process);
 
 private:
+	// Sized for every processor the system can ever have, slots are only filled once
 	uint32_t vm_state_count_{0};
 	vmx::state** vm_states_{nullptr};
-	vmx::ept* ept_{nullptr};
+	volatile long active_vm_state_count_{0};
+	uint64_t system_directory_table_base_{0};
+	uint32_t ept_count_{0};
+	vmx::ept** epts_{nullptr};
+
+	uint64_t bringup_microseconds_{0};
+
+	// Serializes hook changes, requests are handled by several worker threads at once
+	mutable FAST_MUTEX ept_mutex_{};
+	uint64_t next_hook_handle_{1};
 
 	void enable_core(uint64_t system_directory_table_base);
 	bool try_enable_core(uint64_t system_directory_table_base);
 	void disable_core();
 
+	void allocate_epts();
+	void free_epts();
+	void build_epts() const;
+	uint32_t get_ept_index(const vmx::ept* ept) const;
+
+	void record_bringup_error(const char* error) const;
+	void log_bringup_report() const;
+
+	template <typename F>
+	void for_each_ept_on_node(F&& callback) const
+	{
+		if (this->ept_count_ <= 1)
+		{
+			this->for_each_ept(std::forward<F>(callback));
+			return;
+		}
+
+		for (auto i = 0u; i < this->ept_count_; ++i)
+		{
+			thread::scoped_node_affinity affinity{i};
+			callback(*this->epts_[i]);
+		}
+	}
+
+	bool try_install_ept_code_watch_point(uint64_t physical_page, process_id source_pid, process_id target_pid) const;
+
 	void allocate_vm_states();
+	vmx::state* allocate_vm_state(uint32_t processor_index);
 	void free_vm_states();
+	void log_vm_state_placement() const;
 
+	// Single-context INVEPT on every core. INVVPID only drops guest-linear mappings, so it cannot flush EPT changes.
 	void invalidate_cores() const;
 
+	vmx::state* get_vm_state(uint32_t processor_index) const;
 	vmx::state* get_current_vm_state() const;
 };
@@ -8,8 +8,12 @@
 #include <irp_data.hpp>
 
 #include "process.hpp"
-#include "thread.hpp"
 #include "hypervisor.hpp"
+#include "syscall_filter.hpp"
+#include "syscall_events.hpp"
+#include "hypercall.hpp"
+#include "worker_pool.hpp"
+#include "access_records.hpp"
 
 namespace
 {
@@ -37,40 +41,244 @@ namespace
 		return STATUS_SUCCESS;
 	}
 
-	utils::list<vmx::ept_translation_hint> generate_translation_hints(uint32_t process_id, const void* target_address,
-	                                                                  size_t size)
+	_Function_class_(DRIVER_DISPATCH) NTSTATUS cleanup_handler(PDEVICE_OBJECT /*device_object*/, const PIRP irp)
 	{
-		utils::list<vmx::ept_translation_hint> translation_hints{};
+		PAGED_CODE()
+
+		try
+		{
+			// Mappings live in the owning process, so they must be gone before its address space is
+			(void)syscall_events::unmap_from_process(process::get_current_process_id());
+		}
+		catch (...)
+		{
+			debug_log("Failed to release syscall event mapping\n");
+		}
 
-		thread::kernel_thread([&translation_hints, process_id, target_address, size]
+		try
+		{
+			(void)access_records::unmap_from_process(process::get_current_process_id());
+		}
+		catch (...)
 		{
-			debug_log("Looking up process: %d\n", process_id);
+			debug_log("Failed to release access event mapping\n");
+		}
 
-			const auto process_handle = process::find_process_by_id(process_id);
-			if (!process_handle || !process_handle.is_alive())
+		try
+		{
+			(void)hypercall::close_session(process::get_current_process_id());
+		}
+		catch (...)
+		{
+			debug_log("Failed to close hypercall session\n");
+		}
+
+		irp->IoStatus.Information = 0;
+		irp->IoStatus.Status = STATUS_SUCCESS;
+
+		IoCompleteRequest(irp, IO_NO_INCREMENT);
+
+		return STATUS_SUCCESS;
+	}
+
+	volatile long long payload_copies{0};
+	volatile long long payload_bytes_copied{0};
+
+	void record_payload_copy(const uint64_t size)
+	{
+		InterlockedIncrement64(&payload_copies);
+		InterlockedAdd64(&payload_bytes_copied, static_cast<long long>(size));
+	}
+
+	// The worker completes the IRP once the job ran attached to the process.
+	// Jobs may own locked buffers of the caller, so they are destroyed before the IRP completes.
+	void pend_on_process(const PIRP irp, const process_id process, std::function<void()>&& job)
+	{
+		IoMarkIrpPending(irp);
+
+		auto* pending_job = new std::function<void()>(std::move(job));
+		if (!pending_job)
+		{
+			debug_log("Failed to queue IRP\n");
+			irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+			IoCompleteRequest(irp, IO_NO_INCREMENT);
+			return;
+		}
+
+		try
+		{
+			worker_pool::submit(process, [irp, pending_job](const bool attached)
 			{
-				debug_log("Bad process\n");
-				return;
+				{
+					const std::unique_ptr<std::function<void()>> owned_job(pending_job);
+
+					try
+					{
+						if (!attached)
+						{
+							throw std::runtime_error("Bad process");
+						}
+
+						(*owned_job)();
+					}
+					catch (std::exception& e)
+					{
+						debug_log("Handling IRP failed: %s\n", e.what());
+						irp->IoStatus.Status = STATUS_INVALID_DEVICE_REQUEST;
+					}
+					catch (...)
+					{
+						debug_log("Handling IRP failed\n");
+						irp->IoStatus.Status = STATUS_INVALID_DEVICE_REQUEST;
+					}
+				}
+
+				IoCompleteRequest(irp, IO_NO_INCREMENT);
+			});
+		}
+		catch (...)
+		{
+			delete pending_job;
+
+			debug_log("Failed to queue IRP\n");
+			irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+			IoCompleteRequest(irp, IO_NO_INCREMENT);
+		}
+	}
+
+	bool probe_and_lock_pages(const PMDL mdl, const LOCK_OPERATION operation)
+	{
+		__try
+		{
+			MmProbeAndLockPages(mdl, UserMode, operation);
+			return true;
+		}
+		__except (EXCEPTION_EXECUTE_HANDLER)
+		{
+			return false;
+		}
+	}
+
+	// Keeps a buffer of the caller writable for a worker that runs attached to another process
+	class locked_user_buffer
+	{
+	public:
+		locked_user_buffer() = default;
+
+		locked_user_buffer(void* address, const size_t length)
+		{
+			this->mdl_ = IoAllocateMdl(address, static_cast<ULONG>(length), FALSE, FALSE, nullptr);
+			if (!this->mdl_)
+			{
+				throw std::runtime_error("Failed to allocate buffer MDL");
+			}
+
+			if (!probe_and_lock_pages(this->mdl_, IoWriteAccess))
+			{
+				IoFreeMdl(this->mdl_);
+				this->mdl_ = nullptr;
+				throw std::runtime_error("Failed to lock buffer");
+			}
+		}
+
+		~locked_user_buffer()
+		{
+			this->release();
+		}
+
+		locked_user_buffer(locked_user_buffer&& obj) noexcept
+		{
+			this->operator=(std::move(obj));
+		}
+
+		locked_user_buffer& operator=(locked_user_buffer&& obj) noexcept
+		{
+			if (this != &obj)
+			{
+				this->release();
+				this->mdl_ = obj.mdl_;
+				obj.mdl_ = nullptr;
+			}
+
+			return *this;
+		}
+
+		locked_user_buffer(const locked_user_buffer& obj) = delete;
+		locked_user_buffer& operator=(const locked_user_buffer& obj) = delete;
+
+		void* get() const
+		{
+			if (!this->mdl_)
+			{
+				return nullptr;
 			}
 
-			if (const auto name = process_handle.get_image_filename())
+			auto* buffer = MmGetSystemAddressForMdlSafe(this->mdl_, NormalPagePriority | MdlMappingNoExecute);
+			if (!buffer)
 			{
-				debug_log("Attaching to %s\n", name);
+				throw std::runtime_error("Failed to map locked buffer");
 			}
 
-			process::scoped_process_attacher attacher{process_handle};
+			return buffer;
+		}
+
+	private:
+		PMDL mdl_{};
 
-			debug_log("Generating translation hints for address: %p\n", target_address);
-			translation_hints = vmx::ept::generate_translation_hints(target_address, size);
-		}).join();
+		void release()
+		{
+			if (this->mdl_)
+			{
+				MmUnlockPages(this->mdl_);
+				IoFreeMdl(this->mdl_);
+				this->mdl_ = nullptr;
+			}
+		}
+	};
 
-		return translation_hints;
+	locked_user_buffer lock_handle_buffer(uint64_t* handles, const size_t region_count)
+	{
+		if (!handles)
+		{
+			return {};
+		}
+
+		return {handles, region_count * sizeof(uint64_t)};
 	}
 
-	void apply_hook(const hook_request& request)
+	// The output of METHOD_NEITHER requests is a user address that is only valid in the caller's context,
+	// so it is locked before the IRP is handed to a worker. Completing the IRP releases the MDL.
+	void lock_output_buffer(const PIRP irp, const size_t length)
 	{
-		auto* hypervisor = hypervisor::get_instance();
-		if (!hypervisor)
+		auto* mdl = IoAllocateMdl(irp->UserBuffer, static_cast<ULONG>(length), FALSE, FALSE, nullptr);
+		if (!mdl)
+		{
+			throw std::runtime_error("Failed to allocate output MDL");
+		}
+
+		if (!probe_and_lock_pages(mdl, IoWriteAccess))
+		{
+			IoFreeMdl(mdl);
+			throw std::runtime_error("Failed to lock output buffer");
+		}
+
+		irp->MdlAddress = mdl;
+	}
+
+	void* get_locked_output_buffer(const PIRP irp)
+	{
+		auto* buffer = MmGetSystemAddressForMdlSafe(irp->MdlAddress, NormalPagePriority | MdlMappingNoExecute);
+		if (!buffer)
+		{
+			throw std::runtime_error("Failed to map output buffer");
+		}
+
+		return buffer;
+	}
+
+	void apply_hook(const PIRP irp, const hook_request& request)
+	{
+		if (!hypervisor::get_instance())
 		{
 			throw std::runtime_error("Hypervisor not installed");
 		}
@@ -82,29 +290,138 @@ namespace
 		}
 
 		memcpy(buffer.get(), request.source_data, request.source_data_size);
-		const auto translation_hints = generate_translation_hints(request.process_id, request.target_address,
-		                                                          request.source_data_size);
+		record_payload_copy(request.source_data_size);
 
-		if (translation_hints.empty())
+		const auto source_pid = process::get_current_process_id();
+		pend_on_process(irp, request.process_id, [request, source_pid, buffer = std::move(buffer)]
 		{
-			debug_log("Failed to generate tranlsation hints\n");
-			return;
+			auto* hypervisor = hypervisor::get_instance();
+			if (!hypervisor)
+			{
+				throw std::runtime_error("Hypervisor not installed");
+			}
+
+			debug_log("Generating translation hints for address: %p\n", request.target_address);
+			const auto translation_hints = vmx::ept::generate_translation_hints(request.target_address,
+			                                                                    request.source_data_size);
+
+			if (translation_hints.empty())
+			{
+				debug_log("Failed to generate tranlsation hints\n");
+				return;
+			}
+
+			hypervisor->install_ept_hook(request.target_address, buffer.get(), request.source_data_size, source_pid,
+			                             request.process_id, translation_hints);
+		});
+	}
+
+	vmx::ept_patch_filter create_patch_filter(const unhook_request& request, const uint64_t* handles)
+	{
+		vmx::ept_patch_filter filter{};
+
+		switch (request.type)
+		{
+		case unhook_type::handles:
+			filter.type = vmx::ept_patch_filter_type::handles;
+			filter.handles = handles;
+			filter.handle_count = static_cast<size_t>(request.handle_count);
+			break;
+		case unhook_type::range:
+			filter.type = vmx::ept_patch_filter_type::range;
+			filter.process = request.process_id;
+			filter.range_start = reinterpret_cast<uint64_t>(request.range_start);
+			filter.range_end = filter.range_start + request.range_length;
+			if (filter.range_end < filter.range_start)
+			{
+				throw std::runtime_error("Invalid unhook range");
+			}
+			break;
+		case unhook_type::process:
+			filter.type = vmx::ept_patch_filter_type::process;
+			filter.process = request.process_id;
+			break;
+		default:
+			throw std::runtime_error("Invalid unhook type");
 		}
 
-		hypervisor->install_ept_hook(request.target_address, buffer.get(), request.source_data_size,
-		                             process::get_current_process_id(), request.process_id, translation_hints);
+		return filter;
 	}
 
-	void unhook()
+	void unhook(const PIRP irp, const PIO_STACK_LOCATION irp_sp)
 	{
 		const auto instance = hypervisor::get_instance();
-		if (instance)
+		if (!instance)
+		{
+			return;
+		}
+
+		const auto input_length = irp_sp->Parameters.DeviceIoControl.InputBufferLength;
+		if (!input_length)
 		{
 			instance->disable_all_ept_hooks();
+			return;
+		}
+
+		memory::assert_readability(irp_sp->Parameters.DeviceIoControl.Type3InputBuffer, input_length);
+
+		if (input_length < sizeof(unhook_request))
+		{
+			throw std::runtime_error("Invalid unhook request");
+		}
+
+		const auto request = *static_cast<unhook_request*>(irp_sp->Parameters.DeviceIoControl.Type3InputBuffer);
+		if (request.version != unhook_version)
+		{
+			throw std::runtime_error("Unsupported unhook version");
+		}
+
+		const auto return_result = irp_sp->Parameters.DeviceIoControl.OutputBufferLength >= sizeof(unhook_result);
+		if (return_result)
+		{
+			memory::assert_writability(irp->UserBuffer, sizeof(unhook_result));
+		}
+
+		unhook_result result{};
+
+		if (request.type == unhook_type::all)
+		{
+			instance->disable_all_ept_hooks();
+		}
+		else
+		{
+			std::unique_ptr<uint64_t[]> handles{};
+			if (request.type == unhook_type::handles)
+			{
+				if (!request.handle_count || request.handle_count > max_unhook_handles)
+				{
+					throw std::runtime_error("Invalid unhook handle count");
+				}
+
+				const auto handles_size = static_cast<size_t>(request.handle_count) * sizeof(uint64_t);
+				memory::assert_readability(request.handles, handles_size);
+
+				handles = std::unique_ptr<uint64_t[]>(new uint64_t[static_cast<size_t>(request.handle_count)]);
+				if (!handles)
+				{
+					throw std::runtime_error("Failed to copy unhook handles");
+				}
+
+				memcpy(handles.get(), request.handles, handles_size);
+			}
+
+			const auto filter = create_patch_filter(request, handles.get());
+			result.removed_patch_count = instance->remove_ept_hooks(filter);
+		}
+
+		if (return_result)
+		{
+			memcpy(irp->UserBuffer, &result, sizeof(result));
+			irp->IoStatus.Information = sizeof(result);
 		}
 	}
 
-	void try_apply_hook(const PIO_STACK_LOCATION irp_sp)
+	void try_apply_hook(const PIRP irp, const PIO_STACK_LOCATION irp_sp)
 	{
 		memory::assert_readability(irp_sp->Parameters.DeviceIoControl.Type3InputBuffer,
 		                           irp_sp->Parameters.DeviceIoControl.InputBufferLength);
@@ -118,17 +435,263 @@ namespace
 		memory::assert_readability(request.source_data, request.source_data_size);
 		memory::assert_readability(request.target_address, request.source_data_size);
 
-		apply_hook(request);
+		apply_hook(irp, request);
 	}
 
-	void watch_regions(const watch_request& watch_request)
+	void update_hook(const PIO_STACK_LOCATION irp_sp)
 	{
-		const auto* hypervisor = hypervisor::get_instance();
+		const auto instance = hypervisor::get_instance();
+		if (!instance)
+		{
+			throw std::runtime_error("Hypervisor not installed");
+		}
+
+		memory::assert_readability(irp_sp->Parameters.DeviceIoControl.Type3InputBuffer,
+		                           irp_sp->Parameters.DeviceIoControl.InputBufferLength);
+
+		if (irp_sp->Parameters.DeviceIoControl.InputBufferLength < sizeof(update_hook_request))
+		{
+			throw std::runtime_error("Invalid hook update request");
+		}
+
+		const auto request = *static_cast<update_hook_request*>(irp_sp->Parameters.DeviceIoControl.
+			Type3InputBuffer);
+
+		if (!request.data_size || request.data_size > max_hook_batch_data_size)
+		{
+			throw std::runtime_error("Invalid hook update size");
+		}
+
+		const auto size = static_cast<size_t>(request.data_size);
+		memory::assert_readability(request.data, size);
+
+		std::unique_ptr<uint8_t[]> buffer(new uint8_t[size]);
+		if (!buffer)
+		{
+			throw std::runtime_error("Failed to copy buffer");
+		}
+
+		memcpy(buffer.get(), request.data, size);
+		record_payload_copy(size);
+
+		if (!instance->update_ept_hook(request.handle, buffer.get(), size))
+		{
+			throw std::runtime_error("Unknown hook handle");
+		}
+	}
+
+	// Must run attached to the target process
+	size_t install_hook_regions(const vmx::ept_hook_region* regions, const size_t region_count,
+	                            const process_id source_pid, const process_id target_pid,
+	                            const locked_user_buffer& handles)
+	{
+		auto* hypervisor = hypervisor::get_instance();
 		if (!hypervisor)
 		{
 			throw std::runtime_error("Hypervisor not installed");
 		}
 
+		utils::list<vmx::ept_translation_hint> translation_hints{};
+		for (size_t i = 0; i < region_count; ++i)
+		{
+			vmx::ept::generate_translation_hints(translation_hints, regions[i].destination, regions[i].length);
+		}
+
+		if (translation_hints.empty())
+		{
+			throw std::runtime_error("Failed to generate translation hints");
+		}
+
+		return hypervisor->install_ept_hooks(regions, region_count, source_pid, target_pid, translation_hints,
+		                                     static_cast<uint64_t*>(handles.get()));
+	}
+
+	void apply_hook_batch(const PIRP irp, const PIO_STACK_LOCATION irp_sp)
+	{
+		if (!hypervisor::get_instance())
+		{
+			throw std::runtime_error("Hypervisor not installed");
+		}
+
+		memory::assert_readability(irp_sp->Parameters.DeviceIoControl.Type3InputBuffer,
+		                           irp_sp->Parameters.DeviceIoControl.InputBufferLength);
+
+		if (irp_sp->Parameters.DeviceIoControl.InputBufferLength < sizeof(hook_batch_request))
+		{
+			throw std::runtime_error("Invalid hook batch request");
+		}
+
+		const auto request = *static_cast<hook_batch_request*>(irp_sp->Parameters.DeviceIoControl.Type3InputBuffer);
+		if (request.version != hook_batch_version)
+		{
+			throw std::runtime_error("Unsupported hook batch version");
+		}
+
+		if (!request.region_count || request.region_count > max_hook_batch_regions)
+		{
+			throw std::runtime_error("Invalid hook batch region count");
+		}
+
+		const auto region_count = static_cast<size_t>(request.region_count);
+		memory::assert_readability(request.regions, region_count * sizeof(hook_region));
+
+		std::unique_ptr<hook_region[]> user_regions(new hook_region[region_count]);
+		if (!user_regions)
+		{
+			throw std::runtime_error("Failed to copy hook regions");
+		}
+
+		memcpy(user_regions.get(), request.regions, region_count * sizeof(hook_region));
+
+		uint64_t total_size = 0;
+		for (size_t i = 0; i < region_count; ++i)
+		{
+			const auto size = user_regions.get()[i].source_data_size;
+			if (size > max_hook_batch_data_size - total_size)
+			{
+				throw std::runtime_error("Hook batch data too large");
+			}
+
+			total_size += size;
+		}
+
+		// All source data is captured into a single buffer before anything is installed
+		std::unique_ptr<uint8_t[]> data(new uint8_t[total_size ? total_size : 1]);
+		std::unique_ptr<vmx::ept_hook_region[]> regions(new vmx::ept_hook_region[region_count]);
+		if (!data || !regions)
+		{
+			throw std::runtime_error("Failed to copy hook batch");
+		}
+
+		uint64_t offset = 0;
+		for (size_t i = 0; i < region_count; ++i)
+		{
+			const auto& user_region = user_regions.get()[i];
+			const auto size = static_cast<size_t>(user_region.source_data_size);
+
+			memory::assert_readability(user_region.source_data, size);
+			memcpy(data.get() + offset, user_region.source_data, size);
+			record_payload_copy(size);
+
+			auto& region = regions.get()[i];
+			region.destination = user_region.target_address;
+			region.source = data.get() + offset;
+			region.length = size;
+
+			offset += size;
+		}
+
+		const auto return_result = irp_sp->Parameters.DeviceIoControl.OutputBufferLength >= sizeof(hook_batch_result);
+		if (return_result)
+		{
+			lock_output_buffer(irp, sizeof(hook_batch_result));
+		}
+
+		auto handles = lock_handle_buffer(request.handles, region_count);
+
+		const auto source_pid = process::get_current_process_id();
+		pend_on_process(irp, request.process_id, [irp, request, source_pid, region_count, return_result,
+		                                          data = std::move(data), regions = std::move(regions),
+		                                          handles = std::move(handles)]
+		{
+			hook_batch_result result{};
+			result.installed_region_count = install_hook_regions(regions.get(), region_count, source_pid,
+			                                                     request.process_id, handles);
+
+			if (return_result)
+			{
+				memcpy(get_locked_output_buffer(irp), &result, sizeof(result));
+				irp->IoStatus.Information = sizeof(result);
+			}
+		});
+	}
+
+	void apply_hook_payload(const PIRP irp, const PIO_STACK_LOCATION irp_sp)
+	{
+		if (!hypervisor::get_instance())
+		{
+			throw std::runtime_error("Hypervisor not installed");
+		}
+
+		const auto input_length = irp_sp->Parameters.DeviceIoControl.InputBufferLength;
+		if (input_length < sizeof(hook_payload_request))
+		{
+			throw std::runtime_error("Invalid hook payload request");
+		}
+
+		const auto* input = static_cast<const uint8_t*>(irp->AssociatedIrp.SystemBuffer);
+
+		hook_payload_request request{};
+		memcpy(&request, input, sizeof(request));
+
+		if (request.version != hook_batch_version)
+		{
+			throw std::runtime_error("Unsupported hook payload version");
+		}
+
+		if (!request.region_count || request.region_count > max_hook_batch_regions
+			|| input_length < sizeof(request) + request.region_count * sizeof(payload_region))
+		{
+			throw std::runtime_error("Invalid hook payload region count");
+		}
+
+		const auto payload_length = static_cast<uint64_t>(irp_sp->Parameters.DeviceIoControl.OutputBufferLength);
+		if (!irp->MdlAddress || !payload_length || payload_length > max_hook_batch_data_size)
+		{
+			throw std::runtime_error("Invalid hook payload");
+		}
+
+		// The I/O manager locked the payload, so the system mapping stays valid until the IRP completes
+		const auto* payload = static_cast<const uint8_t*>(MmGetSystemAddressForMdlSafe(
+			irp->MdlAddress, NormalPagePriority | MdlMappingNoExecute));
+		if (!payload)
+		{
+			throw std::runtime_error("Failed to map hook payload");
+		}
+
+		const auto region_count = static_cast<size_t>(request.region_count);
+		std::unique_ptr<vmx::ept_hook_region[]> regions(new vmx::ept_hook_region[region_count]);
+		if (!regions)
+		{
+			throw std::runtime_error("Failed to allocate hook regions");
+		}
+
+		const auto* user_regions = input + sizeof(request);
+		for (size_t i = 0; i < region_count; ++i)
+		{
+			payload_region user_region{};
+			memcpy(&user_region, user_regions + i * sizeof(user_region), sizeof(user_region));
+
+			const auto offset = user_region.payload_offset;
+			if (offset > payload_length || user_region.size > payload_length - offset)
+			{
+				throw std::runtime_error("Hook payload region out of bounds");
+			}
+
+			auto& region = regions.get()[i];
+			region.destination = user_region.target_address;
+			region.source = payload + offset;
+			region.length = static_cast<size_t>(user_region.size);
+		}
+
+		auto handles = lock_handle_buffer(request.handles, region_count);
+
+		const auto source_pid = process::get_current_process_id();
+		pend_on_process(irp, request.process_id, [irp, request, source_pid, region_count,
+		                                          regions = std::move(regions), handles = std::move(handles)]
+		{
+			irp->IoStatus.Information = install_hook_regions(regions.get(), region_count, source_pid,
+			                                                 request.process_id, handles);
+		});
+	}
+
+	void watch_regions(const PIRP irp, const watch_request& watch_request)
+	{
+		if (!hypervisor::get_instance())
+		{
+			throw std::runtime_error("Hypervisor not installed");
+		}
+
 		std::unique_ptr<watch_region[]> buffer(new watch_region[watch_request.watch_region_count]);
 		if (!buffer)
 		{
@@ -153,32 +716,25 @@ namespace
 			page_count += (end - start) / PAGE_SIZE;
 		}
 
-		volatile long index = 0;
 		std::unique_ptr<uint64_t[]> page_buffer(new uint64_t[page_count]);
 		if (!page_buffer)
 		{
 			throw std::runtime_error("Failed to copy buffer");
 		}
 
-		thread::kernel_thread t([watch_request_copy, &index, &page_buffer]
+		// The copied request points into buffer, so the job keeps it alive
+		const auto source_pid = process::get_current_process_id();
+		pend_on_process(irp, watch_request_copy.process_id, [watch_request_copy, source_pid,
+		                                                     buffer = std::move(buffer),
+		                                                     page_buffer = std::move(page_buffer)]
 		{
-			debug_log("Looking up process: %d\n", watch_request_copy.process_id);
-
-			const auto process_handle = process::find_process_by_id(watch_request_copy.process_id);
-			if (!process_handle || !process_handle.is_alive())
+			const auto* hypervisor = hypervisor::get_instance();
+			if (!hypervisor)
 			{
-				debug_log("Bad process\n");
-				return;
-			}
-
-			const auto name = process_handle.get_image_filename();
-			if (name)
-			{
-				debug_log("Attaching to %s\n", name);
+				throw std::runtime_error("Hypervisor not installed");
 			}
 
-			process::scoped_process_attacher attacher{process_handle};
-
+			size_t index = 0;
 			for (size_t i = 0; i < watch_request_copy.watch_region_count; ++i)
 			{
 				const auto& watch_region = watch_request_copy.watch_regions[i];
@@ -195,9 +751,7 @@ namespace
 					if (physical_address)
 					{
 						debug_log("Resolved %p -> %llX\n", current, physical_address);
-						page_buffer.get()[index] = physical_address;
-						InterlockedIncrement(&index);
-						//(void)hypervisor->install_ept_code_watch_point(physical_address);
+						page_buffer.get()[index++] = physical_address;
 					}
 					else
 					{
@@ -205,17 +759,15 @@ namespace
 					}
 				}
 			}
-		});
 
-		t.join();
-
-		debug_log("Installing watch points...\n");
-		(void)hypervisor->install_ept_code_watch_points(page_buffer.get(), index, process::get_current_process_id(),
-		                                                watch_request_copy.process_id);
-		debug_log("Watch points installed\n");
+			debug_log("Installing watch points...\n");
+			(void)hypervisor->install_ept_code_watch_points(page_buffer.get(), index, source_pid,
+			                                                watch_request_copy.process_id);
+			debug_log("Watch points installed\n");
+		});
 	}
 
-	void try_watch_regions(const PIO_STACK_LOCATION irp_sp)
+	void try_watch_regions(const PIRP irp, const PIO_STACK_LOCATION irp_sp)
 	{
 		memory::assert_readability(irp_sp->Parameters.DeviceIoControl.Type3InputBuffer,
 		                           irp_sp->Parameters.DeviceIoControl.InputBufferLength);
@@ -228,10 +780,309 @@ namespace
 		const auto& request = *static_cast<watch_request*>(irp_sp->Parameters.DeviceIoControl.Type3InputBuffer);
 		memory::assert_readability(request.watch_regions, request.watch_region_count * sizeof(watch_region));
 
-		watch_regions(request);
+		watch_regions(irp, request);
 	}
 
+	// Legacy interface: the retained distinct RIPs, terminated by zero if there is space left
 	void get_records(const PIRP irp, const PIO_STACK_LOCATION irp_sp)
+	{
+		const auto output_length = irp_sp->Parameters.DeviceIoControl.OutputBufferLength;
+		memory::assert_writability(irp->UserBuffer, output_length);
+
+		std::unique_ptr<uint64_t[]> rips(new uint64_t[access_records::max_retained_rips]);
+		if (!rips)
+		{
+			throw std::runtime_error("Failed to allocate access record buffer");
+		}
+
+		const auto max_records = output_length / sizeof(uint64_t);
+		const auto record_count = access_records::read_retained_rips(rips.get(), max_records);
+
+		auto* output = static_cast<uint64_t*>(irp->UserBuffer);
+		memcpy(output, rips.get(), record_count * sizeof(uint64_t));
+
+		if (record_count < max_records)
+		{
+			output[record_count] = 0;
+		}
+	}
+
+	void read_access_records(const PIRP irp, const PIO_STACK_LOCATION irp_sp)
+	{
+		memory::assert_readability(irp_sp->Parameters.DeviceIoControl.Type3InputBuffer,
+		                           irp_sp->Parameters.DeviceIoControl.InputBufferLength);
+
+		if (irp_sp->Parameters.DeviceIoControl.InputBufferLength < sizeof(access_record_request))
+		{
+			throw std::runtime_error("Invalid access record request");
+		}
+
+		const auto output_length = irp_sp->Parameters.DeviceIoControl.OutputBufferLength;
+		if (output_length < sizeof(access_record_header))
+		{
+			throw std::runtime_error("Invalid access record buffer");
+		}
+
+		memory::assert_writability(irp->UserBuffer, output_length);
+
+		const auto request = *static_cast<access_record_request*>(irp_sp->Parameters.DeviceIoControl.
+			Type3InputBuffer);
+
+		auto* output = static_cast<uint8_t*>(irp->UserBuffer);
+		const auto max_records = (output_length - sizeof(access_record_header)) / sizeof(access_record);
+
+		access_record_header header{};
+		header.next_cursor = request.cursor;
+		header.record_count = access_records::read(header.next_cursor,
+		                                           reinterpret_cast<access_record*>(output + sizeof(header)),
+		                                           max_records, header.lost_count);
+
+		memcpy(output, &header, sizeof(header));
+		irp->IoStatus.Information = sizeof(header) + header.record_count * sizeof(access_record);
+	}
+
+	ept_entry_descriptor create_ept_entry_descriptor(const vmx::ept_entry_info& entry)
+	{
+		ept_entry_descriptor descriptor{};
+		descriptor.source_pid = entry.source_pid;
+		descriptor.target_pid = entry.target_pid;
+		descriptor.patch_count = static_cast<uint32_t>(entry.patch_count);
+		descriptor.physical_address = entry.physical_base_address;
+		descriptor.execute_transitions = entry.execute_transitions;
+		descriptor.data_transitions = entry.data_transitions;
+		descriptor.last_hit_tsc = entry.last_hit_tsc;
+
+		switch (entry.type)
+		{
+		case vmx::ept_entry_type::hook:
+			descriptor.type = ept_entry_type::hook;
+			break;
+		case vmx::ept_entry_type::split:
+			descriptor.type = ept_entry_type::split;
+			break;
+		case vmx::ept_entry_type::watch_point:
+			descriptor.type = ept_entry_type::watch_point;
+			break;
+		}
+
+		return descriptor;
+	}
+
+	void enumerate_ept_entries(const PIRP irp, const PIO_STACK_LOCATION irp_sp)
+	{
+		const auto* hypervisor = hypervisor::get_instance();
+		if (!hypervisor)
+		{
+			throw std::runtime_error("Hypervisor not installed");
+		}
+
+		memory::assert_readability(irp_sp->Parameters.DeviceIoControl.Type3InputBuffer,
+		                           irp_sp->Parameters.DeviceIoControl.InputBufferLength);
+
+		if (irp_sp->Parameters.DeviceIoControl.InputBufferLength < sizeof(ept_entry_request))
+		{
+			throw std::runtime_error("Invalid EPT entry request");
+		}
+
+		const auto output_length = irp_sp->Parameters.DeviceIoControl.OutputBufferLength;
+		if (output_length < sizeof(ept_entry_header))
+		{
+			throw std::runtime_error("Invalid EPT entry buffer");
+		}
+
+		memory::assert_writability(irp->UserBuffer, output_length);
+
+		const auto request = *static_cast<ept_entry_request*>(irp_sp->Parameters.DeviceIoControl.Type3InputBuffer);
+
+		const auto max_entries = min((output_length - sizeof(ept_entry_header)) / sizeof(ept_entry_descriptor),
+		                             static_cast<size_t>(max_ept_entries_per_request));
+
+		// Collected under the EPT lock, the user buffer is only touched afterwards
+		std::unique_ptr<vmx::ept_entry_info[]> entries(new vmx::ept_entry_info[max_entries ? max_entries : 1]);
+		if (!entries)
+		{
+			throw std::runtime_error("Failed to allocate EPT entries");
+		}
+
+		vmx::ept_entry_counts counts{};
+		const auto count = hypervisor->get_ept_entries(request.cursor, entries.get(), max_entries, counts);
+
+		ept_entry_header header{};
+		header.next_cursor = request.cursor + count;
+		header.entry_count = count;
+		header.hook_count = counts.hooks;
+		header.split_count = counts.splits;
+		header.watch_point_count = counts.watch_points;
+
+		auto* output = static_cast<uint8_t*>(irp->UserBuffer);
+		memcpy(output, &header, sizeof(header));
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			const auto descriptor = create_ept_entry_descriptor(entries.get()[i]);
+			memcpy(output + sizeof(header) + i * sizeof(descriptor), &descriptor, sizeof(descriptor));
+		}
+
+		irp->IoStatus.Information = sizeof(header) + count * sizeof(ept_entry_descriptor);
+	}
+
+	void update_syscall_filter(const syscall_filter_request& request)
+	{
+		switch (request.operation)
+		{
+		case syscall_filter_operation::set:
+			syscall_filter::set_target(request.process_id, request.syscall_bitmap);
+			break;
+		case syscall_filter_operation::remove:
+			(void)syscall_filter::remove_target(request.process_id);
+			break;
+		case syscall_filter_operation::clear:
+			syscall_filter::clear();
+			break;
+		default:
+			throw std::runtime_error("Invalid syscall filter operation");
+		}
+	}
+
+	void try_update_syscall_filter(const PIO_STACK_LOCATION irp_sp)
+	{
+		memory::assert_readability(irp_sp->Parameters.DeviceIoControl.Type3InputBuffer,
+		                           irp_sp->Parameters.DeviceIoControl.InputBufferLength);
+
+		if (irp_sp->Parameters.DeviceIoControl.InputBufferLength < sizeof(syscall_filter_request))
+		{
+			throw std::runtime_error("Invalid syscall filter request");
+		}
+
+		static_assert(syscall_filter_max_syscalls == syscall_filter::max_syscall_count);
+
+		const auto request = *static_cast<syscall_filter_request*>(irp_sp->Parameters.DeviceIoControl.
+			Type3InputBuffer);
+		update_syscall_filter(request);
+	}
+
+	void map_syscall_events(const PIRP irp, const PIO_STACK_LOCATION irp_sp)
+	{
+		if (irp_sp->Parameters.DeviceIoControl.OutputBufferLength < sizeof(syscall_event_mapping))
+		{
+			throw std::runtime_error("Invalid syscall event mapping buffer");
+		}
+
+		memory::assert_writability(irp->UserBuffer, sizeof(syscall_event_mapping));
+
+		const auto mapping = syscall_events::map_into_current_process();
+		memcpy(irp->UserBuffer, &mapping, sizeof(mapping));
+
+		irp->IoStatus.Information = sizeof(mapping);
+	}
+
+	void unmap_syscall_events()
+	{
+		if (!syscall_events::unmap_from_process(process::get_current_process_id()))
+		{
+			throw std::runtime_error("Syscall events are not mapped into this process");
+		}
+	}
+
+	void map_access_events(const PIRP irp, const PIO_STACK_LOCATION irp_sp)
+	{
+		memory::assert_readability(irp_sp->Parameters.DeviceIoControl.Type3InputBuffer,
+		                           irp_sp->Parameters.DeviceIoControl.InputBufferLength);
+
+		if (irp_sp->Parameters.DeviceIoControl.InputBufferLength < sizeof(access_event_mapping_request))
+		{
+			throw std::runtime_error("Invalid access event request");
+		}
+
+		if (irp_sp->Parameters.DeviceIoControl.OutputBufferLength < sizeof(access_event_mapping))
+		{
+			throw std::runtime_error("Invalid access event mapping buffer");
+		}
+
+		memory::assert_writability(irp->UserBuffer, sizeof(access_event_mapping));
+
+		const auto request = *static_cast<access_event_mapping_request*>(irp_sp->Parameters.DeviceIoControl.
+			Type3InputBuffer);
+
+		const auto mapping = access_records::map_into_current_process(request);
+		memcpy(irp->UserBuffer, &mapping, sizeof(mapping));
+
+		irp->IoStatus.Information = sizeof(mapping);
+	}
+
+	void unmap_access_events()
+	{
+		if (!access_records::unmap_from_process(process::get_current_process_id()))
+		{
+			throw std::runtime_error("Access events are not mapped into this process");
+		}
+	}
+
+	void open_hypercall_session(const PIRP irp, const PIO_STACK_LOCATION irp_sp)
+	{
+		// VMCALL raises #UD without a hypervisor, so never hand out a session in that case
+		const auto* hypervisor = hypervisor::get_instance();
+		if (!hypervisor || !hypervisor->is_enabled())
+		{
+			throw std::runtime_error("Hypervisor not enabled");
+		}
+
+		if (irp_sp->Parameters.DeviceIoControl.OutputBufferLength < sizeof(hypercall_session))
+		{
+			throw std::runtime_error("Invalid hypercall session buffer");
+		}
+
+		memory::assert_writability(irp->UserBuffer, sizeof(hypercall_session));
+
+		const auto session = hypercall::open_session();
+		memcpy(irp->UserBuffer, &session, sizeof(session));
+
+		irp->IoStatus.Information = sizeof(session);
+	}
+
+	void close_hypercall_session()
+	{
+		if (!hypercall::close_session(process::get_current_process_id()))
+		{
+			throw std::runtime_error("No hypercall session is open in this process");
+		}
+	}
+
+	void get_stats(const PIRP irp, const PIO_STACK_LOCATION irp_sp)
+	{
+		const auto* hypervisor = hypervisor::get_instance();
+		if (!hypervisor)
+		{
+			throw std::runtime_error("Hypervisor not installed");
+		}
+
+		if (irp_sp->Parameters.DeviceIoControl.OutputBufferLength < sizeof(hypervisor_stats))
+		{
+			throw std::runtime_error("Invalid stats buffer");
+		}
+
+		memory::assert_writability(irp->UserBuffer, sizeof(hypervisor_stats));
+
+		const auto core_stats = hypervisor->get_stats();
+
+		hypervisor_stats stats{};
+		stats.core_count = hypervisor->get_core_count();
+		stats.cpuid_exits = core_stats.cpuid_exits;
+		stats.cpuid_cache_hits = core_stats.cpuid_cache_hits;
+		stats.cpuid_cache_misses = core_stats.cpuid_cache_misses;
+		stats.cpuid_cycles = core_stats.cpuid_cycles;
+		stats.exits = core_stats.exits;
+		stats.exit_cycles = core_stats.exit_cycles;
+
+		const auto copy_stats = hypervisor->get_copy_stats();
+		stats.payload_copies = static_cast<uint64_t>(payload_copies) + copy_stats.copies;
+		stats.payload_bytes_copied = static_cast<uint64_t>(payload_bytes_copied) + copy_stats.bytes;
+
+		memcpy(irp->UserBuffer, &stats, sizeof(stats));
+		irp->IoStatus.Information = sizeof(stats);
+	}
+
+	void get_bringup_report(const PIRP irp, const PIO_STACK_LOCATION irp_sp)
 	{
 		const auto* hypervisor = hypervisor::get_instance();
 		if (!hypervisor)
@@ -239,14 +1090,53 @@ namespace
 			throw std::runtime_error("Hypervisor not installed");
 		}
 
-		size_t count{};
-		const auto records = hypervisor->get_ept().get_access_records(&count);
+		const auto output_length = irp_sp->Parameters.DeviceIoControl.OutputBufferLength;
+		if (output_length < sizeof(bringup_report_header))
+		{
+			throw std::runtime_error("Invalid bring-up report buffer");
+		}
+
+		memory::assert_writability(irp->UserBuffer, output_length);
 
-		memset(irp->UserBuffer, 0, irp_sp->Parameters.DeviceIoControl.OutputBufferLength);
-		memcpy(irp->UserBuffer, records, min(irp_sp->Parameters.DeviceIoControl.OutputBufferLength, count * 8));
+		bringup_report_header header{};
+		header.core_count = hypervisor->get_core_count();
+		header.total_microseconds = hypervisor->get_bringup_microseconds();
+
+		auto* output = static_cast<uint8_t*>(irp->UserBuffer);
+		memcpy(output, &header, sizeof(header));
+
+		const auto max_cores = (output_length - sizeof(header)) / sizeof(core_bringup_report);
+		auto* cores = reinterpret_cast<core_bringup_report*>(output + sizeof(header));
+
+		size_t written = 0;
+		for (uint32_t i = 0; i < hypervisor->get_max_core_count() && written < max_cores; ++i)
+		{
+			const auto* timing = hypervisor->get_bringup_timing(i);
+			if (!timing)
+			{
+				continue;
+			}
+
+			core_bringup_report report{};
+			report.processor = i;
+			report.node = hypervisor->get_core_node(i);
+			report.succeeded = timing->succeeded ? 1 : 0;
+			report.ept_build_cycles = timing->ept_build;
+			report.msr_capture_cycles = timing->msr_capture;
+			report.vmxon_cycles = timing->vmxon;
+			report.vmcs_setup_cycles = timing->vmcs_setup;
+			report.launch_cycles = timing->launch;
+			report.total_cycles = timing->total;
+			memcpy(report.error, timing->error, sizeof(report.error));
+
+			memcpy(&cores[written++], &report, sizeof(report));
+		}
+
+		irp->IoStatus.Information = sizeof(header) + written * sizeof(core_bringup_report);
 	}
 
-	void handle_irp(const PIRP irp)
+	// Returns true when the request was pended and will be completed by a worker
+	bool handle_irp(const PIRP irp)
 	{
 		irp->IoStatus.Information = 0;
 		irp->IoStatus.Status = STATUS_SUCCESS;
@@ -259,23 +1149,67 @@ namespace
 			switch (ioctr_code)
 			{
 			case HOOK_DRV_IOCTL:
-				try_apply_hook(irp_sp);
-				break;
+				try_apply_hook(irp, irp_sp);
+				return true;
+			case HOOK_BATCH_DRV_IOCTL:
+				apply_hook_batch(irp, irp_sp);
+				return true;
+			case HOOK_PAYLOAD_DRV_IOCTL:
+				apply_hook_payload(irp, irp_sp);
+				return true;
 			case UNHOOK_DRV_IOCTL:
-				unhook();
+				unhook(irp, irp_sp);
 				break;
-			case WATCH_DRV_IOCTL:
-				try_watch_regions(irp_sp);
+			case UPDATE_HOOK_DRV_IOCTL:
+				update_hook(irp_sp);
 				break;
+			case WATCH_DRV_IOCTL:
+				try_watch_regions(irp, irp_sp);
+				return true;
 			case GET_RECORDS_DRV_IOCTL:
 				get_records(irp, irp_sp);
 				break;
+			case READ_ACCESS_RECORDS_DRV_IOCTL:
+				read_access_records(irp, irp_sp);
+				break;
+			case SYSCALL_FILTER_DRV_IOCTL:
+				try_update_syscall_filter(irp_sp);
+				break;
+			case MAP_SYSCALL_EVENTS_DRV_IOCTL:
+				map_syscall_events(irp, irp_sp);
+				break;
+			case UNMAP_SYSCALL_EVENTS_DRV_IOCTL:
+				unmap_syscall_events();
+				break;
+			case MAP_ACCESS_EVENTS_DRV_IOCTL:
+				map_access_events(irp, irp_sp);
+				break;
+			case UNMAP_ACCESS_EVENTS_DRV_IOCTL:
+				unmap_access_events();
+				break;
+			case ENUMERATE_EPT_ENTRIES_DRV_IOCTL:
+				enumerate_ept_entries(irp, irp_sp);
+				break;
+			case GET_STATS_DRV_IOCTL:
+				get_stats(irp, irp_sp);
+				break;
+			case GET_BRINGUP_REPORT_DRV_IOCTL:
+				get_bringup_report(irp, irp_sp);
+				break;
+			case OPEN_HYPERCALL_SESSION_DRV_IOCTL:
+				open_hypercall_session(irp, irp_sp);
+				break;
+			case CLOSE_HYPERCALL_SESSION_DRV_IOCTL:
+				close_hypercall_session();
+				break;
 			default:
 				debug_log("Invalid IOCTL Code: 0x%X\n", ioctr_code);
 				irp->IoStatus.Status = STATUS_INVALID_DEVICE_REQUEST;
 				break;
 			}
 		}
+
+		return false;
 	}
 
 	_Function_class_(DRIVER_DISPATCH) NTSTATUS io_ctl_handler(
@@ -285,7 +1219,10 @@ namespace
 
 		try
 		{
-			handle_irp(irp);
+			if (handle_irp(irp))
+			{
+				return STATUS_PENDING;
+			}
 		}
 		catch (std::exception& e)
 		{
@@ -333,6 +1270,7 @@ irp::irp(const PDRIVER_OBJECT driver_object, const wchar_t* device_name, const w
 
 	driver_object->MajorFunction[IRP_MJ_CREATE] = success_handler;
 	driver_object->MajorFunction[IRP_MJ_CLOSE] = success_handler;
+	driver_object->MajorFunction[IRP_MJ_CLEANUP] = cleanup_handler;
 	driver_object->MajorFunction[IRP_MJ_DEVICE_CONTROL] = io_ctl_handler;
 
 	this->device_object_->Flags |= DO_DIRECT_IO;
@@ -23,7 +23,7 @@ namespace memory
 			return address;
 		}
 
-		void* allocate_aligned_memory_internal(const size_t size)
+		void* allocate_aligned_memory_internal(const size_t size, const uint32_t node)
 		{
 			PHYSICAL_ADDRESS lowest{}, highest{};
 			lowest.QuadPart = 0;
@@ -37,7 +37,7 @@ namespace memory
 				                         highest,
 				                         lowest,
 				                         PAGE_READWRITE,
-				                         KeGetCurrentNodeNumber());
+				                         node);
 			}
 
 			return MmAllocateContiguousMemory(size, highest);
@@ -59,7 +59,14 @@ namespace memory
 
 	void* allocate_aligned_memory(const size_t size)
 	{
-		void* memory = allocate_aligned_memory_internal(size);
+		return allocate_aligned_memory(size, KeGetCurrentNodeNumber());
+	}
+
+	_Must_inspect_result_
+	_IRQL_requires_max_(DISPATCH_LEVEL)
+	void* allocate_aligned_memory(const size_t size, const uint32_t node)
+	{
+		void* memory = allocate_aligned_memory_internal(size, node);
 		if (memory)
 		{
 			RtlSecureZeroMemory(memory, size);
@@ -10,6 +10,11 @@ namespace memory
 	_IRQL_requires_max_(DISPATCH_LEVEL)
 	void* allocate_aligned_memory(size_t size);
 
+	// Falls back to any node when contiguous node memory is unavailable
+	_Must_inspect_result_
+	_IRQL_requires_max_(DISPATCH_LEVEL)
+	void* allocate_aligned_memory(size_t size, uint32_t node);
+
 	_IRQL_requires_max_(APC_LEVEL)
 	bool read_physical_memory(void* destination, uint64_t physical_address, size_t size);
 
@@ -70,6 +75,18 @@ namespace memory
 		return object;
 	}
 
+	template <typename T, typename... Args>
+	T* allocate_aligned_object_on_node(const uint32_t node, Args ... args)
+	{
+		auto* object = static_cast<T*>(allocate_aligned_memory(sizeof(T), node));
+		if (object)
+		{
+			new(object) T(std::forward<Args>(args)...);
+		}
+
+		return object;
+	}
+
 	template <typename T>
 	void free_aligned_object(T* object)
 	{
@@ -0,0 +1,115 @@
+#pragma once
+
+// Guest page-table walker. Free of kernel dependencies, so it can be
+// exercised in user mode against synthetic tables. Entries are fetched through a reader:
+// bool(uint64_t physical_address, uint64_t& entry)
+namespace paging
+{
+	constexpr uint64_t entry_present = 1ull << 0;
+	constexpr uint64_t entry_writable = 1ull << 1;
+	constexpr uint64_t entry_user = 1ull << 2;
+	constexpr uint64_t entry_large_page = 1ull << 7;
+	constexpr uint64_t entry_execute_disable = 1ull << 63;
+
+	constexpr uint64_t address_mask = 0x000FFFFFFFFFF000ull;
+	constexpr uint64_t page_offset_mask = 0xFFFull;
+
+	enum class page_size : uint8_t
+	{
+		size_4kb,
+		size_2mb,
+		size_1gb,
+	};
+
+	struct translation
+	{
+		uint64_t physical_address;
+		// Number of table levels the walk went through, including the leaf
+		uint32_t entry_count;
+		page_size size;
+		bool writable;
+		bool user;
+		bool executable;
+	};
+
+	constexpr uint64_t get_page_mask(const page_size size)
+	{
+		switch (size)
+		{
+		case page_size::size_1gb:
+			return (1ull << 30) - 1;
+		case page_size::size_2mb:
+			return (1ull << 21) - 1;
+		default:
+			return page_offset_mask;
+		}
+	}
+
+	constexpr bool is_canonical(const uint64_t virtual_address, const bool five_level)
+	{
+		const auto bits = five_level ? 57 : 48;
+		const auto upper = static_cast<int64_t>(virtual_address) >> (bits - 1);
+		return upper == 0 || upper == -1;
+	}
+
+	template <typename Reader>
+	bool translate(Reader&& read_entry, const uint64_t cr3, const uint64_t virtual_address, const bool five_level,
+	               translation& result)
+	{
+		if (!is_canonical(virtual_address, five_level))
+		{
+			return false;
+		}
+
+		auto table = cr3 & address_mask;
+		uint32_t entry_count = 0;
+		auto writable = true;
+		auto user = true;
+		auto executable = true;
+
+		for (auto level = five_level ? 5u : 4u; level > 0; --level)
+		{
+			const auto shift = 12 + 9 * (level - 1);
+			const auto entry_address = table + ((virtual_address >> shift) & 0x1FF) * sizeof(uint64_t);
+
+			uint64_t entry{};
+			if (!read_entry(entry_address, entry) || !(entry & entry_present))
+			{
+				return false;
+			}
+
+			++entry_count;
+
+			writable &= (entry & entry_writable) != 0;
+			user &= (entry & entry_user) != 0;
+			executable &= (entry & entry_execute_disable) == 0;
+
+			auto size = page_size::size_4kb;
+			if (level == 3 && (entry & entry_large_page))
+			{
+				size = page_size::size_1gb;
+			}
+			else if (level == 2 && (entry & entry_large_page))
+			{
+				size = page_size::size_2mb;
+			}
+			else if (level != 1)
+			{
+				table = entry & address_mask;
+				continue;
+			}
+
+			const auto page_mask = get_page_mask(size);
+
+			result.physical_address = (entry & address_mask & ~page_mask) | (virtual_address & page_mask);
+			result.entry_count = entry_count;
+			result.size = size;
+			result.writable = writable;
+			result.user = user;
+			result.executable = executable;
+			return true;
+		}
+
+		return false;
+	}
+}
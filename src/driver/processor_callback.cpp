@@ -0,0 +1,54 @@
+#include "std_include.hpp"
+#include "processor_callback.hpp"
+#include "exception.hpp"
+#include "logging.hpp"
+
+processor_callback::processor_callback(callback_function&& callback)
+	: callback_(std::move(callback))
+{
+	this->handle_ = KeRegisterProcessorChangeCallback(processor_callback::static_callback, this, 0);
+	if (!this->handle_)
+	{
+		throw std::runtime_error("Unable to register processor change callback");
+	}
+}
+
+processor_callback::~processor_callback()
+{
+	if (this->handle_)
+	{
+		KeDeregisterProcessorChangeCallback(this->handle_);
+	}
+}
+
+void processor_callback::dispatcher(const uint32_t processor_index) const
+{
+	try
+	{
+		if (this->callback_)
+		{
+			this->callback_(processor_index);
+		}
+	}
+	catch (std::exception& e)
+	{
+		debug_log("Processor change callback failed for core %u: %s\n", processor_index, e.what());
+	}
+	catch (...)
+	{
+	}
+}
+
+_Function_class_(PROCESSOR_CALLBACK_FUNCTION)
+
+void processor_callback::static_callback(void* context, const PKE_PROCESSOR_CHANGE_NOTIFY_CONTEXT change_context,
+                                         PNTSTATUS /*operation_status*/)
+{
+	// The start notification must not fail the addition, the processor only runs code after completion
+	if (!context || !change_context || change_context->State != KeProcessorAddCompleteNotify)
+	{
+		return;
+	}
+
+	static_cast<processor_callback*>(context)->dispatcher(change_context->NtNumber);
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include "functional.hpp"
+
+// Notifies about processors that were hot-added and are ready to run code
+class processor_callback
+{
+public:
+	using callback_function = std::function<void(uint32_t processor_index)>;
+
+	processor_callback() = default;
+	processor_callback(callback_function&& callback);
+	~processor_callback();
+
+	processor_callback(processor_callback&& obj) noexcept = delete;
+	processor_callback& operator=(processor_callback&& obj) noexcept = delete;
+
+	processor_callback(const processor_callback& obj) = delete;
+	processor_callback& operator=(const processor_callback& obj) = delete;
+
+private:
+	void* handle_{nullptr};
+	callback_function callback_{};
+
+	void dispatcher(uint32_t processor_index) const;
+
+	_Function_class_(PROCESSOR_CALLBACK_FUNCTION)
+	static void static_callback(void* context, PKE_PROCESSOR_CHANGE_NOTIFY_CONTEXT change_context,
+	                            PNTSTATUS operation_status);
+};
@@ -0,0 +1,76 @@
+#include "std_include.hpp"
+#include "syscall_events.hpp"
+#include "event_ring_set.hpp"
+#include "finally.hpp"
+#include "logging.hpp"
+
+namespace
+{
+	constexpr size_t ring_size = 256_kb;
+
+	event_ring_set rings{};
+}
+
+namespace syscall_events
+{
+	void record(const syscall_event& event)
+	{
+		rings.push(event);
+	}
+
+	syscall_event_mapping map_into_current_process()
+	{
+		event_ring_set::scoped_lock _{rings};
+
+		if (rings.is_mapped())
+		{
+			throw std::runtime_error("Syscall events are already mapped");
+		}
+
+		syscall_event_mapping mapping{};
+		mapping.ring_count = rings.get_ring_count();
+		mapping.ring_size = rings.get_ring_size();
+		rings.map_into_current_process(mapping.rings);
+
+		return mapping;
+	}
+
+	bool unmap_from_process(const process_id process)
+	{
+		event_ring_set::scoped_lock _{rings};
+
+		if (!rings.is_mapped_by(process))
+		{
+			return false;
+		}
+
+		rings.unmap();
+		return true;
+	}
+
+	scoped_rings::scoped_rings()
+	{
+		auto destructor = utils::finally([]
+		{
+			rings.free();
+		});
+
+		rings.allocate<syscall_event>(ring_size);
+		destructor.cancel();
+	}
+
+	scoped_rings::~scoped_rings()
+	{
+		try
+		{
+			event_ring_set::scoped_lock _{rings};
+			rings.unmap();
+		}
+		catch (...)
+		{
+			debug_log("Failed to unmap syscall event rings\n");
+		}
+
+		rings.free();
+	}
+}
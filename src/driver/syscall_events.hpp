@@ -0,0 +1,29 @@
+#pragma once
+
+struct syscall_event;
+struct syscall_event_mapping;
+
+namespace syscall_events
+{
+	// Safe to call from VMX root mode
+	void record(const syscall_event& event);
+
+	_IRQL_requires_max_(APC_LEVEL)
+	syscall_event_mapping map_into_current_process();
+
+	_IRQL_requires_max_(APC_LEVEL)
+	bool unmap_from_process(process_id process);
+
+	class scoped_rings
+	{
+	public:
+		scoped_rings();
+		~scoped_rings();
+
+		scoped_rings(scoped_rings&& obj) noexcept = delete;
+		scoped_rings& operator=(scoped_rings&& obj) noexcept = delete;
+
+		scoped_rings(const scoped_rings& obj) = delete;
+		scoped_rings& operator=(const scoped_rings& obj) = delete;
+	};
+}
@@ -0,0 +1,183 @@
+#include "std_include.hpp"
+#include "syscall_filter.hpp"
+
+namespace
+{
+	struct filter_target
+	{
+		// Odd while the entry is being modified, readers discard what they saw in that case
+		volatile long sequence;
+		process_id process;
+		uint64_t syscall_bitmap[syscall_filter::syscall_bitmap_size];
+	};
+
+	filter_target targets[syscall_filter::max_targets]{};
+	volatile long target_count{0};
+	KSPIN_LOCK update_lock{};
+
+	class scoped_update_lock
+	{
+	public:
+		scoped_update_lock()
+		{
+			KeAcquireSpinLock(&update_lock, &this->old_irql_);
+		}
+
+		~scoped_update_lock()
+		{
+			KeReleaseSpinLock(&update_lock, this->old_irql_);
+		}
+
+		scoped_update_lock(scoped_update_lock&& obj) noexcept = delete;
+		scoped_update_lock& operator=(scoped_update_lock&& obj) noexcept = delete;
+
+		scoped_update_lock(const scoped_update_lock& obj) = delete;
+		scoped_update_lock& operator=(const scoped_update_lock& obj) = delete;
+
+	private:
+		KIRQL old_irql_{};
+	};
+
+	bool is_active(const filter_target& target)
+	{
+		return target.process != 0;
+	}
+
+	void begin_update(filter_target& target)
+	{
+		InterlockedIncrement(&target.sequence);
+	}
+
+	void end_update(filter_target& target)
+	{
+		InterlockedIncrement(&target.sequence);
+	}
+
+	filter_target* find_target(const process_id process)
+	{
+		for (auto& target : targets)
+		{
+			if (target.process == process)
+			{
+				return &target;
+			}
+		}
+
+		return nullptr;
+	}
+
+	void release_target(filter_target& target)
+	{
+		begin_update(target);
+		target.process = 0;
+		end_update(target);
+
+		InterlockedDecrement(&target_count);
+	}
+}
+
+namespace syscall_filter
+{
+	void set_target(const process_id process, const uint64_t* syscall_bitmap)
+	{
+		if (!process)
+		{
+			throw std::runtime_error("Invalid process id");
+		}
+
+		scoped_update_lock _{};
+
+		auto* target = find_target(process);
+		const auto is_new = target == nullptr;
+
+		if (is_new)
+		{
+			target = find_target(0);
+		}
+
+		if (!target)
+		{
+			throw std::runtime_error("Too many syscall filter targets");
+		}
+
+		begin_update(*target);
+		target->process = process;
+		memcpy(target->syscall_bitmap, syscall_bitmap, sizeof(target->syscall_bitmap));
+		end_update(*target);
+
+		if (is_new)
+		{
+			InterlockedIncrement(&target_count);
+		}
+	}
+
+	bool remove_target(const process_id process)
+	{
+		if (!process)
+		{
+			return false;
+		}
+
+		scoped_update_lock _{};
+
+		auto* target = find_target(process);
+		if (!target)
+		{
+			return false;
+		}
+
+		release_target(*target);
+		return true;
+	}
+
+	void clear()
+	{
+		scoped_update_lock _{};
+
+		for (auto& target : targets)
+		{
+			if (is_active(target))
+			{
+				release_target(target);
+			}
+		}
+	}
+
+	bool has_targets()
+	{
+		return target_count != 0;
+	}
+
+	bool should_log(const process_id process, const uint64_t syscall_number)
+	{
+		if (syscall_number >= max_syscall_count)
+		{
+			return false;
+		}
+
+		const auto word = syscall_number / 64;
+		const auto bit = 1ull << (syscall_number % 64);
+
+		for (const auto& target : targets)
+		{
+			const auto sequence = target.sequence;
+			if (sequence & 1)
+			{
+				continue;
+			}
+
+			_ReadWriteBarrier();
+
+			const auto matches = target.process == process && (target.syscall_bitmap[word] & bit);
+
+			_ReadWriteBarrier();
+
+			if (matches && target.sequence == sequence)
+			{
+				return true;
+			}
+		}
+
+		return false;
+	}
+}
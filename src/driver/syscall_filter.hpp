@@ -0,0 +1,16 @@
+#pragma once
+
+namespace syscall_filter
+{
+	constexpr size_t max_targets = 16;
+	constexpr uint32_t max_syscall_count = 0x2000;
+	constexpr size_t syscall_bitmap_size = max_syscall_count / 64;
+
+	void set_target(process_id process, const uint64_t* syscall_bitmap);
+	bool remove_target(process_id process);
+	void clear();
+
+	// Safe to call from VMX root mode
+	bool has_targets();
+	bool should_log(process_id process, uint64_t syscall_number);
+}
@@ -166,11 +166,64 @@ namespace thread
 		return static_cast<uint32_t>(KeQueryActiveProcessorCountEx(0));
 	}
 
+	uint32_t get_max_processor_count()
+	{
+		return static_cast<uint32_t>(KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS));
+	}
+
 	uint32_t get_processor_index()
 	{
 		return static_cast<uint32_t>(KeGetCurrentProcessorNumberEx(nullptr));
 	}
 
+	uint32_t get_processor_node(const uint32_t processor_index)
+	{
+		PROCESSOR_NUMBER processor_number{};
+		if (!NT_SUCCESS(KeGetProcessorNumberFromIndex(processor_index, &processor_number)))
+		{
+			return 0;
+		}
+
+		const auto highest_node = KeQueryHighestNodeNumber();
+		for (USHORT node = 0; node <= highest_node; ++node)
+		{
+			GROUP_AFFINITY affinity{};
+			KeQueryNodeActiveAffinity(node, &affinity, nullptr);
+
+			if (affinity.Group == processor_number.Group && (affinity.Mask & (1ull << processor_number.Number)))
+			{
+				return node;
+			}
+		}
+
+		return 0;
+	}
+
+	uint32_t get_node_count()
+	{
+		return static_cast<uint32_t>(KeQueryHighestNodeNumber()) + 1;
+	}
+
+	scoped_node_affinity::scoped_node_affinity(const uint32_t node)
+	{
+		GROUP_AFFINITY affinity{};
+		KeQueryNodeActiveAffinity(static_cast<USHORT>(node), &affinity, nullptr);
+
+		if (affinity.Mask)
+		{
+			KeSetSystemGroupAffinityThread(&affinity, &this->previous_affinity_);
+			this->applied_ = true;
+		}
+	}
+
+	scoped_node_affinity::~scoped_node_affinity()
+	{
+		if (this->applied_)
+		{
+			KeRevertToUserGroupAffinityThread(&this->previous_affinity_);
+		}
+	}
+
 	bool sleep(const uint32_t milliseconds)
 	{
 		LARGE_INTEGER interval{};
@@ -187,4 +240,42 @@ namespace thread
 
 		KeGenericCallDpc(sequential ? sequential_callback_dispatcher : callback_dispatcher, &callback_data);
 	}
+
+	bool dispatch_on_core(const uint32_t processor_index, void (*callback)(void*), void* data)
+	{
+		PROCESSOR_NUMBER processor_number{};
+		if (!NT_SUCCESS(KeGetProcessorNumberFromIndex(processor_index, &processor_number)))
+		{
+			return false;
+		}
+
+		GROUP_AFFINITY affinity{};
+		affinity.Group = processor_number.Group;
+		affinity.Mask = 1ull << processor_number.Number;
+
+		GROUP_AFFINITY previous_affinity{};
+		KeSetSystemGroupAffinityThread(&affinity, &previous_affinity);
+
+		const auto _ = utils::finally([&previous_affinity]
+		{
+			KeRevertToUserGroupAffinityThread(&previous_affinity);
+		});
+
+		dispatch_data callback_data{};
+		callback_data.callback = callback;
+		callback_data.data = data;
+
+		KIRQL old_irql{};
+		KeRaiseIrql(DISPATCH_LEVEL, &old_irql);
+
+		const auto on_target = get_processor_index() == processor_index;
+		if (on_target)
+		{
+			dispatch_callback(&callback_data);
+		}
+
+		KeLowerIrql(old_irql);
+
+		return on_target;
+	}
 }
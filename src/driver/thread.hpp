@@ -4,7 +4,10 @@
 namespace thread
 {
 	uint32_t get_processor_count();
+	uint32_t get_max_processor_count();
 	uint32_t get_processor_index();
+	uint32_t get_processor_node(uint32_t processor_index);
+	uint32_t get_node_count();
 
 	_IRQL_requires_min_(PASSIVE_LEVEL)
 	_IRQL_requires_max_(APC_LEVEL)
@@ -28,6 +31,44 @@ namespace thread
 		}, &callback, sequential);
 	}
 
+	// Runs the callback at DISPATCH_LEVEL on one specific processor
+	_IRQL_requires_max_(APC_LEVEL)
+	_IRQL_requires_min_(PASSIVE_LEVEL)
+	_IRQL_requires_same_
+	bool dispatch_on_core(uint32_t processor_index, void (*callback)(void*), void* data);
+
+	_IRQL_requires_max_(APC_LEVEL)
+	_IRQL_requires_min_(PASSIVE_LEVEL)
+	_IRQL_requires_same_
+	template <typename F>
+	bool dispatch_on_core(const uint32_t processor_index, F&& callback)
+	{
+		return dispatch_on_core(processor_index, [](void* data)
+		{
+			(*static_cast<F*>(data))();
+		}, &callback);
+	}
+
+	// Pins the current thread to the processors of a NUMA node, so allocations
+	// that default to the current node land on that node
+	class scoped_node_affinity
+	{
+	public:
+		_IRQL_requires_max_(APC_LEVEL)
+		scoped_node_affinity(uint32_t node);
+		~scoped_node_affinity();
+
+		scoped_node_affinity(scoped_node_affinity&& obj) noexcept = delete;
+		scoped_node_affinity& operator=(scoped_node_affinity&& obj) noexcept = delete;
+
+		scoped_node_affinity(const scoped_node_affinity& obj) = delete;
+		scoped_node_affinity& operator=(const scoped_node_affinity& obj) = delete;
+
+	private:
+		bool applied_{false};
+		GROUP_AFFINITY previous_affinity_{};
+	};
+
 	class kernel_thread
 	{
 	public:
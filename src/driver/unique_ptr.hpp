@@ -46,7 +46,7 @@ namespace std
 		unique_ptr(const unique_ptr<T>& obj) = delete;
 		unique_ptr& operator=(const unique_ptr<T>& obj) = delete;
 
-		value_type* get()
+		value_type* get() const
 		{
 			return this->pointer_;
 		}
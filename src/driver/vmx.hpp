@@ -2,6 +2,7 @@
 #include "ept.hpp"
 
 #define HYPERV_HYPERVISOR_PRESENT_BIT           0x80000000
+#define HYPERV_CPUID_VENDOR_AND_MAX_FUNCTIONS   0x40000000
 #define HYPERV_CPUID_INTERFACE                  0x40000001
 
 namespace vmx
@@ -40,6 +41,87 @@ namespace vmx
 		bool launched;
 	};
 
+	struct gdt_entry
+	{
+		uint64_t base;
+		uint32_t limit;
+		vmx_segment_access_rights access_rights;
+		segment_selector selector;
+	};
+
+	struct syscall_segments
+	{
+		gdt_entry cs;
+		gdt_entry ss;
+	};
+
+	// Captured when syscall hooking is enabled and refreshed on trapped guest writes
+	struct syscall_msr_state
+	{
+		uint64_t star;
+		uint64_t lstar;
+		uint64_t fmask;
+		syscall_segments syscall;
+		syscall_segments sysret;
+	};
+
+	struct syscall_decode_entry
+	{
+		uint64_t cr3;
+		uint64_t rip;
+		uint64_t physical_rip;
+		uint32_t generation;
+		uint8_t state;
+	};
+
+	// Direct-mapped per core, indexed by a hash of (guest CR3, RIP)
+	constexpr size_t syscall_decode_cache_size = 256;
+
+	constexpr uint32_t max_vpid_cores = 1024;
+
+	// VPID 0 belongs to VMX root, so tags start at 1
+	constexpr uint16_t make_vpid(const uint32_t core_index)
+	{
+		return static_cast<uint16_t>(1 + (core_index % max_vpid_cores));
+	}
+
+	struct cpuid_cache_entry
+	{
+		uint32_t leaf;
+		uint32_t subleaf;
+		int32_t registers[4];
+		bool valid;
+	};
+
+	// Direct-mapped per core, indexed by a hash of (leaf, normalized subleaf)
+	constexpr size_t cpuid_cache_size = 64;
+
+	struct core_stats
+	{
+		uint64_t cpuid_exits;
+		uint64_t cpuid_cache_hits;
+		uint64_t cpuid_cache_misses;
+		uint64_t cpuid_cycles;
+
+		uint64_t exits;
+		uint64_t exit_cycles;
+	};
+
+	// TSC cycles spent in each bring-up phase on one core
+	struct bringup_timing
+	{
+		uint64_t ept_build;
+		uint64_t msr_capture;
+		uint64_t vmxon;
+		uint64_t vmcs_setup;
+		uint64_t launch;
+		uint64_t total;
+
+		uint64_t phase_start;
+		bool succeeded;
+		char error[64];
+	};
+
 	struct state
 	{
 		union
@@ -54,26 +136,121 @@ namespace vmx
 		DECLSPEC_PAGE_ALIGN vmcs vmcs{};
 
 		DECLSPEC_PAGE_ALIGN ept* ept{};
-	};
 
-	struct gdt_entry
-	{
-		uint64_t base;
-		uint32_t limit;
-		vmx_segment_access_rights access_rights;
-		segment_selector selector;
+		syscall_decode_entry syscall_decode_cache[syscall_decode_cache_size]{};
+
+		syscall_msr_state syscall_msrs{};
+
+		cpuid_cache_entry cpuid_cache[cpuid_cache_size]{};
+		core_stats stats{};
+
+		uint16_t vpid{};
+
+		uint32_t node{};
+		uint32_t exit_reason{};
+
+		bringup_timing bringup{};
 	};
 
-	struct guest_context
+	// Drops every cached syscall decode result on all cores
+	void invalidate_syscall_decode_caches();
+
+	class guest_context
 	{
-		PCONTEXT vp_regs;
-		uintptr_t guest_rip;
-		uintptr_t guest_rsp;
-		uintptr_t guest_e_flags;
-		uintptr_t guest_physical_address;
-		uint16_t exit_reason;
-		uintptr_t exit_qualification;
-		bool exit_vm;
-		bool increment_rip;
+	public:
+		guest_context(const PCONTEXT context)
+			: vp_regs(context)
+		{
+		}
+
+		PCONTEXT vp_regs{};
+		uint16_t exit_reason{};
+		bool exit_vm{false};
+		bool increment_rip{true};
+
+		// Fields are fetched on first use and kept until the exit is resumed.
+		uint64_t read(const uint32_t field)
+		{
+			if (auto* entry = this->find_field(field))
+			{
+				return entry->value;
+			}
+
+			uintptr_t value{};
+			__vmx_vmread(field, &value);
+
+			(void)this->add_field(field, value, false);
+			return value;
+		}
+
+		// Writes are buffered and only reach the VMCS when flushing.
+		void write(const uint32_t field, const uint64_t value)
+		{
+			if (auto* entry = this->find_field(field))
+			{
+				entry->value = value;
+				entry->dirty = true;
+				return;
+			}
+
+			if (!this->add_field(field, value, true))
+			{
+				__vmx_vmwrite(field, value);
+			}
+		}
+
+		void flush()
+		{
+			for (uint32_t i = 0; i < this->field_count_; ++i)
+			{
+				auto& entry = this->fields_[i];
+				if (entry.dirty)
+				{
+					__vmx_vmwrite(entry.field, entry.value);
+					entry.dirty = false;
+				}
+			}
+		}
+
+	private:
+		struct cached_field
+		{
+			uint32_t field;
+			bool dirty;
+			uint64_t value;
+		};
+
+		static constexpr uint32_t max_cached_fields = 24;
+
+		uint32_t field_count_{0};
+		cached_field fields_[max_cached_fields];
+
+		cached_field* find_field(const uint32_t field)
+		{
+			for (uint32_t i = 0; i < this->field_count_; ++i)
+			{
+				if (this->fields_[i].field == field)
+				{
+					return &this->fields_[i];
+				}
+			}
+
+			return nullptr;
+		}
+
+		bool add_field(const uint32_t field, const uint64_t value, const bool dirty)
+		{
+			if (this->field_count_ >= max_cached_fields)
+			{
+				return false;
+			}
+
+			auto& entry = this->fields_[this->field_count_++];
+			entry.field = field;
+			entry.value = value;
+			entry.dirty = dirty;
+
+			return true;
+		}
 	};
 }
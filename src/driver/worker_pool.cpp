@@ -0,0 +1,188 @@
+#include "std_include.hpp"
+#include "worker_pool.hpp"
+#include "thread.hpp"
+#include "process.hpp"
+#include "list.hpp"
+#include "logging.hpp"
+#include "exception.hpp"
+
+namespace
+{
+	constexpr uint32_t max_worker_count = 4;
+
+	struct queued_job
+	{
+		process_id process{};
+		worker_pool::job callback{};
+	};
+
+	FAST_MUTEX queue_mutex{};
+	utils::list<queued_job> job_queue{};
+	bool stopping{false};
+
+	// Signaled while jobs are queued or the pool is stopping
+	KEVENT work_available{};
+
+	utils::list<thread::kernel_thread> workers{};
+
+	class scoped_queue_lock
+	{
+	public:
+		scoped_queue_lock()
+		{
+			ExAcquireFastMutex(&queue_mutex);
+		}
+
+		~scoped_queue_lock()
+		{
+			ExReleaseFastMutex(&queue_mutex);
+		}
+
+		scoped_queue_lock(scoped_queue_lock&& obj) noexcept = delete;
+		scoped_queue_lock& operator=(scoped_queue_lock&& obj) noexcept = delete;
+
+		scoped_queue_lock(const scoped_queue_lock& obj) = delete;
+		scoped_queue_lock& operator=(const scoped_queue_lock& obj) = delete;
+	};
+
+	// Only takes the head of the queue, so a filter keeps jobs in submission order
+	bool try_pop_job(queued_job& job, const process_id* process = nullptr)
+	{
+		scoped_queue_lock _{};
+
+		const auto head = job_queue.begin();
+		if (head == job_queue.end() || (process && head->process != *process))
+		{
+			return false;
+		}
+
+		job = std::move(*head);
+		job_queue.erase(head);
+
+		if (job_queue.empty() && !stopping)
+		{
+			KeClearEvent(&work_available);
+		}
+
+		return true;
+	}
+
+	bool wait_for_job(queued_job& job)
+	{
+		while (true)
+		{
+			if (try_pop_job(job))
+			{
+				return true;
+			}
+
+			{
+				scoped_queue_lock _{};
+				if (stopping && job_queue.empty())
+				{
+					return false;
+				}
+			}
+
+			KeWaitForSingleObject(&work_available, Executive, KernelMode, FALSE, nullptr);
+		}
+	}
+
+	void run_job(const queued_job& job, const bool attached)
+	{
+		try
+		{
+			job.callback(attached);
+		}
+		catch (std::exception& e)
+		{
+			debug_log("Worker job threw an exception: %s\n", e.what());
+		}
+		catch (...)
+		{
+			debug_log("Worker job threw an unknown exception\n");
+		}
+	}
+
+	void run_jobs_for_process(queued_job& job)
+	{
+		const auto process_handle = process::find_process_by_id(job.process);
+		if (!process_handle || !process_handle.is_alive())
+		{
+			debug_log("Bad process: %d\n", job.process);
+			run_job(job, false);
+			return;
+		}
+
+		if (const auto name = process_handle.get_image_filename())
+		{
+			debug_log("Attaching to %s\n", name);
+		}
+
+		process::scoped_process_attacher attacher{process_handle};
+		run_job(job, true);
+
+		const auto process = job.process;
+		while (try_pop_job(job, &process))
+		{
+			run_job(job, true);
+		}
+	}
+
+	void worker_loop()
+	{
+		queued_job job{};
+		while (wait_for_job(job))
+		{
+			run_jobs_for_process(job);
+			job = {};
+		}
+	}
+}
+
+namespace worker_pool
+{
+	void submit(const process_id process, job&& job)
+	{
+		scoped_queue_lock _{};
+
+		if (stopping)
+		{
+			throw std::runtime_error("Worker pool is stopping");
+		}
+
+		auto& entry = job_queue.emplace_back();
+		entry.process = process;
+		entry.callback = std::move(job);
+
+		KeSetEvent(&work_available, IO_NO_INCREMENT, FALSE);
+	}
+
+	scoped_pool::scoped_pool()
+	{
+		ExInitializeFastMutex(&queue_mutex);
+		KeInitializeEvent(&work_available, NotificationEvent, FALSE);
+		stopping = false;
+
+		const auto worker_count = min(thread::get_processor_count(), max_worker_count);
+		for (uint32_t i = 0; i < worker_count; ++i)
+		{
+			workers.emplace_back([]
+			{
+				worker_loop();
+			});
+		}
+	}
+
+	scoped_pool::~scoped_pool()
+	{
+		{
+			scoped_queue_lock _{};
+			stopping = true;
+			KeSetEvent(&work_available, IO_NO_INCREMENT, FALSE);
+		}
+
+		// Workers drain the queue before leaving, so every pended request still completes
+		workers.clear();
+	}
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include "functional.hpp"
+
+namespace worker_pool
+{
+	// Receives whether the worker could attach to the requested process
+	using job = std::function<void(bool attached)>;
+
+	// Queues a job that runs on a pool thread attached to the process.
+	// Consecutive jobs for the same process share one attachment.
+	_IRQL_requires_max_(APC_LEVEL)
+	void submit(process_id process, job&& job);
+
+	class scoped_pool
+	{
+	public:
+		scoped_pool();
+		~scoped_pool();
+
+		scoped_pool(scoped_pool&& obj) noexcept = delete;
+		scoped_pool& operator=(scoped_pool&& obj) noexcept = delete;
+
+		scoped_pool(const scoped_pool& obj) = delete;
+		scoped_pool& operator=(const scoped_pool& obj) = delete;
+	};
+}
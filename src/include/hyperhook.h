@@ -10,9 +10,233 @@
 #define DLL_IMPORT __declspec(dllimport)
 #endif
 
+struct hyperhook_write_region
+{
+	unsigned long long address;
+	const void* data;
+	unsigned long long size;
+};
+
+// The data of a payload region lives at payload_offset inside one shared payload buffer
+struct hyperhook_payload_region
+{
+	unsigned long long address;
+	unsigned long long payload_offset;
+	unsigned long long size;
+};
+
+struct hyperhook_access_record
+{
+	unsigned long long sequence;
+	unsigned long long rip;
+};
+
+struct hyperhook_access_event
+{
+	unsigned long long record_sequence;
+	unsigned long long rip;
+	unsigned long long tsc;
+};
+
+struct hyperhook_syscall_event
+{
+	unsigned long long tsc;
+	unsigned long long cr3;
+	unsigned long long syscall_number;
+	unsigned long long arguments[4];
+	unsigned int process_id;
+	unsigned int processor;
+};
+
+struct hyperhook_stats
+{
+	unsigned int core_count;
+	unsigned long long cpuid_exits;
+	unsigned long long cpuid_cache_hits;
+	unsigned long long cpuid_cache_misses;
+	unsigned long long cpuid_cycles;
+	unsigned long long exits;
+	unsigned long long exit_cycles;
+	unsigned long long payload_copies;
+	unsigned long long payload_bytes_copied;
+};
+
+struct hyperhook_core_bringup
+{
+	unsigned int processor;
+	unsigned int node;
+	unsigned int succeeded;
+	unsigned long long ept_build_cycles;
+	unsigned long long msr_capture_cycles;
+	unsigned long long vmxon_cycles;
+	unsigned long long vmcs_setup_cycles;
+	unsigned long long launch_cycles;
+	unsigned long long total_cycles;
+	char error[64];
+};
+
+#define HYPERHOOK_EPT_ENTRY_HOOK 0
+#define HYPERHOOK_EPT_ENTRY_SPLIT 1
+#define HYPERHOOK_EPT_ENTRY_WATCH_POINT 2
+
+// Splits carry the base of the 2 MB page and have no owners or hits
+struct hyperhook_ept_entry
+{
+	unsigned int type;
+	unsigned int source_pid;
+	unsigned int target_pid;
+	unsigned int patch_count;
+	unsigned long long physical_address;
+	unsigned long long execute_transitions;
+	unsigned long long data_transitions;
+	unsigned long long last_hit_tsc;
+};
+
+struct hyperhook_ept_counts
+{
+	unsigned long long hooks;
+	unsigned long long splits;
+	unsigned long long watch_points;
+};
+
+// Runs on a thread pool thread once an asynchronous request completed.
+// For batches, result holds the number of installed regions.
+typedef void (*hyperhook_completion_callback)(void* context, int success, unsigned long long result);
+
+#define HYPERHOOK_HYPERCALL_PING 0
+#define HYPERHOOK_HYPERCALL_QUERY_STATS 1
+
+// Ping echoes arguments[0] and returns the processor and TSC, query_stats returns the
+// hyperhook_stats fields up to exit_cycles in declaration order. A negative status marks a failed command.
+struct hyperhook_hypercall
+{
+	unsigned int command;
+	int status;
+	unsigned long long arguments[4];
+	unsigned long long results[10];
+};
+
 EXTERN_C DLL_IMPORT
 int hyperhook_initialize();
 
 EXTERN_C DLL_IMPORT
 int hyperhook_write(unsigned int process_id, unsigned long long address, const void* data,
                     unsigned long long size);
+
+// Applies all regions with a single request. Returns the number of regions that were installed.
+// Handles may be NULL, otherwise it receives one hook handle per region, zero for regions that failed.
+EXTERN_C DLL_IMPORT
+unsigned long long hyperhook_write_batch(unsigned int process_id, const struct hyperhook_write_region* regions,
+                                         unsigned long long count, unsigned long long* handles);
+
+// The driver locks the payload pages and copies straight into the hooked pages, without any intermediate
+// copy. Returns the number of regions that were installed.
+EXTERN_C DLL_IMPORT
+unsigned long long hyperhook_write_payload(unsigned int process_id, const struct hyperhook_payload_region* regions,
+                                           unsigned long long count, const void* payload,
+                                           unsigned long long payload_size, unsigned long long* handles);
+
+// The asynchronous variants return once the driver captured the data, the callback may be NULL.
+// Handles must stay valid until the callback ran.
+EXTERN_C DLL_IMPORT
+int hyperhook_write_async(unsigned int process_id, unsigned long long address, const void* data,
+                          unsigned long long size, hyperhook_completion_callback callback, void* context);
+
+EXTERN_C DLL_IMPORT
+int hyperhook_write_batch_async(unsigned int process_id, const struct hyperhook_write_region* regions,
+                                unsigned long long count, unsigned long long* handles,
+                                hyperhook_completion_callback callback, void* context);
+
+// Blocks until every asynchronous request issued so far has completed and its callback returned.
+// Call it before the library is unloaded, requests still pending at that point are cancelled.
+EXTERN_C DLL_IMPORT
+int hyperhook_wait_for_async_requests();
+
+// The unhook functions only restore the pages that lose patches and return the number of removed patches.
+// Bytes that another remaining patch covers keep its content.
+EXTERN_C DLL_IMPORT
+unsigned long long hyperhook_remove_hooks(const unsigned long long* handles, unsigned long long count);
+
+// A process id of zero removes the patches of every process in the range
+EXTERN_C DLL_IMPORT
+unsigned long long hyperhook_remove_hooks_in_range(unsigned int process_id, unsigned long long address,
+                                                   unsigned long long size);
+
+// Removes the patches that the process installed or that target it
+EXTERN_C DLL_IMPORT
+unsigned long long hyperhook_remove_process_hooks(unsigned int process_id);
+
+EXTERN_C DLL_IMPORT
+int hyperhook_remove_all_hooks();
+
+// Replaces all bytes of a hook in place. Other cores execute either the old or the new bytes, never a mix.
+// The size must match the original write, and hooks that span more than one page are rejected.
+EXTERN_C DLL_IMPORT
+int hyperhook_update_hook(unsigned long long handle, const void* data, unsigned long long size);
+
+EXTERN_C DLL_IMPORT
+int hyperhook_set_syscall_filter(unsigned int process_id, const unsigned int* syscall_numbers,
+                                 unsigned long long count);
+
+EXTERN_C DLL_IMPORT
+int hyperhook_remove_syscall_filter(unsigned int process_id);
+
+EXTERN_C DLL_IMPORT
+int hyperhook_clear_syscall_filters();
+
+EXTERN_C DLL_IMPORT
+int hyperhook_map_syscall_events();
+
+EXTERN_C DLL_IMPORT
+unsigned long long hyperhook_read_syscall_events(struct hyperhook_syscall_event* events, unsigned long long max_count);
+
+EXTERN_C DLL_IMPORT
+unsigned long long hyperhook_get_lost_syscall_events();
+
+// Reads the watch point records that follow *cursor and advances it, start with a cursor of zero.
+// Records that were overwritten before they could be read are added to *lost_count.
+// Returns the number of records that were read.
+EXTERN_C DLL_IMPORT
+unsigned long long hyperhook_read_access_records(unsigned long long* cursor, struct hyperhook_access_record* records,
+                                                unsigned long long max_count, unsigned long long* lost_count);
+
+EXTERN_C DLL_IMPORT
+int hyperhook_unmap_syscall_events();
+
+// Maps the per-core watch point rings into this process. The event is set once a ring holds watermark
+// unsignalled records, at most once per interval, and records below the watermark are signalled after one
+// interval. Zero picks the defaults. After waiting on the event, the rings are read without a driver request.
+EXTERN_C DLL_IMPORT
+int hyperhook_map_access_events(void* event, unsigned int watermark, unsigned int interval_ms);
+
+EXTERN_C DLL_IMPORT
+unsigned long long hyperhook_read_access_events(struct hyperhook_access_event* events, unsigned long long max_count);
+
+EXTERN_C DLL_IMPORT
+unsigned long long hyperhook_get_lost_access_events();
+
+EXTERN_C DLL_IMPORT
+int hyperhook_unmap_access_events();
+
+EXTERN_C DLL_IMPORT
+int hyperhook_get_stats(struct hyperhook_stats* stats);
+
+// Reads the hooks, splits and watch points that follow *cursor and advances it, start with a cursor of zero.
+// Counts may be NULL. Returns the number of entries that were read, zero once all were read.
+EXTERN_C DLL_IMPORT
+unsigned long long hyperhook_enumerate_ept_entries(unsigned long long* cursor, struct hyperhook_ept_entry* entries,
+                                                   unsigned long long max_count, struct hyperhook_ept_counts* counts);
+
+EXTERN_C DLL_IMPORT
+int hyperhook_get_bringup_report(struct hyperhook_core_bringup* cores, unsigned int max_cores,
+                                 unsigned int* core_count, unsigned long long* total_microseconds);
+
+// Executes the commands with VMCALL, bypassing the IOCTL path. Returns the number of processed commands.
+EXTERN_C DLL_IMPORT
+unsigned int hyperhook_execute_hypercalls(struct hyperhook_hypercall* commands, unsigned int count);
+
+EXTERN_C DLL_IMPORT
+int hyperhook_get_stats_via_hypercall(struct hyperhook_stats* stats);
+
+EXTERN_C DLL_IMPORT
+int hyperhook_close_hypercall_session();
@@ -1,6 +1,100 @@
 #include "std_include.hpp"
 #include "driver_device.hpp"
 
+namespace
+{
+	struct async_request
+	{
+		OVERLAPPED overlapped{};
+		driver_device::data output{};
+		driver_device::completion_callback callback{};
+	};
+
+	// DeviceIoControl resets the event, so each thread keeps one instead of creating it per request
+	HANDLE get_request_event()
+	{
+		thread_local const native_handle event = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+		return event;
+	}
+}
+
+void CALLBACK driver_device::completion_port::io_callback(PTP_CALLBACK_INSTANCE /*instance*/, const PVOID context,
+                                                          const PVOID overlapped, const ULONG io_result,
+                                                          const ULONG_PTR bytes_transferred, PTP_IO /*io*/)
+{
+	std::unique_ptr<async_request> request(CONTAINING_RECORD(overlapped, async_request, overlapped));
+	request->output.resize(min(static_cast<size_t>(bytes_transferred), request->output.size()));
+
+	try
+	{
+		if (request->callback)
+		{
+			request->callback(io_result == NO_ERROR, request->output);
+		}
+	}
+	catch (...)
+	{
+	}
+
+	static_cast<completion_port*>(context)->finish();
+}
+
+driver_device::completion_port::completion_port(const HANDLE device)
+{
+	this->io_ = CreateThreadpoolIo(device, io_callback, this, nullptr);
+	if (!this->io_)
+	{
+		throw std::runtime_error("Unable to bind device to the thread pool");
+	}
+}
+
+// Only destroyed once no request is pending. The pool releases the object after a callback that is still
+// returning, so there is nothing to wait for.
+driver_device::completion_port::~completion_port()
+{
+	CloseThreadpoolIo(this->io_);
+}
+
+void driver_device::completion_port::start()
+{
+	{
+		std::lock_guard _{this->mutex_};
+		++this->pending_requests_;
+	}
+
+	StartThreadpoolIo(this->io_);
+}
+
+void driver_device::completion_port::cancel()
+{
+	CancelThreadpoolIo(this->io_);
+	this->finish();
+}
+
+void driver_device::completion_port::finish()
+{
+	std::lock_guard _{this->mutex_};
+	if (--this->pending_requests_ == 0)
+	{
+		this->condition_.notify_all();
+	}
+}
+
+void driver_device::completion_port::wait() const
+{
+	std::unique_lock lock{this->mutex_};
+	this->condition_.wait(lock, [this]
+	{
+		return this->pending_requests_ == 0;
+	});
+}
+
+bool driver_device::completion_port::has_pending_requests() const
+{
+	std::lock_guard _{this->mutex_};
+	return this->pending_requests_ != 0;
+}
+
 driver_device::driver_device(const std::string& driver_device)
 {
 	this->device_ = CreateFileA(driver_device.data(),
@@ -8,13 +102,27 @@ driver_device::driver_device(const std::string& driver_device)
 	                            NULL,
 	                            nullptr,
 	                            OPEN_EXISTING,
-	                            NULL,
+	                            FILE_FLAG_OVERLAPPED,
 	                            nullptr);
 
 	if (!this->device_)
 	{
 		throw std::runtime_error("Unable to access device");
 	}
+
+	this->completion_port_ = std::make_unique<completion_port>(this->device_);
+}
+
+// The library device is a function-local static, so this usually runs during process exit under the loader
+// lock, where waiting for thread pool callbacks can hang. Pending requests are cancelled instead, and their
+// completion port is leaked so that late callbacks never touch freed memory.
+driver_device::~driver_device()
+{
+	if (this->completion_port_ && this->completion_port_->has_pending_requests())
+	{
+		CancelIoEx(this->device_, nullptr);
+		(void)this->completion_port_.release();
+	}
 }
 
 bool driver_device::send(const DWORD ioctl_code, const data& input) const
@@ -38,17 +146,32 @@ bool driver_device::send(const DWORD ioctl_code, const data& input, data& output
 bool driver_device::send(const DWORD ioctl_code, const void* input, const size_t input_length, void* output,
                          size_t* output_length) const
 {
+	const auto event = get_request_event();
+	if (!event)
+	{
+		return false;
+	}
+
+	// The low bit keeps synchronous requests away from the thread pool completion callback
+	OVERLAPPED overlapped{};
+	overlapped.hEvent = reinterpret_cast<HANDLE>(reinterpret_cast<ULONG_PTR>(event) | 1);
+
 	DWORD size_returned = 0;
-	const auto success = DeviceIoControl(this->device_,
-	                                     ioctl_code,
-	                                     const_cast<void*>(input),
-	                                     static_cast<DWORD>(input_length),
-	                                     output,
-	                                     static_cast<DWORD>(*output_length),
-	                                     &size_returned,
-	                                     nullptr
+	auto success = DeviceIoControl(this->device_,
+	                               ioctl_code,
+	                               const_cast<void*>(input),
+	                               static_cast<DWORD>(input_length),
+	                               output,
+	                               static_cast<DWORD>(*output_length),
+	                               &size_returned,
+	                               &overlapped
 	) != FALSE;
 
+	if (!success && GetLastError() == ERROR_IO_PENDING)
+	{
+		success = GetOverlappedResult(this->device_, &overlapped, &size_returned, TRUE) != FALSE;
+	}
+
 	*output_length = 0;
 	if (success)
 	{
@@ -57,3 +180,46 @@ bool driver_device::send(const DWORD ioctl_code, const void* input, const size_t
 
 	return success;
 }
+
+bool driver_device::send_async(const DWORD ioctl_code, const void* input, const size_t input_length,
+                               const size_t output_length, completion_callback callback) const
+{
+	if (!this->completion_port_)
+	{
+		return false;
+	}
+
+	auto request = std::make_unique<async_request>();
+	request->output.resize(output_length);
+	request->callback = std::move(callback);
+
+	this->completion_port_->start();
+
+	const auto success = DeviceIoControl(this->device_,
+	                                     ioctl_code,
+	                                     const_cast<void*>(input),
+	                                     static_cast<DWORD>(input_length),
+	                                     request->output.data(),
+	                                     static_cast<DWORD>(output_length),
+	                                     nullptr,
+	                                     &request->overlapped
+	) != FALSE;
+
+	if (!success && GetLastError() != ERROR_IO_PENDING)
+	{
+		this->completion_port_->cancel();
+		return false;
+	}
+
+	// Even synchronous completions are queued to the thread pool, which now owns the request
+	(void)request.release();
+	return true;
+}
+
+void driver_device::wait_for_pending_requests() const
+{
+	if (this->completion_port_)
+	{
+		this->completion_port_->wait();
+	}
+}
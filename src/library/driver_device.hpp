@@ -6,7 +6,7 @@ class driver_device
 public:
 	driver_device() = default;
 	driver_device(const std::string& driver_device);
-	~driver_device() = default;
+	~driver_device();
 
 	driver_device(const driver_device&) = delete;
 	driver_device& operator=(const driver_device&) = delete;
@@ -24,6 +24,46 @@ public:
 	bool send(DWORD ioctl_code, const data& input, data& output) const;
 	bool send(DWORD ioctl_code, const void* input, size_t input_length, void* output, size_t* output_length) const;
 
+	using completion_callback = std::function<void(bool success, const data& output)>;
+
+	// The driver captures the input before this returns, so it may be released right away.
+	// The callback runs on a thread pool thread once the driver completed the request.
+	bool send_async(DWORD ioctl_code, const void* input, size_t input_length, size_t output_length,
+	                completion_callback callback) const;
+
+	// Blocks until the callbacks of all asynchronous requests have returned
+	void wait_for_pending_requests() const;
+
 private:
+	class completion_port
+	{
+	public:
+		completion_port(HANDLE device);
+		~completion_port();
+
+		completion_port(const completion_port&) = delete;
+		completion_port& operator=(const completion_port&) = delete;
+
+		completion_port(completion_port&& obj) noexcept = delete;
+		completion_port& operator=(completion_port&& obj) noexcept = delete;
+
+		void start();
+		void cancel();
+		void finish();
+		void wait() const;
+		bool has_pending_requests() const;
+
+	private:
+		PTP_IO io_{nullptr};
+
+		static void CALLBACK io_callback(PTP_CALLBACK_INSTANCE instance, PVOID context, PVOID overlapped,
+		                                 ULONG io_result, ULONG_PTR bytes_transferred, PTP_IO io);
+
+		mutable std::mutex mutex_{};
+		mutable std::condition_variable condition_{};
+		size_t pending_requests_{0};
+	};
+
 	native_handle device_{};
+	std::unique_ptr<completion_port> completion_port_{};
 };
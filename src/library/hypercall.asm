@@ -0,0 +1,13 @@
+.code
+
+; -----------------------------------------------------
+
+; RCX, RDX and R8 already hold the magic, the session key and the command count
+__vmcall_hypercall PROC
+    vmcall
+    ret
+__vmcall_hypercall ENDP
+
+; -----------------------------------------------------
+
+END
@@ -0,0 +1,7 @@
+#pragma once
+
+extern "C"
+{
+// Returns the number of commands the hypervisor processed, 0 for an unknown key
+uint64_t __vmcall_hypercall(uint64_t magic, uint64_t key, uint64_t command_count);
+}
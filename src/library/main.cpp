@@ -6,82 +6,1305 @@
 #include <irp_data.hpp>
 
 #include "utils/io.hpp"
+#include "hypercall.hpp"
 
 #define DLL_IMPORT __declspec(dllexport)
 #include <hyperhook.h>
 
 namespace
 {
+	hook_request create_hook_request(const uint32_t pid, const uint64_t address, const uint8_t* buffer,
+	                                 const size_t length)
+	{
+		hook_request hook_request{};
+		hook_request.process_id = pid;
+		hook_request.target_address = reinterpret_cast<void*>(address);
+
+		hook_request.source_data = buffer;
+		hook_request.source_data_size = length;
+
+		return hook_request;
+	}
+
 	void patch_data(const driver_device& driver_device, const uint32_t pid, const uint64_t address,
 	                const uint8_t* buffer,
 	                const size_t length)
 	{
-		hook_request hook_request{};
-		hook_request.process_id = pid;
-		hook_request.target_address = reinterpret_cast<void*>(address);
+		auto hook_request = create_hook_request(pid, address, buffer, length);
+
+		driver_device::data input{};
+		input.assign(reinterpret_cast<uint8_t*>(&hook_request),
+		             reinterpret_cast<uint8_t*>(&hook_request) + sizeof(hook_request));
+
+		(void)driver_device.send(HOOK_DRV_IOCTL, input);
+	}
+
+	void patch_data_async(const driver_device& driver_device, const uint32_t pid, const uint64_t address,
+	                      const uint8_t* buffer, const size_t length, const hyperhook_completion_callback callback,
+	                      void* context)
+	{
+		const auto hook_request = create_hook_request(pid, address, buffer, length);
+
+		auto on_completion = [callback, context](const bool success, const driver_device::data&)
+		{
+			if (callback)
+			{
+				callback(context, success ? 1 : 0, 0);
+			}
+		};
+
+		if (!driver_device.send_async(HOOK_DRV_IOCTL, &hook_request, sizeof(hook_request), 0,
+		                              std::move(on_completion)))
+		{
+			throw std::runtime_error("Failed to queue hook request");
+		}
+	}
+
+	std::vector<hook_region> create_hook_regions(const hyperhook_write_region* regions, const size_t count)
+	{
+		std::vector<hook_region> hook_regions{};
+		hook_regions.reserve(count);
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			hook_region region{};
+			region.target_address = reinterpret_cast<void*>(regions[i].address);
+			region.source_data = regions[i].data;
+			region.source_data_size = regions[i].size;
+
+			hook_regions.push_back(region);
+		}
+
+		return hook_regions;
+	}
+
+	uint64_t patch_data_batch(const driver_device& driver_device, const uint32_t pid,
+	                          const hyperhook_write_region* regions, const size_t count, uint64_t* handles)
+	{
+		const auto hook_regions = create_hook_regions(regions, count);
+
+		hook_batch_request request{};
+		request.process_id = pid;
+		request.regions = hook_regions.data();
+		request.region_count = hook_regions.size();
+		request.handles = handles;
+
+		hook_batch_result result{};
+		size_t output_length = sizeof(result);
+		if (!driver_device.send(HOOK_BATCH_DRV_IOCTL, &request, sizeof(request), &result, &output_length)
+			|| output_length < sizeof(result))
+		{
+			throw std::runtime_error("Failed to apply hook batch");
+		}
+
+		return result.installed_region_count;
+	}
+
+	void patch_data_batch_async(const driver_device& driver_device, const uint32_t pid,
+	                            const hyperhook_write_region* regions, const size_t count, uint64_t* handles,
+	                            const hyperhook_completion_callback callback, void* context)
+	{
+		const auto hook_regions = create_hook_regions(regions, count);
+
+		hook_batch_request request{};
+		request.process_id = pid;
+		request.regions = hook_regions.data();
+		request.region_count = hook_regions.size();
+		request.handles = handles;
+
+		auto on_completion = [callback, context](const bool success, const driver_device::data& output)
+		{
+			hook_batch_result result{};
+			const auto valid = success && output.size() >= sizeof(result);
+			if (valid)
+			{
+				memcpy(&result, output.data(), sizeof(result));
+			}
+
+			if (callback)
+			{
+				callback(context, valid ? 1 : 0, result.installed_region_count);
+			}
+		};
+
+		if (!driver_device.send_async(HOOK_BATCH_DRV_IOCTL, &request, sizeof(request), sizeof(hook_batch_result),
+		                              std::move(on_completion)))
+		{
+			throw std::runtime_error("Failed to queue hook batch");
+		}
+	}
+
+	uint64_t patch_payload(const driver_device& driver_device, const uint32_t pid,
+	                       const hyperhook_payload_region* regions, const size_t count, const void* payload,
+	                       const size_t payload_size, uint64_t* handles)
+	{
+		hook_payload_request request{};
+		request.process_id = pid;
+		request.region_count = count;
+		request.handles = handles;
+
+		driver_device::data input(sizeof(request) + count * sizeof(payload_region));
+		memcpy(input.data(), &request, sizeof(request));
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			payload_region region{};
+			region.target_address = reinterpret_cast<void*>(regions[i].address);
+			region.payload_offset = regions[i].payload_offset;
+			region.size = regions[i].size;
+
+			memcpy(input.data() + sizeof(request) + i * sizeof(region), &region, sizeof(region));
+		}
+
+		// The payload travels as the locked output buffer, but the driver only reads it
+		size_t installed_regions = payload_size;
+		if (!driver_device.send(HOOK_PAYLOAD_DRV_IOCTL, input.data(), input.size(), const_cast<void*>(payload),
+		                        &installed_regions))
+		{
+			throw std::runtime_error("Failed to apply hook payload");
+		}
+
+		return installed_regions;
+	}
+
+	void update_hook(const driver_device& driver_device, const uint64_t handle, const void* data, const size_t size)
+	{
+		update_hook_request request{};
+		request.handle = handle;
+		request.data = data;
+		request.data_size = size;
+
+		size_t output_length = 0;
+		if (!driver_device.send(UPDATE_HOOK_DRV_IOCTL, &request, sizeof(request), nullptr, &output_length))
+		{
+			throw std::runtime_error("Failed to update hook");
+		}
+	}
+
+	uint64_t remove_hooks(const driver_device& driver_device, const unhook_request& request)
+	{
+		unhook_result result{};
+		size_t output_length = sizeof(result);
+		if (!driver_device.send(UNHOOK_DRV_IOCTL, &request, sizeof(request), &result, &output_length)
+			|| output_length < sizeof(result))
+		{
+			throw std::runtime_error("Failed to remove hooks");
+		}
+
+		return result.removed_patch_count;
+	}
+
+	void send_syscall_filter(const driver_device& driver_device, const syscall_filter_request& request)
+	{
+		driver_device::data input{};
+		input.assign(reinterpret_cast<const uint8_t*>(&request),
+		             reinterpret_cast<const uint8_t*>(&request) + sizeof(request));
+
+		(void)driver_device.send(SYSCALL_FILTER_DRV_IOCTL, input);
+	}
+
+	template <typename Entry>
+	struct event_readers
+	{
+		std::mutex mutex{};
+		std::vector<event_ring::reader<Entry>> readers{};
+		size_t next_reader{0};
+		uint64_t lost_before_remap{0};
+	};
+
+	using syscall_event_readers = event_readers<syscall_event>;
+	using access_event_readers = event_readers<access_event>;
+
+	syscall_event_readers& get_syscall_event_readers()
+	{
+		static syscall_event_readers readers{};
+		return readers;
+	}
+
+	access_event_readers& get_access_event_readers()
+	{
+		static access_event_readers readers{};
+		return readers;
+	}
+
+	template <typename Entry>
+	uint64_t get_lost_events(const event_readers<Entry>& readers)
+	{
+		auto lost = readers.lost_before_remap;
+		for (const auto& reader : readers.readers)
+		{
+			lost += reader.get_lost();
+		}
+
+		return lost;
+	}
+
+	void map_syscall_events(const driver_device& driver_device)
+	{
+		auto& readers = get_syscall_event_readers();
+		std::lock_guard _{readers.mutex};
+
+		if (!readers.readers.empty())
+		{
+			return;
+		}
+
+		syscall_event_mapping mapping{};
+		size_t output_length = sizeof(mapping);
+		if (!driver_device.send(MAP_SYSCALL_EVENTS_DRV_IOCTL, nullptr, 0, &mapping, &output_length)
+			|| output_length < sizeof(mapping))
+		{
+			throw std::runtime_error("Failed to map syscall events");
+		}
+
+		for (uint32_t i = 0; i < mapping.ring_count; ++i)
+		{
+			readers.readers.emplace_back(mapping.rings[i]);
+		}
+
+		readers.next_reader = 0;
+	}
+
+	void unmap_syscall_events(const driver_device& driver_device)
+	{
+		auto& readers = get_syscall_event_readers();
+		std::lock_guard _{readers.mutex};
+
+		if (readers.readers.empty())
+		{
+			return;
+		}
+
+		readers.lost_before_remap = get_lost_events(readers);
+		readers.readers.clear();
+
+		(void)driver_device.send(UNMAP_SYSCALL_EVENTS_DRV_IOCTL, {});
+	}
+
+	size_t read_syscall_events(hyperhook_syscall_event* events, const size_t max_count)
+	{
+		auto& readers = get_syscall_event_readers();
+		std::lock_guard _{readers.mutex};
+
+		if (readers.readers.empty())
+		{
+			return 0;
+		}
+
+		syscall_event buffer[64]{};
+		size_t count = 0;
+
+		// Rotate the starting ring, so a busy core cannot starve the others
+		for (size_t i = 0; i < readers.readers.size() && count < max_count; ++i)
+		{
+			auto& reader = readers.readers[(readers.next_reader + i) % readers.readers.size()];
+
+			while (count < max_count)
+			{
+				const auto read_count = reader.read(buffer, min(std::size(buffer), max_count - count));
+				for (size_t j = 0; j < read_count; ++j)
+				{
+					const auto& source = buffer[j];
+					auto& target = events[count++];
+
+					target.tsc = source.tsc;
+					target.cr3 = source.cr3;
+					target.syscall_number = source.syscall_number;
+					memcpy(target.arguments, source.arguments, sizeof(target.arguments));
+					target.process_id = source.process_id;
+					target.processor = source.processor;
+				}
+
+				if (read_count < std::size(buffer))
+				{
+					break;
+				}
+			}
+		}
+
+		readers.next_reader = (readers.next_reader + 1) % readers.readers.size();
+		return count;
+	}
+
+	void get_stats(const driver_device& driver_device, hyperhook_stats& stats)
+	{
+		hypervisor_stats driver_stats{};
+		size_t output_length = sizeof(driver_stats);
+		if (!driver_device.send(GET_STATS_DRV_IOCTL, nullptr, 0, &driver_stats, &output_length)
+			|| output_length < sizeof(driver_stats))
+		{
+			throw std::runtime_error("Failed to query stats");
+		}
+
+		stats.core_count = driver_stats.core_count;
+		stats.cpuid_exits = driver_stats.cpuid_exits;
+		stats.cpuid_cache_hits = driver_stats.cpuid_cache_hits;
+		stats.cpuid_cache_misses = driver_stats.cpuid_cache_misses;
+		stats.cpuid_cycles = driver_stats.cpuid_cycles;
+		stats.exits = driver_stats.exits;
+		stats.exit_cycles = driver_stats.exit_cycles;
+		stats.payload_copies = driver_stats.payload_copies;
+		stats.payload_bytes_copied = driver_stats.payload_bytes_copied;
+	}
+
+	void map_access_events(const driver_device& driver_device, const HANDLE event, const uint32_t watermark,
+	                       const uint32_t interval_ms)
+	{
+		auto& readers = get_access_event_readers();
+		std::lock_guard _{readers.mutex};
+
+		if (!readers.readers.empty())
+		{
+			return;
+		}
+
+		access_event_mapping_request request{};
+		request.event_handle = reinterpret_cast<uint64_t>(event);
+		request.watermark = watermark;
+		request.interval_ms = interval_ms;
+
+		access_event_mapping mapping{};
+		size_t output_length = sizeof(mapping);
+		if (!driver_device.send(MAP_ACCESS_EVENTS_DRV_IOCTL, &request, sizeof(request), &mapping, &output_length)
+			|| output_length < sizeof(mapping))
+		{
+			throw std::runtime_error("Failed to map access events");
+		}
+
+		for (uint32_t i = 0; i < mapping.ring_count; ++i)
+		{
+			readers.readers.emplace_back(mapping.rings[i]);
+		}
+
+		readers.next_reader = 0;
+	}
+
+	void unmap_access_events(const driver_device& driver_device)
+	{
+		auto& readers = get_access_event_readers();
+		std::lock_guard _{readers.mutex};
+
+		if (readers.readers.empty())
+		{
+			return;
+		}
+
+		readers.lost_before_remap = get_lost_events(readers);
+		readers.readers.clear();
+
+		(void)driver_device.send(UNMAP_ACCESS_EVENTS_DRV_IOCTL, {});
+	}
+
+	size_t read_access_events(hyperhook_access_event* events, const size_t max_count)
+	{
+		auto& readers = get_access_event_readers();
+		std::lock_guard _{readers.mutex};
+
+		if (readers.readers.empty())
+		{
+			return 0;
+		}
+
+		access_event buffer[64]{};
+		size_t count = 0;
+
+		for (size_t i = 0; i < readers.readers.size() && count < max_count; ++i)
+		{
+			auto& reader = readers.readers[(readers.next_reader + i) % readers.readers.size()];
+
+			while (count < max_count)
+			{
+				const auto read_count = reader.read(buffer, min(std::size(buffer), max_count - count));
+				for (size_t j = 0; j < read_count; ++j)
+				{
+					auto& target = events[count++];
+					target.record_sequence = buffer[j].record_sequence;
+					target.rip = buffer[j].rip;
+					target.tsc = buffer[j].tsc;
+				}
+
+				if (read_count < std::size(buffer))
+				{
+					break;
+				}
+			}
+		}
+
+		readers.next_reader = (readers.next_reader + 1) % readers.readers.size();
+		return count;
+	}
+
+	size_t read_access_records(const driver_device& driver_device, uint64_t& cursor, hyperhook_access_record* records,
+	                           const size_t max_count, uint64_t& lost_count)
+	{
+		access_record_request request{};
+		request.cursor = cursor;
+
+		std::vector<uint8_t> buffer(sizeof(access_record_header) + max_count * sizeof(access_record));
+
+		size_t output_length = buffer.size();
+		if (!driver_device.send(READ_ACCESS_RECORDS_DRV_IOCTL, &request, sizeof(request), buffer.data(),
+		                        &output_length)
+			|| output_length < sizeof(access_record_header))
+		{
+			throw std::runtime_error("Failed to read access records");
+		}
+
+		access_record_header header{};
+		memcpy(&header, buffer.data(), sizeof(header));
+
+		const auto count = min(static_cast<size_t>(header.record_count), max_count);
+		for (size_t i = 0; i < count; ++i)
+		{
+			access_record record{};
+			memcpy(&record, buffer.data() + sizeof(header) + i * sizeof(record), sizeof(record));
+
+			records[i].sequence = record.sequence;
+			records[i].rip = record.rip;
+		}
+
+		cursor = header.next_cursor;
+		lost_count += header.lost_count;
+
+		return count;
+	}
+
+	size_t enumerate_ept_entries(const driver_device& driver_device, uint64_t& cursor, hyperhook_ept_entry* entries,
+	                             const size_t max_count, hyperhook_ept_counts* counts)
+	{
+		ept_entry_request request{};
+		request.cursor = cursor;
+
+		const auto request_count = min(max_count, static_cast<size_t>(max_ept_entries_per_request));
+		std::vector<uint8_t> buffer(sizeof(ept_entry_header) + request_count * sizeof(ept_entry_descriptor));
+
+		size_t output_length = buffer.size();
+		if (!driver_device.send(ENUMERATE_EPT_ENTRIES_DRV_IOCTL, &request, sizeof(request), buffer.data(),
+		                        &output_length)
+			|| output_length < sizeof(ept_entry_header))
+		{
+			throw std::runtime_error("Failed to enumerate EPT entries");
+		}
+
+		ept_entry_header header{};
+		memcpy(&header, buffer.data(), sizeof(header));
+
+		const auto count = min(static_cast<size_t>(header.entry_count), request_count);
+		for (size_t i = 0; i < count; ++i)
+		{
+			ept_entry_descriptor descriptor{};
+			memcpy(&descriptor, buffer.data() + sizeof(header) + i * sizeof(descriptor), sizeof(descriptor));
+
+			auto& entry = entries[i];
+			entry.type = static_cast<unsigned int>(descriptor.type);
+			entry.source_pid = descriptor.source_pid;
+			entry.target_pid = descriptor.target_pid;
+			entry.patch_count = descriptor.patch_count;
+			entry.physical_address = descriptor.physical_address;
+			entry.execute_transitions = descriptor.execute_transitions;
+			entry.data_transitions = descriptor.data_transitions;
+			entry.last_hit_tsc = descriptor.last_hit_tsc;
+		}
+
+		if (counts)
+		{
+			counts->hooks = header.hook_count;
+			counts->splits = header.split_count;
+			counts->watch_points = header.watch_point_count;
+		}
+
+		cursor = header.next_cursor;
+		return count;
+	}
+
+	size_t get_bringup_report(const driver_device& driver_device, hyperhook_core_bringup* cores,
+	                          const size_t max_cores, bringup_report_header& header)
+	{
+		std::vector<uint8_t> buffer(sizeof(bringup_report_header) + max_cores * sizeof(core_bringup_report));
+
+		size_t output_length = buffer.size();
+		if (!driver_device.send(GET_BRINGUP_REPORT_DRV_IOCTL, nullptr, 0, buffer.data(), &output_length)
+			|| output_length < sizeof(header))
+		{
+			throw std::runtime_error("Failed to query bring-up report");
+		}
+
+		memcpy(&header, buffer.data(), sizeof(header));
+
+		const auto count = (output_length - sizeof(header)) / sizeof(core_bringup_report);
+		const auto* reports = reinterpret_cast<const core_bringup_report*>(buffer.data() + sizeof(header));
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			const auto& report = reports[i];
+			auto& core = cores[i];
+
+			core.processor = report.processor;
+			core.node = report.node;
+			core.succeeded = report.succeeded;
+			core.ept_build_cycles = report.ept_build_cycles;
+			core.msr_capture_cycles = report.msr_capture_cycles;
+			core.vmxon_cycles = report.vmxon_cycles;
+			core.vmcs_setup_cycles = report.vmcs_setup_cycles;
+			core.launch_cycles = report.launch_cycles;
+			core.total_cycles = report.total_cycles;
+			memcpy(core.error, report.error, sizeof(core.error));
+		}
+
+		return count;
+	}
+
+	struct hypercall_client
+	{
+		std::mutex mutex{};
+		hypercall_session session{};
+	};
+
+	hypercall_client& get_hypercall_client()
+	{
+		static hypercall_client client{};
+		return client;
+	}
+
+	void open_hypercall_session(const driver_device& driver_device, hypercall_client& client)
+	{
+		if (client.session.commands)
+		{
+			return;
+		}
+
+		hypercall_session session{};
+		size_t output_length = sizeof(session);
+		if (!driver_device.send(OPEN_HYPERCALL_SESSION_DRV_IOCTL, nullptr, 0, &session, &output_length)
+			|| output_length < sizeof(session) || !session.commands || !session.command_capacity)
+		{
+			throw std::runtime_error("Failed to open hypercall session");
+		}
+
+		client.session = session;
+	}
+
+	void close_hypercall_session(const driver_device& driver_device)
+	{
+		auto& client = get_hypercall_client();
+		std::lock_guard _{client.mutex};
+
+		if (!client.session.commands)
+		{
+			return;
+		}
+
+		client.session = {};
+		(void)driver_device.send(CLOSE_HYPERCALL_SESSION_DRV_IOCTL, {});
+	}
+
+	size_t execute_hypercalls(const driver_device& driver_device, hyperhook_hypercall* commands, const size_t count)
+	{
+		auto& client = get_hypercall_client();
+		std::lock_guard _{client.mutex};
+
+		open_hypercall_session(driver_device, client);
+
+		const auto& session = client.session;
+		size_t processed = 0;
+
+		while (processed < count)
+		{
+			const auto batch_size = min(count - processed, static_cast<size_t>(session.command_capacity));
+
+			for (size_t i = 0; i < batch_size; ++i)
+			{
+				const auto& source = commands[processed + i];
+				auto& target = session.commands[i];
+
+				target = {};
+				target.type = static_cast<hypercall_command_type>(source.command);
+				memcpy(target.arguments, source.arguments, sizeof(target.arguments));
+			}
+
+			const auto executed = static_cast<size_t>(
+				__vmcall_hypercall(hypercall_session_magic, session.key, batch_size));
+
+			for (size_t i = 0; i < executed && i < batch_size; ++i)
+			{
+				const auto& source = session.commands[i];
+				auto& target = commands[processed + i];
+
+				target.status = static_cast<int>(source.status);
+				memcpy(target.results, source.results, sizeof(target.results));
+			}
+
+			processed += min(executed, batch_size);
+			if (executed < batch_size)
+			{
+				break;
+			}
+		}
+
+		return processed;
+	}
+
+	driver_device create_driver_device()
+	{
+		return driver_device{R"(\\.\HyperHook)"};
+	}
+
+	driver create_driver()
+	{
+		return driver{std::filesystem::absolute(DRIVER_NAME), "HyperHookDriver"};
+	}
+
+	driver_device& get_driver_device()
+	{
+		static driver hypervisor{};
+		static driver_device device{};
+
+		if (!device)
+		{
+			try
+			{
+				device = create_driver_device();
+			}
+			catch (...)
+			{
+			}
+		}
+
+		if (device)
+		{
+			return device;
+		}
+
+		if (!hypervisor)
+		{
+			hypervisor = create_driver();
+		}
+
+		if (!device)
+		{
+			device = create_driver_device();
+		}
+
+		return device;
+	}
+
+	uint64_t try_remove_hooks(const unhook_request& request)
+	{
+		if (hyperhook_initialize() == 0)
+		{
+			return 0;
+		}
+
+		try
+		{
+			const auto& device = get_driver_device();
+			if (device)
+			{
+				return remove_hooks(device, request);
+			}
+		}
+		catch (const std::exception& e)
+		{
+			printf("%s\n", e.what());
+		}
+
+		return 0;
+	}
+}
+
+int hyperhook_initialize()
+{
+	try
+	{
+		const auto& device = get_driver_device();
+		if (device)
+		{
+			return 1;
+		}
+	}
+	catch (const std::exception& e)
+	{
+		printf("%s\n", e.what());
+	}
+
+	return 0;
+}
+
+int hyperhook_write(const unsigned int process_id, const unsigned long long address, const void* data,
+                    const unsigned long long size)
+{
+	if (hyperhook_initialize() == 0)
+	{
+		return 0;
+	}
+
+	try
+	{
+		const auto& device = get_driver_device();
+		if (device)
+		{
+			patch_data(device, process_id, address, static_cast<const uint8_t*>(data), size);
+			return 1;
+		}
+	}
+	catch (const std::exception& e)
+	{
+		printf("%s\n", e.what());
+	}
+
+	return 0;
+}
+
+unsigned long long hyperhook_write_batch(const unsigned int process_id, const hyperhook_write_region* regions,
+                                         const unsigned long long count, unsigned long long* handles)
+{
+	if (!regions || !count || hyperhook_initialize() == 0)
+	{
+		return 0;
+	}
+
+	try
+	{
+		const auto& device = get_driver_device();
+		if (device)
+		{
+			return patch_data_batch(device, process_id, regions, count, handles);
+		}
+	}
+	catch (const std::exception& e)
+	{
+		printf("%s\n", e.what());
+	}
+
+	return 0;
+}
+
+unsigned long long hyperhook_write_payload(const unsigned int process_id, const hyperhook_payload_region* regions,
+                                           const unsigned long long count, const void* payload,
+                                           const unsigned long long payload_size, unsigned long long* handles)
+{
+	if (!regions || !count || !payload || !payload_size || hyperhook_initialize() == 0)
+	{
+		return 0;
+	}
+
+	try
+	{
+		const auto& device = get_driver_device();
+		if (device)
+		{
+			return patch_payload(device, process_id, regions, count, payload, payload_size, handles);
+		}
+	}
+	catch (const std::exception& e)
+	{
+		printf("%s\n", e.what());
+	}
+
+	return 0;
+}
+
+int hyperhook_write_async(const unsigned int process_id, const unsigned long long address, const void* data,
+                          const unsigned long long size, const hyperhook_completion_callback callback,
+                          void* context)
+{
+	if (hyperhook_initialize() == 0)
+	{
+		return 0;
+	}
+
+	try
+	{
+		const auto& device = get_driver_device();
+		if (device)
+		{
+			patch_data_async(device, process_id, address, static_cast<const uint8_t*>(data), size, callback,
+			                 context);
+			return 1;
+		}
+	}
+	catch (const std::exception& e)
+	{
+		printf("%s\n", e.what());
+	}
+
+	return 0;
+}
+
+int hyperhook_write_batch_async(const unsigned int process_id, const hyperhook_write_region* regions,
+                                const unsigned long long count, unsigned long long* handles,
+                                const hyperhook_completion_callback callback, void* context)
+{
+	if (!regions || !count || hyperhook_initialize() == 0)
+	{
+		return 0;
+	}
+
+	try
+	{
+		const auto& device = get_driver_device();
+		if (device)
+		{
+			patch_data_batch_async(device, process_id, regions, count, handles, callback, context);
+			return 1;
+		}
+	}
+	catch (const std::exception& e)
+	{
+		printf("%s\n", e.what());
+	}
+
+	return 0;
+}
+
+int hyperhook_wait_for_async_requests()
+{
+	if (hyperhook_initialize() == 0)
+	{
+		return 0;
+	}
+
+	try
+	{
+		const auto& device = get_driver_device();
+		if (device)
+		{
+			device.wait_for_pending_requests();
+			return 1;
+		}
+	}
+	catch (const std::exception& e)
+	{
+		printf("%s\n", e.what());
+	}
+
+	return 0;
+}
+
+unsigned long long hyperhook_remove_hooks(const unsigned long long* handles, const unsigned long long count)
+{
+	if (!handles || !count)
+	{
+		return 0;
+	}
+
+	unhook_request request{};
+	request.type = unhook_type::handles;
+	request.handles = handles;
+	request.handle_count = count;
+
+	return try_remove_hooks(request);
+}
+
+unsigned long long hyperhook_remove_hooks_in_range(const unsigned int process_id, const unsigned long long address,
+                                                   const unsigned long long size)
+{
+	if (!size)
+	{
+		return 0;
+	}
+
+	unhook_request request{};
+	request.type = unhook_type::range;
+	request.process_id = process_id;
+	request.range_start = reinterpret_cast<const void*>(address);
+	request.range_length = size;
+
+	return try_remove_hooks(request);
+}
+
+unsigned long long hyperhook_remove_process_hooks(const unsigned int process_id)
+{
+	unhook_request request{};
+	request.type = unhook_type::process;
+	request.process_id = process_id;
+
+	return try_remove_hooks(request);
+}
+
+int hyperhook_update_hook(const unsigned long long handle, const void* data, const unsigned long long size)
+{
+	if (!data || !size || hyperhook_initialize() == 0)
+	{
+		return 0;
+	}
+
+	try
+	{
+		const auto& device = get_driver_device();
+		if (device)
+		{
+			update_hook(device, handle, data, static_cast<size_t>(size));
+			return 1;
+		}
+	}
+	catch (const std::exception& e)
+	{
+		printf("%s\n", e.what());
+	}
+
+	return 0;
+}
+
+int hyperhook_remove_all_hooks()
+{
+	if (hyperhook_initialize() == 0)
+	{
+		return 0;
+	}
+
+	try
+	{
+		const auto& device = get_driver_device();
+		if (device)
+		{
+			unhook_request request{};
+			request.type = unhook_type::all;
+
+			(void)remove_hooks(device, request);
+			return 1;
+		}
+	}
+	catch (const std::exception& e)
+	{
+		printf("%s\n", e.what());
+	}
+
+	return 0;
+}
+
+int hyperhook_set_syscall_filter(const unsigned int process_id, const unsigned int* syscall_numbers,
+                                 const unsigned long long count)
+{
+	if (hyperhook_initialize() == 0)
+	{
+		return 0;
+	}
+
+	try
+	{
+		auto request = std::make_unique<syscall_filter_request>();
+		request->operation = syscall_filter_operation::set;
+		request->process_id = process_id;
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			const auto syscall_number = syscall_numbers[i];
+			if (syscall_number >= syscall_filter_max_syscalls)
+			{
+				throw std::runtime_error("Syscall number out of range");
+			}
+
+			request->syscall_bitmap[syscall_number / 64] |= 1ull << (syscall_number % 64);
+		}
+
+		const auto& device = get_driver_device();
+		if (device)
+		{
+			send_syscall_filter(device, *request);
+			return 1;
+		}
+	}
+	catch (const std::exception& e)
+	{
+		printf("%s\n", e.what());
+	}
+
+	return 0;
+}
+
+int hyperhook_remove_syscall_filter(const unsigned int process_id)
+{
+	if (hyperhook_initialize() == 0)
+	{
+		return 0;
+	}
 
-		hook_request.source_data = buffer;
-		hook_request.source_data_size = length;
+	try
+	{
+		syscall_filter_request request{};
+		request.operation = syscall_filter_operation::remove;
+		request.process_id = process_id;
 
-		driver_device::data input{};
-		input.assign(reinterpret_cast<uint8_t*>(&hook_request),
-		             reinterpret_cast<uint8_t*>(&hook_request) + sizeof(hook_request));
+		const auto& device = get_driver_device();
+		if (device)
+		{
+			send_syscall_filter(device, request);
+			return 1;
+		}
+	}
+	catch (const std::exception& e)
+	{
+		printf("%s\n", e.what());
+	}
 
-		(void)driver_device.send(HOOK_DRV_IOCTL, input);
+	return 0;
+}
+
+int hyperhook_clear_syscall_filters()
+{
+	if (hyperhook_initialize() == 0)
+	{
+		return 0;
 	}
 
-	driver_device create_driver_device()
+	try
 	{
-		return driver_device{R"(\\.\HyperHook)"};
+		syscall_filter_request request{};
+		request.operation = syscall_filter_operation::clear;
+
+		const auto& device = get_driver_device();
+		if (device)
+		{
+			send_syscall_filter(device, request);
+			return 1;
+		}
+	}
+	catch (const std::exception& e)
+	{
+		printf("%s\n", e.what());
 	}
 
-	driver create_driver()
+	return 0;
+}
+
+int hyperhook_map_syscall_events()
+{
+	if (hyperhook_initialize() == 0)
 	{
-		return driver{std::filesystem::absolute(DRIVER_NAME), "HyperHookDriver"};
+		return 0;
 	}
 
-	driver_device& get_driver_device()
+	try
 	{
-		static driver hypervisor{};
-		static driver_device device{};
+		const auto& device = get_driver_device();
+		if (device)
+		{
+			map_syscall_events(device);
+			return 1;
+		}
+	}
+	catch (const std::exception& e)
+	{
+		printf("%s\n", e.what());
+	}
 
-		if (!device)
+	return 0;
+}
+
+unsigned long long hyperhook_read_syscall_events(hyperhook_syscall_event* events, const unsigned long long max_count)
+{
+	if (!events)
+	{
+		return 0;
+	}
+
+	return read_syscall_events(events, static_cast<size_t>(max_count));
+}
+
+unsigned long long hyperhook_read_access_records(unsigned long long* cursor, hyperhook_access_record* records,
+                                                const unsigned long long max_count, unsigned long long* lost_count)
+{
+	if (!cursor || (!records && max_count) || hyperhook_initialize() == 0)
+	{
+		return 0;
+	}
+
+	try
+	{
+		const auto& device = get_driver_device();
+		if (device)
 		{
-			try
-			{
-				device = create_driver_device();
-			}
-			catch (...)
+			uint64_t current_cursor = *cursor;
+			uint64_t lost = 0;
+
+			const auto count = read_access_records(device, current_cursor, records, static_cast<size_t>(max_count),
+			                                       lost);
+
+			*cursor = current_cursor;
+			if (lost_count)
 			{
+				*lost_count += lost;
 			}
+
+			return count;
 		}
+	}
+	catch (const std::exception& e)
+	{
+		printf("%s\n", e.what());
+	}
+
+	return 0;
+}
+
+unsigned long long hyperhook_get_lost_syscall_events()
+{
+	auto& readers = get_syscall_event_readers();
+	std::lock_guard _{readers.mutex};
+
+	return get_lost_events(readers);
+}
+
+int hyperhook_map_access_events(void* event, const unsigned int watermark, const unsigned int interval_ms)
+{
+	if (!event || hyperhook_initialize() == 0)
+	{
+		return 0;
+	}
 
+	try
+	{
+		const auto& device = get_driver_device();
 		if (device)
 		{
-			return device;
+			map_access_events(device, event, watermark, interval_ms);
+			return 1;
 		}
+	}
+	catch (const std::exception& e)
+	{
+		printf("%s\n", e.what());
+	}
 
-		if (!hypervisor)
+	return 0;
+}
+
+unsigned long long hyperhook_read_access_events(hyperhook_access_event* events, const unsigned long long max_count)
+{
+	if (!events)
+	{
+		return 0;
+	}
+
+	return read_access_events(events, static_cast<size_t>(max_count));
+}
+
+unsigned long long hyperhook_get_lost_access_events()
+{
+	auto& readers = get_access_event_readers();
+	std::lock_guard _{readers.mutex};
+
+	return get_lost_events(readers);
+}
+
+int hyperhook_unmap_access_events()
+{
+	try
+	{
+		const auto& device = get_driver_device();
+		if (device)
 		{
-			hypervisor = create_driver();
+			unmap_access_events(device);
+			return 1;
 		}
+	}
+	catch (const std::exception& e)
+	{
+		printf("%s\n", e.what());
+	}
 
-		if (!device)
+	return 0;
+}
+
+int hyperhook_unmap_syscall_events()
+{
+	try
+	{
+		const auto& device = get_driver_device();
+		if (device)
 		{
-			device = create_driver_device();
+			unmap_syscall_events(device);
+			return 1;
 		}
+	}
+	catch (const std::exception& e)
+	{
+		printf("%s\n", e.what());
+	}
 
-		return device;
+	return 0;
+}
+
+int hyperhook_get_stats(hyperhook_stats* stats)
+{
+	if (!stats || hyperhook_initialize() == 0)
+	{
+		return 0;
+	}
+
+	try
+	{
+		const auto& device = get_driver_device();
+		if (device)
+		{
+			get_stats(device, *stats);
+			return 1;
+		}
+	}
+	catch (const std::exception& e)
+	{
+		printf("%s\n", e.what());
 	}
+
+	return 0;
 }
 
-int hyperhook_initialize()
+unsigned long long hyperhook_enumerate_ept_entries(unsigned long long* cursor, hyperhook_ept_entry* entries,
+                                                   const unsigned long long max_count, hyperhook_ept_counts* counts)
+{
+	if (!cursor || (!entries && max_count) || hyperhook_initialize() == 0)
+	{
+		return 0;
+	}
+
+	try
+	{
+		const auto& device = get_driver_device();
+		if (device)
+		{
+			uint64_t current_cursor = *cursor;
+			const auto count = enumerate_ept_entries(device, current_cursor, entries, static_cast<size_t>(max_count),
+			                                         counts);
+
+			*cursor = current_cursor;
+			return count;
+		}
+	}
+	catch (const std::exception& e)
+	{
+		printf("%s\n", e.what());
+	}
+
+	return 0;
+}
+
+int hyperhook_get_bringup_report(hyperhook_core_bringup* cores, const unsigned int max_cores,
+                                 unsigned int* core_count, unsigned long long* total_microseconds)
 {
+	if ((!cores && max_cores) || hyperhook_initialize() == 0)
+	{
+		return 0;
+	}
+
 	try
 	{
 		const auto& device = get_driver_device();
 		if (device)
 		{
+			bringup_report_header header{};
+			const auto count = get_bringup_report(device, cores, max_cores, header);
+
+			if (core_count)
+			{
+				*core_count = static_cast<unsigned int>(count);
+			}
+
+			if (total_microseconds)
+			{
+				*total_microseconds = header.total_microseconds;
+			}
+
 			return 1;
 		}
 	}
@@ -93,8 +1316,56 @@ int hyperhook_initialize()
 	return 0;
 }
 
-int hyperhook_write(const unsigned int process_id, const unsigned long long address, const void* data,
-                    const unsigned long long size)
+unsigned int hyperhook_execute_hypercalls(hyperhook_hypercall* commands, const unsigned int count)
+{
+	if (!commands || hyperhook_initialize() == 0)
+	{
+		return 0;
+	}
+
+	try
+	{
+		const auto& device = get_driver_device();
+		if (device)
+		{
+			return static_cast<unsigned int>(execute_hypercalls(device, commands, count));
+		}
+	}
+	catch (const std::exception& e)
+	{
+		printf("%s\n", e.what());
+	}
+
+	return 0;
+}
+
+int hyperhook_get_stats_via_hypercall(hyperhook_stats* stats)
+{
+	if (!stats)
+	{
+		return 0;
+	}
+
+	hyperhook_hypercall command{};
+	command.command = HYPERHOOK_HYPERCALL_QUERY_STATS;
+
+	if (hyperhook_execute_hypercalls(&command, 1) != 1 || command.status < 0)
+	{
+		return 0;
+	}
+
+	stats->core_count = static_cast<unsigned int>(command.results[0]);
+	stats->cpuid_exits = command.results[1];
+	stats->cpuid_cache_hits = command.results[2];
+	stats->cpuid_cache_misses = command.results[3];
+	stats->cpuid_cycles = command.results[4];
+	stats->exits = command.results[5];
+	stats->exit_cycles = command.results[6];
+
+	return 1;
+}
+
+int hyperhook_close_hypercall_session()
 {
 	if (hyperhook_initialize() == 0)
 	{
@@ -106,7 +1377,7 @@ int hyperhook_write(const unsigned int process_id, const unsigned long long addr
 		const auto& device = get_driver_device();
 		if (device)
 		{
-			patch_data(device, process_id, address, static_cast<const uint8_t*>(data), size);
+			close_hypercall_session(device);
 			return 1;
 		}
 	}
@@ -3,6 +3,8 @@
 #include <string>
 #include <vector>
 #include <mutex>
+#include <condition_variable>
+#include <memory>
 #include <filesystem>
 #include <functional>
 #include <iostream>
@@ -1,7 +1,9 @@
 #include <vector>
+#include <algorithm>
 #include <conio.h>
 #include <optional>
 #include <stdexcept>
+#include <string_view>
 
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
@@ -9,20 +11,34 @@
 #include <hyperhook.h>
 
 
-bool patch_data(const uint32_t process_id, const uint64_t address, const void* buffer,
-                const size_t length)
+// Collects all patches of a profile into one payload, so they reach the driver in a single request
+class patch_batch
 {
-	return hyperhook_write(process_id, address, buffer, length) != 0;
-}
+public:
+	void patch_data(const uint64_t address, const void* buffer, const size_t length)
+	{
+		const auto* data = static_cast<const uint8_t*>(buffer);
+		this->regions_.push_back({address, this->payload_.size(), length});
+		this->payload_.insert(this->payload_.end(), data, data + length);
+	}
 
-bool insert_nop(const uint32_t process_id, const uint64_t address, const size_t length)
-{
-	std::vector<uint8_t> buffer{};
-	buffer.resize(length);
-	memset(buffer.data(), 0x90, buffer.size());
+	void insert_nop(const uint64_t address, const size_t length)
+	{
+		this->regions_.push_back({address, this->payload_.size(), length});
+		this->payload_.insert(this->payload_.end(), length, 0x90);
+	}
 
-	return patch_data(process_id, address, buffer.data(), buffer.size());
-}
+	bool apply(const uint32_t process_id) const
+	{
+		return hyperhook_write_payload(process_id, this->regions_.data(), this->regions_.size(),
+		                               this->payload_.data(), this->payload_.size(), nullptr)
+			== this->regions_.size();
+	}
+
+private:
+	std::vector<hyperhook_payload_region> regions_{};
+	std::vector<uint8_t> payload_{};
+};
 
 std::optional<uint32_t> get_process_id_from_window(const char* class_name, const char* window_name)
 {
@@ -39,22 +55,29 @@ std::optional<uint32_t> get_process_id_from_window(const char* class_name, const
 
 void patch_iw5(const uint32_t pid)
 {
-	insert_nop(pid, 0x4488A8, 2); // Force calling CG_DrawFriendOrFoeTargetBoxes
-	insert_nop(pid, 0x47F6C7, 2); // Ignore blind-eye perks
-	//insert_nop(driver_device, pid, 0x44894C, 2); // Miniconsole
+	patch_batch batch{};
+
+	batch.insert_nop(0x4488A8, 2); // Force calling CG_DrawFriendOrFoeTargetBoxes
+	batch.insert_nop(0x47F6C7, 2); // Ignore blind-eye perks
+	//batch.insert_nop(0x44894C, 2); // Miniconsole
 
 	// Always full alpha
 	constexpr uint8_t data1[] = {0xD9, 0xE8, 0xC3};
-	patch_data(pid, 0x47F0D0, data1, sizeof(data1));
+	batch.patch_data(0x47F0D0, data1, sizeof(data1));
 
 	// Compass show enemies
 	constexpr uint8_t data2[] = {0xEB, 0x13};
-	patch_data(pid, 0x4437A8, data2, sizeof(data2));
+	batch.patch_data(0x4437A8, data2, sizeof(data2));
 
 	// Enemy arrows
 	constexpr uint8_t data3[] = {0xEB};
-	patch_data(pid, 0x443A2A, data3, sizeof(data3));
-	patch_data(pid, 0x443978, data3, sizeof(data3));
+	batch.patch_data(0x443A2A, data3, sizeof(data3));
+	batch.patch_data(0x443978, data3, sizeof(data3));
+
+	if (!batch.apply(pid))
+	{
+		printf("Not all IW5 patches were applied\n");
+	}
 }
 
 void try_patch_iw5()
@@ -69,20 +92,27 @@ void try_patch_iw5()
 
 void patch_t6(const uint32_t pid)
 {
+	patch_batch batch{};
+
 	// Force calling SatellitePingEnemyPlayer
-	insert_nop(pid, 0x7993B1, 2);
-	insert_nop(pid, 0x7993C1, 2);
+	batch.insert_nop(0x7993B1, 2);
+	batch.insert_nop(0x7993C1, 2);
 
 	// Better vsat updates
-	insert_nop(pid, 0x41D06C, 2); // No time check
-	insert_nop(pid, 0x41D092, 2); // No perk check
-	insert_nop(pid, 0x41D0BB, 2); // No fadeout
+	batch.insert_nop(0x41D06C, 2); // No time check
+	batch.insert_nop(0x41D092, 2); // No perk check
+	batch.insert_nop(0x41D0BB, 2); // No fadeout
 
 	// Enable chopper boxes
-	insert_nop(pid, 0x7B539C, 6); // ShouldDrawPlayerTargetHighlights
-	insert_nop(pid, 0x7B53AE, 6); // Enable chopper boxes
-	insert_nop(pid, 0x7B5461, 6); // Ignore player not visible
-	insert_nop(pid, 0x7B5471, 6); // Ignore blind-eye perks
+	batch.insert_nop(0x7B539C, 6); // ShouldDrawPlayerTargetHighlights
+	batch.insert_nop(0x7B53AE, 6); // Enable chopper boxes
+	batch.insert_nop(0x7B5461, 6); // Ignore player not visible
+	batch.insert_nop(0x7B5471, 6); // Ignore blind-eye perks
+
+	if (!batch.apply(pid))
+	{
+		printf("Not all T6 patches were applied\n");
+	}
 }
 
 void try_patch_t6()
@@ -100,14 +130,136 @@ void try_patch_t6()
 	}
 }
 
+template <typename F>
+double measure_microseconds(const size_t iterations, F&& callback)
+{
+	LARGE_INTEGER frequency{};
+	LARGE_INTEGER start{};
+	LARGE_INTEGER end{};
+
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&start);
+
+	for (size_t i = 0; i < iterations; ++i)
+	{
+		callback();
+	}
 
-int safe_main(const int /*argc*/, char* /*argv*/[])
+	QueryPerformanceCounter(&end);
+
+	const auto elapsed = static_cast<double>(end.QuadPart - start.QuadPart) * 1000000.0;
+	return elapsed / static_cast<double>(frequency.QuadPart) / static_cast<double>(iterations);
+}
+
+void run_bench(const size_t iterations)
+{
+	printf("Measuring %zu round trips per path...\n", iterations);
+
+	hyperhook_stats stats{};
+	if (!hyperhook_get_stats_via_hypercall(&stats))
+	{
+		throw std::runtime_error("Hypercall session unavailable");
+	}
+
+	const auto ioctl_time = measure_microseconds(iterations, [&]
+	{
+		(void)hyperhook_get_stats(&stats);
+	});
+
+	const auto hypercall_time = measure_microseconds(iterations, [&]
+	{
+		(void)hyperhook_get_stats_via_hypercall(&stats);
+	});
+
+	hyperhook_hypercall pings[64]{};
+	for (auto& ping : pings)
+	{
+		ping.command = HYPERHOOK_HYPERCALL_PING;
+	}
+
+	const auto batch_time = measure_microseconds(iterations, [&]
+	{
+		(void)hyperhook_execute_hypercalls(pings, static_cast<unsigned int>(std::size(pings)));
+	});
+
+	printf("Stats via IOCTL:      %.3f us\n", ioctl_time);
+	printf("Stats via VMCALL:     %.3f us\n", hypercall_time);
+	printf("%zu pings via VMCALL: %.3f us\n", std::size(pings), batch_time);
+
+	(void)hyperhook_close_hypercall_session();
+}
+
+const char* get_ept_entry_type_name(const unsigned int type)
+{
+	switch (type)
+	{
+	case HYPERHOOK_EPT_ENTRY_HOOK:
+		return "hook";
+	case HYPERHOOK_EPT_ENTRY_SPLIT:
+		return "split";
+	case HYPERHOOK_EPT_ENTRY_WATCH_POINT:
+		return "watch";
+	default:
+		return "unknown";
+	}
+}
+
+// Prints everything the driver holds, the entries with the most transitions first
+void list_ept_entries()
+{
+	std::vector<hyperhook_ept_entry> entries{};
+	hyperhook_ept_counts counts{};
+	unsigned long long cursor = 0;
+
+	while (true)
+	{
+		hyperhook_ept_entry buffer[256]{};
+		const auto count = hyperhook_enumerate_ept_entries(&cursor, buffer, std::size(buffer), &counts);
+		if (!count)
+		{
+			break;
+		}
+
+		entries.insert(entries.end(), buffer, buffer + count);
+	}
+
+	std::sort(entries.begin(), entries.end(), [](const hyperhook_ept_entry& a, const hyperhook_ept_entry& b)
+	{
+		return a.execute_transitions + a.data_transitions > b.execute_transitions + b.data_transitions;
+	});
+
+	printf("%llu hooks, %llu splits, %llu watch points\n", counts.hooks, counts.splits, counts.watch_points);
+	printf("%-6s %-18s %-8s %-8s %-8s %-14s %-14s %s\n", "Type", "Physical", "Source", "Target", "Patches",
+	       "Exec", "Data", "Last hit TSC");
+
+	for (const auto& entry : entries)
+	{
+		printf("%-6s %016llX   %-8u %-8u %-8u %-14llu %-14llu %llu\n", get_ept_entry_type_name(entry.type),
+		       entry.physical_address, entry.source_pid, entry.target_pid, entry.patch_count,
+		       entry.execute_transitions, entry.data_transitions, entry.last_hit_tsc);
+	}
+}
+
+int safe_main(const int argc, char* argv[])
 {
 	if (hyperhook_initialize() == 0)
 	{
 		throw std::runtime_error("Failed to initialize HyperHook");
 	}
 
+	if (argc > 1 && argv[1] == std::string_view("bench"))
+	{
+		const auto iterations = argc > 2 ? strtoull(argv[2], nullptr, 10) : 10000;
+		run_bench(max(iterations, 1ull));
+		return 0;
+	}
+
+	if (argc > 1 && argv[1] == std::string_view("list"))
+	{
+		list_ept_entries();
+		return 0;
+	}
+
 	while (true)
 	{
 		try_patch_iw5();
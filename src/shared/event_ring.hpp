@@ -0,0 +1,157 @@
+#pragma once
+
+#include <intrin.h>
+
+// Ring written by exactly one producer in overwrite mode. The consumer only has a
+// read-only view, so it keeps its own position and detects entries that were
+// overwritten while it was reading them through the per-entry sequence.
+struct event_ring_header
+{
+	volatile uint64_t head{};
+	uint64_t capacity{};
+	uint64_t entry_size{};
+	uint64_t entry_offset{};
+	volatile uint64_t dropped{};
+	uint32_t processor{};
+};
+
+namespace event_ring
+{
+	template <typename Entry>
+	constexpr uint64_t get_entry_offset()
+	{
+		return (sizeof(event_ring_header) + 63) & ~63ull;
+	}
+
+	template <typename Entry>
+	constexpr uint64_t get_capacity(const uint64_t size)
+	{
+		auto capacity = 1ull;
+		while (get_entry_offset<Entry>() + capacity * 2 * sizeof(Entry) <= size)
+		{
+			capacity *= 2;
+		}
+
+		return capacity;
+	}
+
+	template <typename Entry>
+	void initialize(event_ring_header& header, const uint64_t size, const uint32_t processor)
+	{
+		header.head = 0;
+		header.capacity = get_capacity<Entry>(size);
+		header.entry_size = sizeof(Entry);
+		header.entry_offset = get_entry_offset<Entry>();
+		header.dropped = 0;
+		header.processor = processor;
+	}
+
+	template <typename Entry>
+	Entry* get_entries(const event_ring_header& header)
+	{
+		return reinterpret_cast<Entry*>(reinterpret_cast<uint64_t>(&header) + header.entry_offset);
+	}
+
+	// Entry types start with a volatile uint64_t sequence, which is zero while the slot is written
+	template <typename Entry>
+	void push(event_ring_header& header, const Entry& value)
+	{
+		const auto index = header.head;
+		auto& entry = get_entries<Entry>(header)[index & (header.capacity - 1)];
+
+		entry.sequence = 0;
+		_ReadWriteBarrier();
+
+		auto copy = value;
+		copy.sequence = 0;
+		memcpy(const_cast<Entry*>(&entry), &copy, sizeof(copy));
+
+		_ReadWriteBarrier();
+		entry.sequence = index + 1;
+		_ReadWriteBarrier();
+
+		header.head = index + 1;
+	}
+
+	template <typename Entry>
+	class reader
+	{
+	public:
+		reader() = default;
+
+		reader(const event_ring_header* header)
+			: header_(header)
+			  , position_(header ? header->head : 0)
+		{
+		}
+
+		operator bool() const
+		{
+			return this->header_ != nullptr;
+		}
+
+		size_t read(Entry* entries, const size_t count)
+		{
+			if (!this->header_)
+			{
+				return 0;
+			}
+
+			const auto& header = *this->header_;
+			const auto* ring = get_entries<Entry>(header);
+
+			size_t read_count = 0;
+			while (read_count < count)
+			{
+				const auto head = header.head;
+				_ReadWriteBarrier();
+
+				if (this->position_ >= head)
+				{
+					break;
+				}
+
+				if (head - this->position_ > header.capacity)
+				{
+					this->lost_ += head - this->position_ - header.capacity;
+					this->position_ = head - header.capacity;
+				}
+
+				const auto expected_sequence = this->position_ + 1;
+				const auto& slot = ring[this->position_ & (header.capacity - 1)];
+
+				const auto sequence_before = slot.sequence;
+				_ReadWriteBarrier();
+
+				auto& entry = entries[read_count];
+				memcpy(&entry, const_cast<const Entry*>(&slot), sizeof(entry));
+
+				_ReadWriteBarrier();
+				const auto sequence_after = slot.sequence;
+
+				++this->position_;
+
+				if (sequence_before != expected_sequence || sequence_after != expected_sequence)
+				{
+					++this->lost_;
+					continue;
+				}
+
+				++read_count;
+			}
+
+			return read_count;
+		}
+
+		// Entries overwritten before they could be read, plus those the producer could not record
+		uint64_t get_lost() const
+		{
+			return this->lost_ + (this->header_ ? this->header_->dropped : 0);
+		}
+
+	private:
+		const event_ring_header* header_{nullptr};
+		uint64_t position_{0};
+		uint64_t lost_{0};
+	};
+}
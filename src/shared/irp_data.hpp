@@ -1,9 +1,25 @@
 #pragma once
 
+#include "event_ring.hpp"
+
 #define HOOK_DRV_IOCTL CTL_CODE(FILE_DEVICE_UNKNOWN, 0x800, METHOD_NEITHER, FILE_ANY_ACCESS)
 #define UNHOOK_DRV_IOCTL CTL_CODE(FILE_DEVICE_UNKNOWN, 0x801, METHOD_NEITHER, FILE_ANY_ACCESS)
 #define WATCH_DRV_IOCTL CTL_CODE(FILE_DEVICE_UNKNOWN, 0x802, METHOD_NEITHER, FILE_ANY_ACCESS)
 #define GET_RECORDS_DRV_IOCTL CTL_CODE(FILE_DEVICE_UNKNOWN, 0x803, METHOD_NEITHER, FILE_ANY_ACCESS)
+#define SYSCALL_FILTER_DRV_IOCTL CTL_CODE(FILE_DEVICE_UNKNOWN, 0x804, METHOD_NEITHER, FILE_ANY_ACCESS)
+#define MAP_SYSCALL_EVENTS_DRV_IOCTL CTL_CODE(FILE_DEVICE_UNKNOWN, 0x805, METHOD_NEITHER, FILE_ANY_ACCESS)
+#define UNMAP_SYSCALL_EVENTS_DRV_IOCTL CTL_CODE(FILE_DEVICE_UNKNOWN, 0x806, METHOD_NEITHER, FILE_ANY_ACCESS)
+#define GET_STATS_DRV_IOCTL CTL_CODE(FILE_DEVICE_UNKNOWN, 0x807, METHOD_NEITHER, FILE_ANY_ACCESS)
+#define GET_BRINGUP_REPORT_DRV_IOCTL CTL_CODE(FILE_DEVICE_UNKNOWN, 0x808, METHOD_NEITHER, FILE_ANY_ACCESS)
+#define OPEN_HYPERCALL_SESSION_DRV_IOCTL CTL_CODE(FILE_DEVICE_UNKNOWN, 0x809, METHOD_NEITHER, FILE_ANY_ACCESS)
+#define CLOSE_HYPERCALL_SESSION_DRV_IOCTL CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80A, METHOD_NEITHER, FILE_ANY_ACCESS)
+#define HOOK_BATCH_DRV_IOCTL CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80B, METHOD_NEITHER, FILE_ANY_ACCESS)
+#define HOOK_PAYLOAD_DRV_IOCTL CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80C, METHOD_IN_DIRECT, FILE_ANY_ACCESS)
+#define READ_ACCESS_RECORDS_DRV_IOCTL CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80D, METHOD_NEITHER, FILE_ANY_ACCESS)
+#define MAP_ACCESS_EVENTS_DRV_IOCTL CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80E, METHOD_NEITHER, FILE_ANY_ACCESS)
+#define UNMAP_ACCESS_EVENTS_DRV_IOCTL CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80F, METHOD_NEITHER, FILE_ANY_ACCESS)
+#define ENUMERATE_EPT_ENTRIES_DRV_IOCTL CTL_CODE(FILE_DEVICE_UNKNOWN, 0x810, METHOD_NEITHER, FILE_ANY_ACCESS)
+#define UPDATE_HOOK_DRV_IOCTL CTL_CODE(FILE_DEVICE_UNKNOWN, 0x811, METHOD_NEITHER, FILE_ANY_ACCESS)
 
 static_assert(sizeof(void*) == 8);
 
@@ -15,6 +31,91 @@ struct hook_request
 	uint64_t source_data_size{};
 };
 
+constexpr uint32_t hook_batch_version = 2;
+constexpr uint64_t max_hook_batch_regions = 4096;
+constexpr uint64_t max_hook_batch_data_size = 16 * 1024 * 1024;
+
+struct hook_region
+{
+	const void* target_address{};
+	const void* source_data{};
+	uint64_t source_data_size{};
+};
+
+// All regions target the same process. The optional output receives a hook_batch_result.
+// Handles is optional and receives one handle per region, zero for regions that were not installed.
+struct hook_batch_request
+{
+	uint32_t version{hook_batch_version};
+	uint32_t process_id{};
+	const hook_region* regions{};
+	uint64_t region_count{};
+	uint64_t* handles{};
+};
+
+struct hook_batch_result
+{
+	uint64_t installed_region_count{};
+};
+
+struct payload_region
+{
+	const void* target_address{};
+	uint64_t payload_offset{};
+	uint64_t size{};
+};
+
+// The input holds this header followed by region_count payload_region entries. The payload is passed as
+// the output buffer, which the I/O manager locks and describes with an MDL, so it is never copied.
+// The number of returned bytes carries the number of installed regions.
+struct hook_payload_request
+{
+	uint32_t version{hook_batch_version};
+	uint32_t process_id{};
+	uint64_t region_count{};
+	uint64_t* handles{};
+};
+
+constexpr uint32_t unhook_version = 1;
+constexpr uint64_t max_unhook_handles = 64 * 1024;
+
+enum class unhook_type : uint32_t
+{
+	all,
+	handles,
+	range,
+	process,
+};
+
+// Without an input, UNHOOK_DRV_IOCTL removes every hook. The optional output receives an unhook_result.
+struct unhook_request
+{
+	uint32_t version{unhook_version};
+	unhook_type type{};
+
+	// For ranges the target process, zero matches any. Otherwise the process that installed or is targeted by hooks.
+	uint32_t process_id{};
+
+	const uint64_t* handles{};
+	uint64_t handle_count{};
+
+	const void* range_start{};
+	uint64_t range_length{};
+};
+
+struct unhook_result
+{
+	uint64_t removed_patch_count{};
+};
+
+// Replaces all bytes of an installed hook within one page, so the data must be as large as the original write
+struct update_hook_request
+{
+	uint64_t handle{};
+	const void* data{};
+	uint64_t data_size{};
+};
+
 struct watch_region
 {
 	const void* virtual_address{};
@@ -27,3 +128,195 @@ struct watch_request
 	const watch_region* watch_regions{};
 	uint64_t watch_region_count{};
 };
+
+// Sequence numbers start at 1 and never repeat
+struct access_record
+{
+	uint64_t sequence{};
+	uint64_t rip{};
+};
+
+// The cursor is the sequence of the last record the client has seen, zero starts at the oldest one
+struct access_record_request
+{
+	uint64_t cursor{};
+};
+
+// Followed by record_count access_record entries in the output buffer
+struct access_record_header
+{
+	uint64_t next_cursor{};
+	uint64_t record_count{};
+	uint64_t lost_count{};
+};
+
+enum class ept_entry_type : uint32_t
+{
+	hook,
+	split,
+	watch_point,
+};
+
+// Splits carry the base of the 2 MB page and have no owners or hits
+struct ept_entry_descriptor
+{
+	ept_entry_type type{};
+	uint32_t source_pid{};
+	uint32_t target_pid{};
+	uint32_t patch_count{};
+	uint64_t physical_address{};
+	uint64_t execute_transitions{};
+	uint64_t data_transitions{};
+	uint64_t last_hit_tsc{};
+};
+
+constexpr uint64_t max_ept_entries_per_request = 1024;
+
+// The cursor is the index of the first entry, it stays valid as long as no hook or watch point changes
+struct ept_entry_request
+{
+	uint64_t cursor{};
+};
+
+// Followed by entry_count ept_entry_descriptor entries in the output buffer
+struct ept_entry_header
+{
+	uint64_t next_cursor{};
+	uint64_t entry_count{};
+	uint64_t hook_count{};
+	uint64_t split_count{};
+	uint64_t watch_point_count{};
+};
+
+constexpr uint32_t syscall_filter_max_syscalls = 0x2000;
+
+enum class syscall_filter_operation : uint32_t
+{
+	set,
+	remove,
+	clear,
+};
+
+struct syscall_filter_request
+{
+	syscall_filter_operation operation{};
+	uint32_t process_id{};
+	uint64_t syscall_bitmap[syscall_filter_max_syscalls / 64]{};
+};
+
+constexpr uint32_t max_event_rings = 256;
+
+struct syscall_event
+{
+	volatile uint64_t sequence{};
+	uint64_t tsc{};
+	uint64_t cr3{};
+	uint64_t syscall_number{};
+	uint64_t arguments[4]{};
+	uint32_t process_id{};
+	uint32_t processor{};
+};
+
+struct syscall_event_mapping
+{
+	uint32_t ring_count{};
+	uint64_t ring_size{};
+	const event_ring_header* rings[max_event_rings]{};
+};
+
+// Watch point records, pushed to the ring of the core that hit the watch point
+struct access_event
+{
+	volatile uint64_t sequence{};
+	uint64_t record_sequence{};
+	uint64_t rip{};
+	uint64_t tsc{};
+};
+
+// The event is set once a ring holds watermark entries that were not signalled yet, at most once per
+// interval. Fewer entries are signalled after they waited for a full interval. Zero picks the defaults.
+struct access_event_mapping_request
+{
+	uint64_t event_handle{};
+	uint32_t watermark{};
+	uint32_t interval_ms{};
+};
+
+struct access_event_mapping
+{
+	uint32_t ring_count{};
+	uint64_t ring_size{};
+	const event_ring_header* rings[max_event_rings]{};
+};
+
+// Summed over all cores
+struct hypervisor_stats
+{
+	uint32_t core_count{};
+	uint64_t cpuid_exits{};
+	uint64_t cpuid_cache_hits{};
+	uint64_t cpuid_cache_misses{};
+	uint64_t cpuid_cycles{};
+	uint64_t exits{};
+	uint64_t exit_cycles{};
+
+	// Every copy of hook data, from user buffers into the driver and from there into fake pages
+	uint64_t payload_copies{};
+	uint64_t payload_bytes_copied{};
+};
+
+// Phase durations are in TSC cycles
+struct core_bringup_report
+{
+	uint32_t processor{};
+	uint32_t node{};
+	uint32_t succeeded{};
+	uint64_t ept_build_cycles{};
+	uint64_t msr_capture_cycles{};
+	uint64_t vmxon_cycles{};
+	uint64_t vmcs_setup_cycles{};
+	uint64_t launch_cycles{};
+	uint64_t total_cycles{};
+	char error[64]{};
+};
+
+// Followed by core_count core_bringup_report entries, as many as fit into the output buffer
+struct bringup_report_header
+{
+	uint32_t core_count{};
+	uint64_t total_microseconds{};
+};
+
+// VMCALL with RCX = hypercall_session_magic, RDX = session key and R8 = command count.
+// The commands are taken from the start of the session ring, RAX returns how many were processed.
+constexpr uint64_t hypercall_session_magic = 0x4859504552434C4C;
+
+// Only root-safe commands. Changing a hook allocates memory or swaps EPT entries that every core has to
+// flush before the previous page can be reused, so hooks stay on the IOCTL path.
+enum class hypercall_command_type : uint32_t
+{
+	ping,
+	query_stats,
+};
+
+enum class hypercall_status : int32_t
+{
+	success = 0,
+	invalid_command = -1,
+	unavailable = -2,
+};
+
+struct hypercall_command
+{
+	hypercall_command_type type{};
+	hypercall_status status{};
+	uint64_t arguments[4]{};
+	uint64_t results[10]{};
+};
+
+struct hypercall_session
+{
+	uint64_t key{};
+	hypercall_command* commands{};
+	uint32_t command_capacity{};
+};
@@ -0,0 +1,192 @@
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <chrono>
+
+#include "../driver/exit_dispatch.hpp"
+
+namespace vmx
+{
+	// The dispatch header only declares these, so the test defines them with what the stubs need
+	class guest_context
+	{
+	public:
+		uint32_t exit_reason{};
+		uint64_t handled_reasons{};
+	};
+
+	struct state
+	{
+		size_t calls{};
+	};
+}
+
+namespace
+{
+	size_t failures = 0;
+
+#define EXPECT(condition) \
+	do \
+	{ \
+		if (!(condition)) \
+		{ \
+			printf("%s:%d: Expectation failed: %s\n", __FILE__, __LINE__, #condition); \
+			++failures; \
+		} \
+	} \
+	while (false)
+
+	constexpr uint32_t cpuid_reason = 10;
+	constexpr uint32_t ept_violation_reason = 48;
+	constexpr uint32_t first_group_reason = 19;
+	constexpr uint32_t last_group_reason = 27;
+
+	void handle_cpuid(vmx::guest_context& guest_context, vmx::state& vm_state)
+	{
+		guest_context.handled_reasons += guest_context.exit_reason;
+		++vm_state.calls;
+	}
+
+	void handle_ept_violation(vmx::guest_context& guest_context, vmx::state& vm_state)
+	{
+		guest_context.handled_reasons += guest_context.exit_reason * 2;
+		++vm_state.calls;
+	}
+
+	void handle_group(vmx::guest_context& guest_context, vmx::state& vm_state)
+	{
+		guest_context.handled_reasons += 1000;
+		++vm_state.calls;
+	}
+
+	template <uint32_t ExitReason>
+	struct stub_registry : vmx::exit_handler<ExitReason>
+	{
+	};
+
+	template <>
+	struct stub_registry<cpuid_reason> : vmx::exit_handler_registration<handle_cpuid>
+	{
+	};
+
+	template <>
+	struct stub_registry<ept_violation_reason>
+		: vmx::exit_handler_registration<handle_ept_violation, vmx::exit_flag_needs_exit_qualification |
+		                                 vmx::exit_flag_needs_guest_physical_address>
+	{
+	};
+
+	template <uint32_t ExitReason>
+		requires(ExitReason >= first_group_reason && ExitReason <= last_group_reason)
+	struct stub_registry<ExitReason> : vmx::exit_handler_registration<handle_group, vmx::exit_flag_needs_guest_rip>
+	{
+	};
+
+	constexpr auto stub_table = vmx::make_exit_handler_table<stub_registry>();
+
+	// The table is built at compile time
+	static_assert(stub_table[cpuid_reason].handler == handle_cpuid);
+	static_assert(stub_table[vmx::exit_reason_count].handler == nullptr);
+
+	void dispatch(const vmx::exit_handler_table& table, vmx::guest_context& guest_context, vmx::state& vm_state)
+	{
+		const auto& entry = table[guest_context.exit_reason];
+		if (entry.handler)
+		{
+			entry.handler(guest_context, vm_state);
+		}
+	}
+
+	void test_flags()
+	{
+		EXPECT(stub_table[cpuid_reason].flags == vmx::exit_flag_advances_rip);
+		EXPECT(stub_table[ept_violation_reason].flags == (vmx::exit_flag_needs_exit_qualification |
+			vmx::exit_flag_needs_guest_physical_address));
+
+		for (auto reason = first_group_reason; reason <= last_group_reason; ++reason)
+		{
+			EXPECT(stub_table[reason].handler == handle_group);
+			EXPECT(stub_table[reason].flags == vmx::exit_flag_needs_guest_rip);
+		}
+
+		// Unregistered and out of range reasons only advance RIP
+		EXPECT(stub_table[0].handler == nullptr);
+		EXPECT(stub_table[0].flags == vmx::exit_flag_advances_rip);
+		EXPECT(stub_table[last_group_reason + 1].handler == nullptr);
+		EXPECT(stub_table[0xFFFF].handler == nullptr);
+		EXPECT(stub_table[0xFFFF].flags == vmx::exit_flag_advances_rip);
+	}
+
+	void test_dispatch()
+	{
+		vmx::state vm_state{};
+		vmx::guest_context guest_context{};
+
+		guest_context.exit_reason = cpuid_reason;
+		dispatch(stub_table, guest_context, vm_state);
+		EXPECT(guest_context.handled_reasons == cpuid_reason);
+
+		guest_context.exit_reason = ept_violation_reason;
+		dispatch(stub_table, guest_context, vm_state);
+		EXPECT(guest_context.handled_reasons == cpuid_reason + ept_violation_reason * 2);
+
+		guest_context.exit_reason = first_group_reason + 3;
+		dispatch(stub_table, guest_context, vm_state);
+		EXPECT(guest_context.handled_reasons == cpuid_reason + ept_violation_reason * 2 + 1000);
+
+		guest_context.exit_reason = 1;
+		dispatch(stub_table, guest_context, vm_state);
+		guest_context.exit_reason = vmx::exit_reason_count + 5;
+		dispatch(stub_table, guest_context, vm_state);
+
+		EXPECT(vm_state.calls == 3);
+	}
+
+	void time_lookups()
+	{
+		constexpr size_t lookup_count = 10'000'000;
+
+		vmx::state vm_state{};
+		vmx::guest_context guest_context{};
+
+		// A cheap LCG spreads the reasons, so the lookups do not all hit one entry
+		uint32_t seed = 1;
+		uint64_t flags = 0;
+
+		const auto start = std::chrono::steady_clock::now();
+
+		for (size_t i = 0; i < lookup_count; ++i)
+		{
+			seed = seed * 1664525 + 1013904223;
+			guest_context.exit_reason = (seed >> 16) % (vmx::exit_reason_count + 8);
+
+			flags += stub_table[guest_context.exit_reason].flags;
+			dispatch(stub_table, guest_context, vm_state);
+		}
+
+		const auto elapsed = std::chrono::steady_clock::now() - start;
+		const auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+
+		EXPECT(flags != 0 && vm_state.calls != 0);
+
+		printf("%zu lookups and dispatches in %lld us, %.2f ns each\n", lookup_count,
+		       static_cast<long long>(nanoseconds / 1000),
+		       static_cast<double>(nanoseconds) / static_cast<double>(lookup_count));
+	}
+}
+
+int main()
+{
+	test_flags();
+	test_dispatch();
+	time_lookups();
+
+	if (failures)
+	{
+		printf("%zu expectations failed\n", failures);
+		return 1;
+	}
+
+	printf("All exit dispatch tests passed\n");
+	return 0;
+}
@@ -0,0 +1,171 @@
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <unordered_map>
+
+#include "../driver/paging.hpp"
+
+namespace
+{
+	size_t failures = 0;
+
+#define EXPECT(condition) \
+	do \
+	{ \
+		if (!(condition)) \
+		{ \
+			printf("%s:%d: Expectation failed: %s\n", __FILE__, __LINE__, #condition); \
+			++failures; \
+		} \
+	} \
+	while (false)
+
+	constexpr uint64_t present_writable = paging::entry_present | paging::entry_writable | paging::entry_user;
+
+	// Synthetic physical memory that only holds page table entries, everything else reads as zero
+	class physical_memory
+	{
+	public:
+		void set_entry(const uint64_t table, const uint64_t virtual_address, const uint32_t level,
+		               const uint64_t value)
+		{
+			const auto shift = 12 + 9 * (level - 1);
+			this->entries_[table + ((virtual_address >> shift) & 0x1FF) * sizeof(uint64_t)] = value;
+		}
+
+		auto get_reader()
+		{
+			return [this](const uint64_t physical_address, uint64_t& entry)
+			{
+				if (physical_address == this->failing_address_)
+				{
+					return false;
+				}
+
+				const auto value = this->entries_.find(physical_address);
+				entry = value == this->entries_.end() ? 0 : value->second;
+				return true;
+			};
+		}
+
+		void fail_reads_at(const uint64_t physical_address)
+		{
+			this->failing_address_ = physical_address;
+		}
+
+	private:
+		std::unordered_map<uint64_t, uint64_t> entries_{};
+		uint64_t failing_address_{~0ull};
+	};
+
+	constexpr uint64_t cr3 = 0x1000;
+	constexpr uint64_t virtual_address = 0x00007FF6'12345ABCull;
+
+	// PML4 at 0x1000, PDPT at 0x2000, PD at 0x3000 and PT at 0x4000
+	void map_4kb_page(physical_memory& memory, const uint64_t address, const uint64_t page)
+	{
+		memory.set_entry(0x1000, address, 4, 0x2000 | present_writable);
+		memory.set_entry(0x2000, address, 3, 0x3000 | present_writable);
+		memory.set_entry(0x3000, address, 2, 0x4000 | present_writable);
+		memory.set_entry(0x4000, address, 1, page | present_writable);
+	}
+
+	void test_four_level_walk()
+	{
+		physical_memory memory{};
+		map_4kb_page(memory, virtual_address, 0x7000);
+
+		paging::translation translation{};
+		EXPECT(paging::translate(memory.get_reader(), cr3, virtual_address, false, translation));
+		EXPECT(translation.physical_address == 0x7ABC);
+		EXPECT(translation.size == paging::page_size::size_4kb);
+		EXPECT(translation.entry_count == 4);
+		EXPECT(translation.writable && translation.user && translation.executable);
+
+		// Permissions are the intersection of every level
+		memory.set_entry(0x3000, virtual_address, 2, 0x4000 | paging::entry_present | paging::entry_user |
+		                 paging::entry_execute_disable);
+		EXPECT(paging::translate(memory.get_reader(), cr3, virtual_address, false, translation));
+		EXPECT(!translation.writable && translation.user && !translation.executable);
+	}
+
+	void test_five_level_walk()
+	{
+		constexpr uint64_t address = 0x00AB0000'12345678ull;
+
+		physical_memory memory{};
+		memory.set_entry(0x1000, address, 5, 0x8000 | present_writable);
+		memory.set_entry(0x8000, address, 4, 0x2000 | present_writable);
+		memory.set_entry(0x2000, address, 3, 0x3000 | present_writable);
+		memory.set_entry(0x3000, address, 2, 0x4000 | present_writable);
+		memory.set_entry(0x4000, address, 1, 0x9000 | present_writable);
+
+		paging::translation translation{};
+		EXPECT(paging::translate(memory.get_reader(), cr3, address, true, translation));
+		EXPECT(translation.physical_address == 0x9678);
+		EXPECT(translation.entry_count == 5);
+
+		// The address is not canonical with four levels
+		EXPECT(!paging::translate(memory.get_reader(), cr3, address, false, translation));
+	}
+
+	void test_large_pages()
+	{
+		physical_memory memory{};
+		memory.set_entry(0x1000, virtual_address, 4, 0x2000 | present_writable);
+		memory.set_entry(0x2000, virtual_address, 3, 0x3000 | present_writable);
+		memory.set_entry(0x3000, virtual_address, 2, 0x40000000 | present_writable | paging::entry_large_page);
+
+		paging::translation translation{};
+		EXPECT(paging::translate(memory.get_reader(), cr3, virtual_address, false, translation));
+		EXPECT(translation.size == paging::page_size::size_2mb);
+		EXPECT(translation.physical_address == (0x40000000 | (virtual_address & ((1ull << 21) - 1))));
+		EXPECT(translation.entry_count == 3);
+
+		memory.set_entry(0x2000, virtual_address, 3, 0x80000000 | present_writable | paging::entry_large_page);
+		EXPECT(paging::translate(memory.get_reader(), cr3, virtual_address, false, translation));
+		EXPECT(translation.size == paging::page_size::size_1gb);
+		EXPECT(translation.physical_address == (0x80000000 | (virtual_address & ((1ull << 30) - 1))));
+		EXPECT(translation.entry_count == 2);
+	}
+
+	void test_non_present_entries()
+	{
+		paging::translation translation{};
+
+		for (uint32_t level = 1; level <= 4; ++level)
+		{
+			physical_memory memory{};
+			map_4kb_page(memory, virtual_address, 0x7000);
+
+			const uint64_t tables[] = {0x4000, 0x3000, 0x2000, 0x1000};
+			memory.set_entry(tables[level - 1], virtual_address, level, 0x5000 | paging::entry_writable);
+
+			EXPECT(!paging::translate(memory.get_reader(), cr3, virtual_address, false, translation));
+		}
+
+		physical_memory memory{};
+		map_4kb_page(memory, virtual_address, 0x7000);
+		memory.fail_reads_at(0x3000 + ((virtual_address >> 21) & 0x1FF) * sizeof(uint64_t));
+		EXPECT(!paging::translate(memory.get_reader(), cr3, virtual_address, false, translation));
+
+		EXPECT(!paging::translate(memory.get_reader(), cr3, 0x00008000'00000000ull, false, translation));
+	}
+}
+
+int main()
+{
+	test_four_level_walk();
+	test_five_level_walk();
+	test_large_pages();
+	test_non_present_entries();
+
+	if (failures)
+	{
+		printf("%zu expectations failed\n", failures);
+		return 1;
+	}
+
+	printf("All paging tests passed\n");
+	return 0;
+}